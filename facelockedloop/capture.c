@@ -7,6 +7,7 @@
  */
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #if defined(HAVE_OPENCV2)
@@ -14,7 +15,11 @@
 #endif
 
 #include "capture.h"
+#include "videofile.h"
+#include "jpegfile.h"
+#include "scene.h"
 #include "kernel_utils.h"
+#include "time_utils.h"
 #include "debug.h"
 
 static void capture_stage_up(struct stage *stg, struct stage_params *p,
@@ -24,6 +29,7 @@ static int capture_stage_run(struct stage *stg);
 static void capture_stage_wait(struct stage *stg);
 static void capture_stage_go(struct stage *stg);
 static int capture_stage_output(struct stage *stg, void* it);
+static void capture_stage_discard(struct stage *stg, void *it);
 
 static struct stage_ops capture_ops = {
 	.up = capture_stage_up, 
@@ -32,6 +38,7 @@ static struct stage_ops capture_ops = {
 	.wait = capture_stage_wait,
 	.go = capture_stage_go,
 	.output = capture_stage_output,
+	.discard = capture_stage_discard,
 };
 
 static void capture_stage_up(struct stage *stg, struct stage_params *p,
@@ -60,7 +67,7 @@ static int capture_stage_run(struct stage *stg)
 	if (!imgr)
 		return -EINVAL;
 	ret = capture_run(imgr);
-	stg->params.data_out = imgr->params.frame;
+	stg->params.data_out = imgr->params.current;
 	stg->stats.ofinterest = imgr->stats.tally;
 	
 	return ret;
@@ -78,40 +85,206 @@ static void capture_stage_go(struct stage *stg)
 
 static int capture_stage_output(struct stage *stg, void* it)
 {
-	return stage_output(stg, stg->params.data_out);
+	struct imager *imgr = container_of(stg, struct imager, step);
+	struct store_frame *f = it;
+	IplImage *image = f->image;
+	int n, ret;
+
+	/* one reference per consumer, taken before anyone can drop it */
+	n = stage_fanout(stg);
+	if (!n) {
+		store_frame_put(f);
+		return -EPIPE;
+	}
+	f->refs = n;
+	f->seq = imgr->params.seq;
+	f->camera = imgr->params.camera;
+	f->width = image->width * f->scale;
+	f->height = image->height * f->scale;
+
+	ret = stage_output(stg, f);
+	for (n = 0; n < ret; n++)
+		store_frame_put(f);	/* refused, drop those references */
+	if (ret)
+		return -EAGAIN;
+
+	/* only frames handed over get a number, so there are no gaps */
+	++(imgr->params.seq);
+	return 0;
+}
+
+/* a newer frame took its place before the consumer got to it */
+static void capture_stage_discard(struct stage *stg, void *it)
+{
+	store_frame_put(it);
 }
 
 
+/*
+ * For sources that are not paced by a device: waits for the next frame
+ * due at fps, without catching up on frames it fell behind on. fps 0
+ * does not wait.
+ */
+void capture_pace(struct timespec *due, int fps)
+{
+	unsigned long long period;
+	struct timespec now, step;
+
+	if (!fps)
+		return;
+
+	period = FLL_NANOSECONDS_IN_SECOND / fps;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_delta(due, &now) > period)
+		*due = now;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, due, NULL);
+	step.tv_sec = period / FLL_NANOSECONDS_IN_SECOND;
+	step.tv_nsec = period % FLL_NANOSECONDS_IN_SECOND;
+	timespec_add(due, &step);
+}
+
 #if HAVE_OPENCV2
 
+/* Y4M and raw files are mapped, JPEG ones decoded, scenes drawn */
+static const struct capture_source *capture_source_for(const char *path)
+{
+	if (scene_match(path))
+		return &scene_source;
+	if (jpegfile_match(path))
+		return &jpegfile_source;
+	return &videofile_source;
+}
+
+static int camera_open(struct imager *i)
+{
+	i->params.videocam = cvCreateCameraCapture(CV_CAP_ANY +
+						   i->params.vididx);
+	if (!(i->params.videocam))
+		return -ENODEV;
+	/* frames carry their size, the tracker works with any of them */
+	if (i->params.width && i->params.height) {
+		cvSetCaptureProperty(i->params.videocam,
+				     CV_CAP_PROP_FRAME_WIDTH,
+				     i->params.width);
+		cvSetCaptureProperty(i->params.videocam,
+				     CV_CAP_PROP_FRAME_HEIGHT,
+				     i->params.height);
+		printf("capture: cam%d asked for %dx%d, gives %.0fx%.0f.\n",
+		       i->params.vididx, i->params.width, i->params.height,
+		       cvGetCaptureProperty(i->params.videocam,
+					    CV_CAP_PROP_FRAME_WIDTH),
+		       cvGetCaptureProperty(i->params.videocam,
+					    CV_CAP_PROP_FRAME_HEIGHT));
+	}
+	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS,
+			     CAPTURE_DEFAULT_FPS);
+	return 0;
+}
+
+static int camera_grab(struct imager *i)
+{
+	return cvGrabFrame(i->params.videocam) ? 0 : -EIO;
+}
+
+static void *camera_retrieve(struct imager *i)
+{
+	return cvRetrieveFrame(i->params.videocam, i->params.frameidx);
+}
+
+/* the C API always hands out converted frames */
+static enum capture_format camera_format(struct imager *i)
+{
+	return CAPTURE_FORMAT_BGR;
+}
+
+static int camera_set_fps(struct imager *i, int fps)
+{
+	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS, fps);
+	return 0;
+}
+
+static void camera_close(struct imager *i)
+{
+	cvReleaseCapture(&i->params.videocam);
+}
+
+static const struct capture_source camera_source = {
+	.name = "camera",
+	.stable = 0,
+	.open = camera_open,
+	.grab = camera_grab,
+	.retrieve = camera_retrieve,
+	.format = camera_format,
+	.set_fps = camera_set_fps,
+	.close = camera_close,
+};
+
 int capture_initialize(struct imager *i, struct imager_params *p,
 		       struct pipeline *pipe)
 {
 	struct stage_params stgparams;
+	int n, ret;
 	
-	stgparams.nth_stage = CAPTURE_STAGE;
+	stgparams.nth_stage = 0;
 	stgparams.data_in = NULL;
+	stgparams.depth = 0;
+	stgparams.dispatch = STAGE_DISPATCH_ALL;
 	stgparams.data_out = NULL;
 	stgparams.name = "CAP_STG";
 
 	i->stats.tally = 0;
 	i->stats.fps = 0;
+	i->stats.nobuf = 0;
+	i->stats.skipped = 0;
+	i->rate.fps = CAPTURE_DEFAULT_FPS;
+	i->rate.applied_fps = CAPTURE_DEFAULT_FPS;
+	i->rate.cadence = 1;
+	i->rate.countdown = 0;
+	memset(&i->grab, 0, sizeof(i->grab));
+	/* grabbed frames need room of their own in the pool */
+	i->grab.enabled = p->grabber;
 	
 	i->params.name = p->name;
 	i->params.vididx = p->vididx;
+	i->params.camera = p->camera;
+	i->params.path = p->path;
+	i->params.source = p->path ? capture_source_for(p->path) :
+		&camera_source;
+	i->params.file = NULL;
+	i->params.jpeg = NULL;
+	i->params.scene = NULL;
+	i->params.min_face = p->min_face;
+	i->params.scale = 1;
+	i->params.width = p->width;
+	i->params.height = p->height;
+	i->params.videocam = NULL;
 	i->params.frame = p->frame;
 	i->params.frameidx = 0;
-	i->params.videocam = cvCreateCameraCapture(CV_CAP_ANY +
-						   i->params.vididx); 
-	if (!(i->params.videocam))
-		return -ENODEV;
+	i->params.npool = 0;
+	i->params.poolidx = 0;
+	i->params.seq = 0;
+	i->params.current = NULL;
+	i->params.live.refs = 0;
+	i->params.live.image = NULL;
+	timespec_zero(&i->params.live.stamp);
+	i->params.live.scale = 1;
+	for (n = 0; n < CAPTURE_POOL_SIZE; n++) {
+		i->params.pool[n].refs = 0;
+		i->params.pool[n].scale = 1;
+		i->params.pool[n].image = NULL;
+	}
+	ret = i->params.source->open(i);
+	if (ret)
+		return ret;
+	p->source = i->params.source;
 	p->videocam = i->params.videocam;
-#if 0
-	/*if webcam format changes it requires modifications to the servo algorithms */
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_WIDTH, 640.0);
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FRAME_HEIGHT, 480.0);
-#endif
-	cvSetCaptureProperty(i->params.videocam, CV_CAP_PROP_FPS, 30);
+	p->file = i->params.file;
+	p->jpeg = i->params.jpeg;
+	p->scene = i->params.scene;
+	p->scale = i->params.scale;
+	printf("capture: %s source, %s frames.\n", i->params.source->name,
+	       i->params.source->format(i) == CAPTURE_FORMAT_GRAY ?
+	       "luma" : "BGR");
 	debug(i, "display window is %s.\n", i->params.name);
 
 	//cvNamedWindow(p->name, CV_WINDOW_AUTOSIZE);
@@ -122,28 +295,335 @@ int capture_initialize(struct imager *i, struct imager_params *p,
 
 void capture_teardown(struct imager *i)
 {
+	IplImage *img;
+	int n;
+
 	cvDestroyWindow(i->params.name);
-	cvReleaseCapture(&i->params.videocam);
+	if (i->grab.running) {
+		__atomic_store_n(&i->grab.running, 0, __ATOMIC_RELEASE);
+		pthread_join(i->grab.thread, NULL);
+		handoff_destroy(&i->grab.ready);
+	}
+	i->grab.enabled = 0;
+	for (n = 0; n < CAPTURE_POOL_SIZE; n++) {
+		img = i->params.pool[n].image;
+		if (img && i->params.source->stable)
+			cvReleaseImageHeader(&img);
+		else if (img)
+			cvReleaseImage(&img);
+		i->params.pool[n].image = NULL;
+	}
+	i->params.source->close(i);
 }
 
-int capture_run(struct imager *i)
+/* a pool frame no consumer holds any more, NULL if all are busy */
+static struct store_frame *capture_slot(struct imager *i)
 {
+	struct store_frame *f = NULL;
+	int n, idx;
+
+	if (!i->params.npool) {
+		/*
+		 * each consumer: its queue plus the frame it works on, and
+		 * the one being grabbed; with a grabber, also the newest
+		 * and the one capture holds from its pick to its output
+		 */
+		for (n = 0; n < i->step.nout; n++)
+			i->params.npool += i->step.out[n]->q.depth + 1;
+		i->params.npool += 1 + 2 * i->grab.enabled;
+		if (i->params.npool > CAPTURE_POOL_SIZE)
+			i->params.npool = CAPTURE_POOL_SIZE;
+	}
+
+	for (n = 0; n < i->params.npool; n++) {
+		idx = (i->params.poolidx + n) % i->params.npool;
+		if (!store_frame_busy(&i->params.pool[idx])) {
+			f = &i->params.pool[idx];
+			i->params.poolidx = (idx + 1) % i->params.npool;
+			break;
+		}
+	}
+	if (!f)
+		++(i->stats.nobuf);
+	return f;
+}
+
+/*
+ * The frame returned by a camera is reused on the next grab; when stages
+ * overlap, hand a private copy downstream instead. Copies are recycled
+ * once every consumer has put them back.
+ */
+static struct store_frame *capture_keep(struct imager *i, IplImage *srcframe)
+{
+	struct store_frame *f = capture_slot(i);
+	IplImage *copy;
+
+	if (!f)
+		return NULL;
+
+	copy = f->image;
+	if (copy && (copy->width != srcframe->width ||
+		     copy->height != srcframe->height ||
+		     copy->nChannels != srcframe->nChannels)) {
+		cvReleaseImage(&copy);
+		f->image = NULL;
+	}
+
+	if (!f->image) {
+		debug(i, "allocate pool frame %d\n", (int)(f - i->params.pool));
+		f->image = cvCreateImage(cvSize(srcframe->width,
+						srcframe->height),
+					 srcframe->depth, srcframe->nChannels);
+		if (!f->image)
+			return NULL;
+	}
+	cvCopy(srcframe, f->image, NULL);
+
+	return f;
+}
+
+/*
+ * Frames of a stable source outlive the grab: the pool frame only gets
+ * a header of its own pointing at the pixels, no copy.
+ */
+static struct store_frame *capture_refer(struct imager *i, IplImage *srcframe)
+{
+	struct store_frame *f = capture_slot(i);
+	IplImage *hdr;
+
+	if (!f)
+		return NULL;
+
+	hdr = f->image;
+	if (hdr && (hdr->width != srcframe->width ||
+		    hdr->height != srcframe->height ||
+		    hdr->nChannels != srcframe->nChannels)) {
+		cvReleaseImageHeader(&hdr);
+		f->image = NULL;
+	}
+	if (!f->image) {
+		f->image = cvCreateImageHeader(cvSize(srcframe->width,
+						      srcframe->height),
+					       srcframe->depth,
+					       srcframe->nChannels);
+		if (!f->image)
+			return NULL;
+	}
+	cvSetData(f->image, srcframe->imageData, srcframe->widthStep);
+
+	return f;
+}
+
+static struct store_frame *capture_hold(struct imager *i, IplImage *srcframe)
+{
+	if (i->params.source->stable)
+		return capture_refer(i, srcframe);
+	return capture_keep(i, srcframe);
+}
+
+/*
+ * Before the first pipeline_run(): a frame grabbed to learn its size is
+ * copied into every pool frame, so none is allocated later. Returns the
+ * frame, for the detectors to warm up on.
+ */
+void *capture_prepare(struct imager *i)
+{
+	struct store_frame *f;
 	IplImage *srcframe;
-	
-	if (i->params.vididx < 0)
+	int n;
+
+	if (!i->params.source || i->params.source->grab(i))
+		return NULL;
+	srcframe = i->params.source->retrieve(i);
+	if (!srcframe)
+		return NULL;
+	if (i->step.pipeline->mode != PIPELINE_OVERLAPPED)
+		return srcframe;
+
+	/* the first one sizes the pool, each one moves on to the next */
+	f = capture_hold(i, srcframe);
+	for (n = 1; f && n < i->params.npool; n++)
+		f = capture_hold(i, srcframe);
+
+	return f ? srcframe : NULL;
+}
+
+static void capture_apply_fps(struct imager *i)
+{
+	int fps = __atomic_load_n(&i->rate.fps, __ATOMIC_RELAXED);
+
+	if (fps != i->rate.applied_fps) {
+		i->params.source->set_fps(i, fps);
+		i->rate.applied_fps = fps;
+	}
+}
+
+/* a grab that fails, a camera gone, is retried this much later */
+#define CAPTURE_RETRY_NS (10 * FLL_NANOSECONDS_IN_MILISECOND)
+
+static void *capture_grabber(void *arg)
+{
+	struct imager *i = arg;
+	struct imager_grabber *g = &i->grab;
+	const struct timespec retry = { 0, CAPTURE_RETRY_NS };
+	unsigned long long interval, period;
+	struct store_frame *f, *old;
+	struct timespec grabbed;
+	IplImage *srcframe;
+
+	while (__atomic_load_n(&g->running, __ATOMIC_ACQUIRE)) {
+		capture_apply_fps(i);
+		if (i->params.source->grab(i)) {
+			++(g->errors);
+			nanosleep(&retry, NULL);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &grabbed);
+		if (g->grabbed) {
+			interval = timespec_delta(&g->last, &grabbed);
+			histogram_record(&g->interval, interval);
+			period = i->rate.applied_fps ?
+				FLL_NANOSECONDS_IN_SECOND /
+				i->rate.applied_fps : 0;
+			if (period)
+				histogram_record(&g->jitter,
+						 interval > period ?
+						 interval - period :
+						 period - interval);
+		}
+		g->last = grabbed;
+		++(g->grabbed);
+
+		if (i->rate.countdown > 0) {
+			--(i->rate.countdown);
+			++(i->stats.skipped);
+			continue;
+		}
+		i->rate.countdown =
+			__atomic_load_n(&i->rate.cadence, __ATOMIC_RELAXED) - 1;
+
+		srcframe = i->params.source->retrieve(i);
+		if (!srcframe) {
+			++(g->errors);
+			continue;
+		}
+		f = capture_hold(i, srcframe);
+		if (!f)
+			continue;
+		f->refs = 1;
+		f->stamp = grabbed;
+		f->scale = i->params.scale;
+
+		old = __atomic_exchange_n(&g->newest, f, __ATOMIC_ACQ_REL);
+		if (old) {
+			store_frame_put(old);
+			++(g->superseded);
+		} else {
+			handoff_post(&g->ready);
+		}
+	}
+	/* whoever waits for a frame, there are no more */
+	handoff_post(&g->ready);
+	return NULL;
+}
+
+/*
+ * Grabs from now on on a thread of its own; capture_run() then only
+ * picks up the newest frame, waiting for one if it has taken it
+ * already. For an imager set up with params.grabber, whose pool is
+ * sized for it, and after capture_prepare(), which grabs on the
+ * caller's thread. On failure, capture grabs on its own.
+ */
+int capture_start_grabber(struct imager *i)
+{
+	struct imager_grabber *g = &i->grab;
+	int ret;
+
+	if (!i->params.source)
+		return -ENODEV;
+	if (!g->enabled || g->running)
 		return -EINVAL;
+	ret = handoff_init(&g->ready, HANDOFF_SEM, 0);
+	if (ret) {
+		g->enabled = 0;
+		return ret;
+	}
+	histogram_reset(&g->interval);
+	histogram_reset(&g->jitter);
+	g->running = 1;
+	ret = pthread_create(&g->thread, NULL, capture_grabber, i);
+	if (ret) {
+		g->enabled = 0;
+		g->running = 0;
+		handoff_destroy(&g->ready);
+		return -ret;
+	}
+	pthread_setname_np(g->thread, "fll-grab");
+	return 0;
+}
+
+static int capture_pick(struct imager *i)
+{
+	struct store_frame *f;
+
+	handoff_wait(&i->grab.ready);
+	f = __atomic_exchange_n(&i->grab.newest, NULL, __ATOMIC_ACQ_REL);
+	if (!f)
+		return -ENODATA;
+
+	++(i->params.frameidx);
+	i->params.frame = f->image;
+	i->params.current = f;
+	++(i->stats.tally);
+	return 0;
+}
+
+int capture_run(struct imager *i)
+{
+	struct store_frame *f;
+	struct timespec grabbed;
+	IplImage *srcframe;
 	
-	if (!(i->params.videocam))
+	i->params.current = NULL;
+	if (!i->params.source)
 		return -ENODEV;
+	if (i->grab.enabled)
+		return capture_pick(i);
 
-	if (cvGrabFrame(i->params.videocam)) {
-		srcframe = cvRetrieveFrame(i->params.videocam,
-					   i->params.frameidx);
+	capture_apply_fps(i);
+
+	if (!i->params.source->grab(i)) {
+		clock_gettime(CLOCK_MONOTONIC, &grabbed);
+		/* left in the driver, no need to decode it */
+		if (i->rate.countdown > 0) {
+			--(i->rate.countdown);
+			++(i->stats.skipped);
+			return 0;
+		}
+		i->rate.countdown =
+			__atomic_load_n(&i->rate.cadence, __ATOMIC_RELAXED) - 1;
+
+		srcframe = i->params.source->retrieve(i);
 		if (!srcframe)
 			return -EIO;
 
+		if (i->step.pipeline->mode == PIPELINE_OVERLAPPED) {
+			f = capture_hold(i, srcframe);
+			if (!f)
+				return -ENOBUFS;
+			srcframe = f->image;
+		} else {
+			f = &i->params.live;
+			f->image = srcframe;
+		}
+		/* this reference travels with the frame to its consumer */
+		f->refs = 1;
+		f->stamp = grabbed;
+		f->scale = i->params.scale;
+
 		++(i->params.frameidx);
 		i->params.frame = srcframe;
+		i->params.current = f;
 		debug(i, "cam%d captured %dth image(%p = %p): %dx%d with [%d channels,"
 		       "%d step, %p data.\n",
  		       i->params.vididx , i->params.frameidx, srcframe,
@@ -164,6 +644,16 @@ int capture_get_imgcount(struct imager *i)
 	return i->stats.tally;
 }
 
+int capture_set_rate(struct imager *i, int fps, int cadence)
+{
+	if (fps < 1 || cadence < 1)
+		return -EINVAL;
+
+	__atomic_store_n(&i->rate.fps, fps, __ATOMIC_RELAXED);
+	__atomic_store_n(&i->rate.cadence, cadence, __ATOMIC_RELAXED);
+	return 0;
+}
+
 #else
 
 int capture_initialize(struct imager *i, struct imager_params *p,
@@ -187,9 +677,34 @@ int capture_get_imgcount(struct imager *i)
 	return 0;
 }
 
+int capture_set_rate(struct imager *i, int fps, int cadence)
+{
+	return -ENODEV;
+}
+
+int capture_start_grabber(struct imager *i)
+{
+	return -ENODEV;
+}
+
+void *capture_prepare(struct imager *i)
+{
+	return NULL;
+}
+
 #endif /*HAVE_OPENCV2*/
 
 int capture_print_stats(struct imager *i)
 {
+	struct imager_grabber *g = &i->grab;
+
+	if (!g->enabled)
+		return 0;
+
+	printf("capture: %lu grabbed, %lu superseded before pick-up, "
+	       "%lu failed, %lu skipped by cadence.\n", g->grabbed,
+	       g->superseded, g->errors, i->stats.skipped);
+	histogram_print("grab interval", &g->interval);
+	histogram_print("grab jitter", &g->jitter);
 	return 0;
 }
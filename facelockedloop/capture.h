@@ -6,6 +6,45 @@ extern "C" {
 #endif
 
 #include "pipeline.h"
+#include "store.h"
+
+/*
+ * In overlapped mode a frame may still be under detection while the next
+ * one is grabbed: one being grabbed, plus a full queue and one being
+ * worked on for every consumer.
+ */
+#define CAPTURE_POOL_SIZE (STAGE_MAX_LINKS * (STAGE_QUEUE_MAX_DEPTH + 1) + 1)
+
+#define CAPTURE_DEFAULT_FPS 30
+
+struct imager;
+struct videofile;
+struct jpegfile;
+struct scene;
+
+/* what the frames of a source are made of, 8 bits per sample */
+enum capture_format {
+	CAPTURE_FORMAT_BGR = 0,
+	/* luma only: detection takes it as is, with no conversion */
+	CAPTURE_FORMAT_GRAY = 1,
+};
+
+/*
+ * Where the frames come from: a camera, or a video file. grab() waits
+ * for the next frame and retrieve() returns it, valid until the next
+ * grab(); the frames of a 'stable' source stay valid as long as it is
+ * open, so they are handed downstream without a copy.
+ */
+struct capture_source {
+	const char *name;
+	int stable;
+	int (*open)(struct imager *i);
+	int (*grab)(struct imager *i);
+	void *(*retrieve)(struct imager *i);
+	enum capture_format (*format)(struct imager *i);
+	int (*set_fps)(struct imager *i, int fps);
+	void (*close)(struct imager *i);
+};
 
 #if defined(HAVE_OPENCV2)
 #include "opencv2/highgui/highgui_c.h"
@@ -13,18 +52,58 @@ extern "C" {
 struct imager_params {
 	char* name;
 	int vididx;
+	/* its place in the rig, every frame carries it */
+	int camera;
+	/* a video file instead of camera vididx, see videofile.h */
+	const char *path;
+	const struct capture_source *source;
+	struct videofile *file;
+	struct jpegfile *jpeg;
+	struct scene *scene;
+	/* smallest face to be found, sources that decode may scale down */
+	int min_face;
+	/* frames come at 1/scale of their size, faces are not affected */
+	int scale;
+	/* size asked of the camera, 0: whatever it gives by default */
+	int width;
+	int height;
+	/* frames will be grabbed on a thread, see capture_start_grabber() */
+	int grabber;
 	int frameidx;
 	IplImage* frame;
 	CvCapture* videocam;
+	struct store_frame live;
+	struct store_frame pool[CAPTURE_POOL_SIZE];
+	int npool;
+	int poolidx;
+	unsigned long seq;
+	struct store_frame *current;
 };
 
 #else
 struct imager_params {
 	char* name;
 	int vididx;
+	int camera;
+	const char *path;
+	const struct capture_source *source;
+	struct videofile *file;
+	struct jpegfile *jpeg;
+	struct scene *scene;
+	int min_face;
+	int scale;
+	int width;
+	int height;
+	int grabber;
 	int frameidx;
 	void* frame;
 	void* videocam;
+	struct store_frame live;
+	struct store_frame pool[CAPTURE_POOL_SIZE];
+	int npool;
+	int poolidx;
+	unsigned long seq;
+	struct store_frame *current;
 };
 
 #endif
@@ -32,12 +111,51 @@ struct imager_params {
 struct imager_stats {
 	int tally;
 	int fps;
+	int nobuf;
+	/* grabbed but not handed over, see cadence */
+	unsigned long skipped;
+};
+
+/*
+ * Requested by capture_set_rate() from any thread, applied by the
+ * capture worker: the camera frame rate, and handing over only one
+ * frame out of 'cadence'. The others are still grabbed, so the camera
+ * buffers never hold stale frames.
+ */
+struct imager_rate {
+	int fps;
+	int cadence;
+	int applied_fps;
+	int countdown;
+};
+
+/*
+ * Grabbing on a thread of its own, at the rate of the source: every
+ * frame is taken and stamped as soon as it is there, and the newest
+ * one waits in 'newest' for the pipeline; one it does not get to in
+ * time is superseded. 'interval' is the time between two grabs, and
+ * 'jitter' how far that is from the period asked for.
+ */
+struct imager_grabber {
+	int enabled;
+	int running;
+	pthread_t thread;
+	struct handoff ready;
+	struct store_frame *newest;
+	struct timespec last;
+	unsigned long grabbed;
+	unsigned long superseded;
+	unsigned long errors;
+	struct histogram interval;
+	struct histogram jitter;
 };
 
 struct imager {
 	struct stage step;
 	struct imager_params params;
 	struct imager_stats stats;
+	struct imager_rate rate;
+	struct imager_grabber grab;
 	int status;
 };
 
@@ -45,10 +163,14 @@ struct pipeline;
   
 int capture_initialize(struct imager *i, struct imager_params *p,
 		       struct pipeline *pipe);
+void *capture_prepare(struct imager *i);
 int capture_run(struct imager *i);
 void capture_teardown(struct imager *i);
 int capture_get_imgcount(struct imager *i);
+int capture_set_rate(struct imager *i, int fps, int cadence);
+int capture_start_grabber(struct imager *i);
 int capture_print_stats (struct imager *i);
+void capture_pace(struct timespec *due, int fps);
   
 #ifdef __cplusplus
 }
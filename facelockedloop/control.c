@@ -0,0 +1,357 @@
+/**
+ * @file facelockedloop/control.c
+ * @brief Settings changed at run time through a UNIX socket.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "debug.h"
+
+/* copies tried before a stage gives up and keeps its last one */
+#define CONTROL_SNAPSHOT_TRIES 16
+
+/* odd while a command is being applied */
+static unsigned int seq;
+
+static void control_begin(void)
+{
+	__atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void control_end(void)
+{
+	__atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Called by the stages before each frame: never waits for the control
+ * thread, -EAGAIN leaves dst as it was, with the settings of last frame.
+ */
+int control_snapshot(void *dst, const void *src, size_t len)
+{
+	unsigned int before;
+	int tries;
+
+	for (tries = 0; tries < CONTROL_SNAPSHOT_TRIES; tries++) {
+		before = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+		if (before & 1)
+			continue;
+		memcpy(dst, src, len);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == before)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+int control_initialize(struct control *c, const char *path,
+		       struct pipeline *pipe)
+{
+	memset(c, 0, sizeof(*c));
+	c->path = path;
+	c->pipe = pipe;
+	c->fd = -1;
+	c->client = -1;
+	return 0;
+}
+
+int control_register(struct control *c, const char *name, int camera,
+		     int *value, int min, int max, const char *help)
+{
+	struct control_tunable *t;
+
+	if (c->ntunables == CONTROL_MAX_TUNABLES)
+		return -ENOSPC;
+	if (min > max || *value < min || *value > max ||
+	    camera < CONTROL_SHARED)
+		return -EINVAL;
+
+	t = &c->tunables[c->ntunables++];
+	t->name = name;
+	t->help = help;
+	t->camera = camera;
+	t->value = value;
+	t->min = min;
+	t->max = max;
+	return 0;
+}
+
+/* <name>, or <name>:<camera> for the settings of each camera */
+static struct control_tunable *control_lookup(struct control *c,
+					      char *spec)
+{
+	struct control_tunable *t;
+	char *sep, *end;
+	int n, camera = 0;
+
+	sep = strchr(spec, ':');
+	if (sep) {
+		*sep++ = '\0';
+		camera = strtol(sep, &end, 10);
+		if (!*sep || *end || camera < 0)
+			return NULL;
+	}
+
+	for (n = 0; n < c->ntunables; n++) {
+		t = &c->tunables[n];
+		if (strcmp(t->name, spec))
+			continue;
+		if (t->camera == CONTROL_SHARED ? !sep : t->camera == camera)
+			return t;
+	}
+	return NULL;
+}
+
+static const char *control_name(struct control_tunable *t, char *buf,
+				size_t len)
+{
+	if (t->camera == CONTROL_SHARED)
+		return t->name;
+	snprintf(buf, len, "%s:%d", t->name, t->camera);
+	return buf;
+}
+
+/* a client gone away must not take fll down with SIGPIPE */
+static void control_reply(struct control *c, const char *fmt, ...)
+{
+	char buf[CONTROL_LINE_LEN];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(buf))
+		len = sizeof(buf) - 1;
+	if (len > 0)
+		send(c->client, buf, len, MSG_NOSIGNAL);
+}
+
+static int control_set(struct control *c, char *args)
+{
+	struct control_tunable *t[CONTROL_MAX_TUNABLES];
+	int value[CONTROL_MAX_TUNABLES];
+	char *tok, *save, *arg, *end, name[CONTROL_LINE_LEN];
+	int n, count = 0;
+
+	for (tok = strtok_r(args, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		arg = strchr(tok, '=');
+		if (!arg) {
+			control_reply(c, "error: expected <name>=<value>, "
+				      "got '%s'\n", tok);
+			return -EINVAL;
+		}
+		*arg++ = '\0';
+		if (count == CONTROL_MAX_TUNABLES)
+			return -E2BIG;
+		snprintf(name, sizeof(name), "%s", tok);
+		t[count] = control_lookup(c, tok);
+		if (!t[count]) {
+			control_reply(c, "error: no setting '%s'\n", name);
+			return -ENOENT;
+		}
+		value[count] = strtol(arg, &end, 0);
+		if (!*arg || *end || value[count] < t[count]->min ||
+		    value[count] > t[count]->max) {
+			control_reply(c, "error: %s takes %d to %d\n", name,
+				      t[count]->min, t[count]->max);
+			return -ERANGE;
+		}
+		count++;
+	}
+	if (!count) {
+		control_reply(c, "error: nothing to set\n");
+		return -EINVAL;
+	}
+
+	control_begin();
+	for (n = 0; n < count; n++)
+		__atomic_store_n(t[n]->value, value[n], __ATOMIC_RELAXED);
+	control_end();
+
+	for (n = 0; n < count; n++)
+		printf("control: %s set to %d.\n",
+		       control_name(t[n], name, sizeof(name)), value[n]);
+	control_reply(c, "ok\n");
+	return 0;
+}
+
+static int control_command(struct control *c, char *line)
+{
+	struct control_tunable *t;
+	char *cmd, *args, *tok, name[CONTROL_LINE_LEN];
+	int n;
+
+	cmd = strtok_r(line, " \t", &args);
+	if (!cmd)
+		return 0;
+
+	if (!strcmp(cmd, "list")) {
+		for (n = 0; n < c->ntunables; n++) {
+			t = &c->tunables[n];
+			control_reply(c, "%-12s %6d  %d to %d: %s\n",
+				      control_name(t, name, sizeof(name)),
+				      *t->value, t->min, t->max, t->help);
+		}
+		control_reply(c, "ok\n");
+	} else if (!strcmp(cmd, "get")) {
+		tok = strtok_r(NULL, " \t", &args);
+		t = tok ? control_lookup(c, tok) : NULL;
+		if (!t) {
+			control_reply(c, "error: no such setting\n");
+			return -ENOENT;
+		}
+		control_reply(c, "%d\n", *t->value);
+	} else if (!strcmp(cmd, "set")) {
+		return control_set(c, args);
+	} else if (!strcmp(cmd, "reset")) {
+		pipeline_reset_stats(c->pipe);
+		printf("control: statistics reset.\n");
+		control_reply(c, "ok\n");
+	} else if (!strcmp(cmd, "help")) {
+		control_reply(c, "list | get <name>[:<camera>] | "
+			      "set <name>[:<camera>]=<value> [...] | reset\n");
+	} else {
+		control_reply(c, "error: unknown command '%s', try help\n",
+			      cmd);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void control_session(struct control *c)
+{
+	char buf[CONTROL_LINE_LEN], *line, *eol;
+	size_t len = 0;
+	ssize_t got;
+
+	for (;;) {
+		got = read(c->client, buf + len, sizeof(buf) - 1 - len);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return;
+		len += got;
+		buf[len] = '\0';
+
+		for (line = buf; (eol = strchr(line, '\n')); line = eol + 1) {
+			*eol = '\0';
+			if (eol > line && eol[-1] == '\r')
+				eol[-1] = '\0';
+			++(c->stats.commands);
+			if (control_command(c, line))
+				++(c->stats.errors);
+		}
+		len -= line - buf;
+		memmove(buf, line, len);
+		if (len == sizeof(buf) - 1) {
+			control_reply(c, "error: line too long\n");
+			return;
+		}
+	}
+}
+
+static void *control_serve(void *arg)
+{
+	struct control *c = arg;
+	int fd;
+
+	while (__atomic_load_n(&c->running, __ATOMIC_ACQUIRE)) {
+		fd = accept(c->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		__atomic_store_n(&c->client, fd, __ATOMIC_SEQ_CST);
+		/* control_stop() may have missed it */
+		if (__atomic_load_n(&c->running, __ATOMIC_SEQ_CST)) {
+			++(c->stats.clients);
+			control_session(c);
+		}
+		__atomic_store_n(&c->client, -1, __ATOMIC_RELEASE);
+		close(fd);
+	}
+	return NULL;
+}
+
+/* replaces the socket of an fll that did not clean up */
+int control_start(struct control *c)
+{
+	struct sockaddr_un addr;
+	int ret;
+
+	if (strlen(c->path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, c->path);
+	unlink(c->path);
+	if (bind(c->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(c->path, S_IRUSR | S_IWUSR) || listen(c->fd, 1)) {
+		ret = -errno;
+		printf("control: cannot listen on %s: %s.\n", c->path,
+		       strerror(errno));
+		goto fail;
+	}
+
+	c->running = 1;
+	ret = pthread_create(&c->thread, NULL, control_serve, c);
+	if (ret) {
+		ret = -ret;
+		goto fail;
+	}
+	printf("control: listening on %s, %d settings.\n", c->path,
+	       c->ntunables);
+	return 0;
+fail:
+	c->running = 0;
+	close(c->fd);
+	c->fd = -1;
+	unlink(c->path);
+	return ret;
+}
+
+void control_stop(struct control *c)
+{
+	int fd;
+
+	if (c->fd < 0)
+		return;
+
+	__atomic_store_n(&c->running, 0, __ATOMIC_SEQ_CST);
+	/* wakes up accept() and read() */
+	shutdown(c->fd, SHUT_RDWR);
+	fd = __atomic_load_n(&c->client, __ATOMIC_SEQ_CST);
+	if (fd >= 0)
+		shutdown(fd, SHUT_RDWR);
+	pthread_join(c->thread, NULL);
+	close(c->fd);
+	c->fd = -1;
+	unlink(c->path);
+}
+
+void control_print_stats(struct control *c)
+{
+	printf("control: %lu clients, %lu commands, %lu errors.\n",
+	       c->stats.clients, c->stats.commands, c->stats.errors);
+}
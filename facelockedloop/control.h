@@ -0,0 +1,76 @@
+#ifndef __CONTROL_H_
+#define __CONTROL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "pipeline.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONTROL_PATH "/tmp/fll-control"
+#define CONTROL_MAX_TUNABLES 32
+#define CONTROL_LINE_LEN 256
+/* camera of a setting all the cameras share */
+#define CONTROL_SHARED -1
+
+/*
+ * A setting that may change while fll runs. Only the control thread
+ * writes *value, all the values of one command under a single seqlock
+ * update; whoever uses it takes a copy of its settings once per frame
+ * with control_snapshot(), so a command is seen all or nothing.
+ */
+struct control_tunable {
+	const char *name;
+	const char *help;
+	/* the one it belongs to, or CONTROL_SHARED */
+	int camera;
+	int *value;
+	int min;
+	int max;
+};
+
+struct control_stats {
+	unsigned long clients;
+	unsigned long commands;
+	unsigned long errors;
+};
+
+/*
+ * UNIX stream socket served by its own thread, one client at a time,
+ * one command per line:
+ *   list                          every setting, with its range
+ *   get <name>
+ *   set <name>=<value> [...]      applied together, or not at all
+ *   reset                         clear the stage statistics
+ * The settings of each camera are named <name>:<camera>; a plain <name>
+ * is the one of camera 0.
+ */
+struct control {
+	const char *path;
+	struct pipeline *pipe;
+	struct control_tunable tunables[CONTROL_MAX_TUNABLES];
+	int ntunables;
+	int fd;
+	int client;
+	pthread_t thread;
+	int running;
+	struct control_stats stats;
+};
+
+int control_initialize(struct control *c, const char *path,
+		       struct pipeline *pipe);
+int control_register(struct control *c, const char *name, int camera,
+		     int *value, int min, int max, const char *help);
+int control_start(struct control *c);
+void control_stop(struct control *c);
+void control_print_stats(struct control *c);
+int control_snapshot(void *dst, const void *src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONTROL_H_ */
@@ -8,10 +8,14 @@
 #include <errno.h>
 #include <stdio.h>
 #include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
 #include "detect.h"
+#include "control.h"
 #include "store.h"
 #include "kernel_utils.h"
 #include "debug.h"
+#include "trace.h"
 
 #if defined(HAVE_OPENCV2)
 //#include "opencv2/highgui.hpp"
@@ -21,13 +25,22 @@
 //#include "opencv2/objdetect.hpp"
 #include "opencv2/objdetect/objdetect.hpp"
 
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * HighGUI is not thread-safe: detectors leave a copy of their last view
+ * here, under window_lock, and only the main loop shows it.
+ */
+static IplImage *shown;
+static int shown_new;
+
 static CvSeq* detect_run_Haar_algorithm(IplImage* frame,
 					CvMemStorage* const buffer,
 					void *algo);
 static CvSeq* detect_run_latentSVM_algorithm(IplImage* frame,
 					     CvMemStorage* const buffer,
 					     void *algo);
-static struct store_box* detect_store(CvSeq* faces, IplImage* img, int scale);
+static void detect_store(struct facepos *bbpos, CvSeq* faces, IplImage* img,
+			 int scale, CvPoint offset);
 #endif
 
 static void detect_stage_up(struct stage *stg, struct stage_params *p,
@@ -38,6 +51,9 @@ static void detect_stage_wait(struct stage *stg);
 static void detect_stage_go(struct stage *stg);
 static int detect_stage_output(struct stage *stg, void* it);
 static int detect_stage_input(struct stage *stg, void** it);
+static void detect_stage_discard(struct stage *stg, void *it);
+static void detect_stage_degrade(struct stage *stg);
+static int detect_stage_route(struct stage *stg, void *it);
 
 static struct stage_ops detect_ops = {
 	.up = detect_stage_up, 
@@ -47,6 +63,9 @@ static struct stage_ops detect_ops = {
 	.go = detect_stage_go,
 	.output = detect_stage_output,
 	.input = detect_stage_input,
+	.discard = detect_stage_discard,
+	.degrade = detect_stage_degrade,
+	.route = detect_stage_route,
 };
 
 static void detect_stage_up(struct stage *stg, struct stage_params *p,
@@ -75,7 +94,22 @@ static int detect_stage_run(struct stage *stg)
 	if (!algo)
 		return -EINVAL;
 	
+	/* a change under way keeps the settings of the last frame */
+	control_snapshot(&algo->live, algo->params.tunables,
+			 sizeof(algo->live));
 	ret = detect_run(algo);
+	if (algo->params.faceboxs) {
+		algo->params.faceboxs->box.seq = algo->params.frame->seq;
+		algo->params.faceboxs->timestamp = algo->params.frame->stamp;
+		algo->params.faceboxs->camera = algo->camera;
+		algo->params.faceboxs->width = algo->params.frame->width;
+		algo->params.faceboxs->height = algo->params.frame->height;
+		clock_gettime(CLOCK_MONOTONIC,
+			      &algo->params.faceboxs->detected);
+	}
+	/* the frame is no longer needed, capture may reuse it */
+	store_frame_put(algo->params.frame);
+	algo->params.frame = NULL;
 	/* pass only first face detected to next stage */
 	stg->params.data_out = algo->params.faceboxs;
 	stg->stats.ofinterest = algo->stats.facecount;
@@ -95,22 +129,75 @@ static void detect_stage_go(struct stage *stg)
 
 static int detect_stage_output(struct stage *stg, void* it)
 {
-	return stage_output(stg, stg->params.data_out);
+	int ret;
+
+	ret = stage_output(stg, it);
+	if (ret)	/* still ours, the tracker did not take it */
+		store_result_put(it);
+	return ret;
+}
+
+/* results go to the tracker of the camera they were found on */
+static int detect_stage_route(struct stage *stg, void *it)
+{
+	struct facepos *pos = it;
+
+	return pos->camera;
+}
+
+/* an older result the tracker never took */
+static void detect_stage_discard(struct stage *stg, void *it)
+{
+	store_result_put(it);
+}
+
+/* too slow: look for the next face around the last one only */
+static void detect_stage_degrade(struct stage *stg)
+{
+	struct detector *algo = container_of(stg, struct detector, step);
+
+	algo->roi = 1;
+}
+
+/* a result nobody holds any more, NULL if they are all on their way */
+static struct facepos *detect_result(struct detector *d)
+{
+	struct facepos *pos;
+	int n;
+
+	for (n = 0; n < DETECT_RESULTS; n++) {
+		pos = &d->results[(d->nextresult + n) % DETECT_RESULTS];
+		if (!__atomic_load_n(&pos->busy, __ATOMIC_ACQUIRE)) {
+			d->nextresult = (pos - d->results + 1) % DETECT_RESULTS;
+			memset(pos, 0, sizeof(*pos));
+			pos->busy = 1;
+			return pos;
+		}
+	}
+	++(d->stats.nobuf);
+	return NULL;
 }
 
 static int detect_stage_input(struct stage *stg, void **it)
 {
 	void *itin = NULL;
 	struct detector *algo;
+	int ret;
 
 	algo = container_of(stg, struct detector, step);
-	stage_input(stg, &itin);
-
-	algo->params.srcframe = itin;
-	algo->params.faceboxs = NULL;
 	if (!algo->params.scratchbuf)
 		return -EINVAL;	
 
+	ret = stage_input(stg, &itin);
+	if (ret)
+		return ret;
+
+	algo->params.frame = itin;
+	algo->params.srcframe = algo->params.frame->image;
+	algo->scale = algo->params.frame->scale;
+	algo->camera = algo->params.frame->camera;
+	algo->params.faceboxs = NULL;
+
 	return 0;
 }
 
@@ -126,16 +213,37 @@ int detect_initialize(struct detector *d, struct detector_params *p,
 	struct stage_params stgparams;
 	CvLatentSvmDetector* cdtSVM_det;
 	CvHaarClassifierCascade* cdtHaar_det;
-	int ret = 0;
+	int n, ret = 0;
 
-	stgparams.nth_stage = DETECTION_STAGE;
+	stgparams.nth_stage = 0;
 	stgparams.data_in = NULL;
+	stgparams.depth = 0;
+	stgparams.dispatch = STAGE_DISPATCH_ALL;
 	stgparams.data_out = NULL;
 	stgparams.name = "DET_STG";
 
 	d->params = *p;
-
-	cvNamedWindow("FLL detection", CV_WINDOW_AUTOSIZE);
+	d->params.frame = NULL;
+	for (n = 0; n < STORE_MAX_CAMERAS; n++)
+		d->last[n].scan = 1;
+	d->roi = 0;
+	d->scale = 1;
+	d->camera = 0;
+	if (!p->tunables)
+		return -EINVAL;
+	d->live = *p->tunables;
+	memset(d->results, 0, sizeof(d->results));
+	d->nextresult = 0;
+	d->stats.nobuf = 0;
+
+	d->params.view = NULL;
+
+	/* detectors may be set up side by side, the window is shared */
+	if (d->params.display) {
+		pthread_mutex_lock(&window_lock);
+		cvNamedWindow("FLL detection", CV_WINDOW_AUTOSIZE);
+		pthread_mutex_unlock(&window_lock);
+	}
 
 	d->params.scratchbuf = cvCreateMemStorage(0); /*block_size: 0->64K*/
 	if (d->params.scratchbuf == NULL)
@@ -171,22 +279,140 @@ int detect_initialize(struct detector *d, struct detector_params *p,
 
 void detect_teardown(struct detector *d)
 {
-	cvDestroyWindow("FLL detection");
+	if (d->params.display) {
+		pthread_mutex_lock(&window_lock);
+		cvDestroyWindow("FLL detection");
+		if (shown)
+			cvReleaseImage(&shown);
+		shown_new = 0;
+		pthread_mutex_unlock(&window_lock);
+	}
 
 	if (d->params.dstframe)
 		cvReleaseImage(&(d->params.dstframe));
+	if (d->params.view)
+		cvReleaseImage(&(d->params.view));
 	if (d->params.scratchbuf)
 		cvReleaseMemStorage(&(d->params.scratchbuf));
 }
 
+/*
+ * The last face box grown by half its size on every side, within the
+ * image; 0 if there is no face to look around.
+ */
+static int detect_roi(struct detector *d, CvRect *roi)
+{
+	struct store_box *b = &d->last[d->camera];
+	int s = d->scale;
+	int w = (b->ptB_x - b->ptA_x) / s, h = (b->ptB_y - b->ptA_y) / s;
+	int x0, y0, x1, y1;
+
+	if (b->scan || w <= 0 || h <= 0)
+		return 0;
+
+	/* boxes are in pixels of the full size frame */
+	x0 = b->ptA_x / s - w / 2 > 0 ? b->ptA_x / s - w / 2 : 0;
+	y0 = b->ptA_y / s - h / 2 > 0 ? b->ptA_y / s - h / 2 : 0;
+	x1 = b->ptB_x / s + w / 2;
+	y1 = b->ptB_y / s + h / 2;
+	if (x1 > d->params.srcframe->width)
+		x1 = d->params.srcframe->width;
+	if (y1 > d->params.srcframe->height)
+		y1 = d->params.srcframe->height;
+	if (x1 <= x0 || y1 <= y0)
+		return 0;
+
+	*roi = cvRect(x0, y0, x1 - x0, y1 - y0);
+	return 1;
+}
+
+/*
+ * A luma frame is searched where it lies, through a header of this
+ * detector's own, so the ROI set on it is not seen by other consumers.
+ */
+static IplImage *detect_luma(struct detector *d)
+{
+	IplImage *src = d->params.srcframe;
+
+	cvInitImageHeader(&d->params.luma, cvSize(src->width, src->height),
+			  src->depth, 1, src->origin, 4);
+	cvSetData(&d->params.luma, src->imageData, src->widthStep);
+	return &d->params.luma;
+}
+
+/*
+ * What the faces are drawn on and shown: a copy of this detector's own,
+ * made BGR from luma, as the frame is shared with other consumers and
+ * may be the mapping of a file.
+ */
+static IplImage *detect_view(struct detector *d)
+{
+	IplImage *src = d->params.srcframe;
+
+	if (!d->params.display)
+		return NULL;
+
+	if (d->params.view && (d->params.view->width != src->width ||
+			       d->params.view->height != src->height))
+		cvReleaseImage(&(d->params.view));
+	if (!d->params.view) {
+		debug(d, "allocate display image only once\n");
+		d->params.view = cvCreateImage(cvSize(src->width, src->height),
+					       src->depth, 3);
+		if (!d->params.view)
+			return NULL;
+	}
+	if (src->nChannels == 1)
+		cvCvtColor(src, d->params.view, CV_GRAY2BGR);
+	else
+		cvCopy(src, d->params.view, NULL);
+	return d->params.view;
+}
+
+/* the newest view replaces the one not shown yet */
+static void detect_publish(IplImage *view)
+{
+	pthread_mutex_lock(&window_lock);
+	if (shown && (shown->width != view->width ||
+		      shown->height != view->height))
+		cvReleaseImage(&shown);
+	if (!shown)
+		shown = cvCreateImage(cvSize(view->width, view->height),
+				      view->depth, view->nChannels);
+	if (shown) {
+		cvCopy(view, shown, NULL);
+		shown_new = 1;
+	}
+	pthread_mutex_unlock(&window_lock);
+}
+
+/* on the thread of the main loop, once per run */
+void detect_show(void)
+{
+	pthread_mutex_lock(&window_lock);
+	if (shown_new) {
+		cvShowImage("FLL detection", (CvArr*)shown);
+		shown_new = 0;
+	}
+	pthread_mutex_unlock(&window_lock);
+	cvWaitKey(1);
+}
+
 int detect_run(struct detector *d)
 {
+	unsigned long long span;
+	CvPoint offset = cvPoint(0, 0);
+	CvRect roi;
+	int roied = 0;
+	int luma = d->params.srcframe->nChannels == 1;
+	int s = d->scale, min_size, max_size;
+	IplImage *gray, *view;
 	CvSeq* faces;
 
 	if (!d->params.scratchbuf)
 		return -ENOMEM;
 
-	if (!d->params.dstframe) {
+	if (!d->params.dstframe && !(luma && d->params.odt == CDT_HAAR)) {
 		debug(d, "allocate gray image only once\n");
 		d->params.dstframe = cvCreateImage(cvSize(d->params.srcframe->width, 
 							  d->params.srcframe->height),
@@ -198,31 +424,47 @@ int detect_run(struct detector *d)
 
 	switch(d->params.odt) {
 	case CDT_HAAR:
-		/* grey image only be needed for Haar */
-		cvCvtColor(d->params.srcframe,
-			   d->params.dstframe,
-			   CV_BGR2GRAY);
+		/* grey image only be needed for Haar, luma frames are one */
+		if (luma) {
+			gray = detect_luma(d);
+		} else {
+			gray = d->params.dstframe;
+			cvCvtColor(d->params.srcframe, gray, CV_BGR2GRAY);
+		}
+		if (d->roi && detect_roi(d, &roi)) {
+			cvSetImageROI(gray, roi);
+			offset = cvPoint(roi.x, roi.y);
+			roied = 1;
+		}
 		cvClearMemStorage(d->params.scratchbuf);
-		faces = cvHaarDetectObjects(d->params.dstframe,
+		/* a frame decoded smaller has smaller faces */
+		min_size = d->live.min_size / s;
+		max_size = d->live.max_size / s > 0 ?
+			d->live.max_size / s : 1;
+		span = trace_begin();
+		faces = cvHaarDetectObjects(gray,
 					    (CvHaarClassifierCascade*)(
 						    d->params.algorithm),
 					    d->params.scratchbuf,
-					    1.2, /*default scale factor: 1.1*/
-					    2,   /*default min neighbours: 3*/
+					    d->live.scale / 100.0,
+					    d->live.neighbours,
 					    CV_HAAR_DO_CANNY_PRUNING |
 					    CV_HAAR_FIND_BIGGEST_OBJECT,
-					    cvSize(d->params.min_size,
-						   d->params.min_size),  
-					    cvSize(d->params.max_size,
-						   d->params.max_size) ); 
+					    cvSize(min_size, min_size),
+					    cvSize(max_size, max_size));
+		trace_end("cvHaarDetectObjects", span);
+		if (roied)
+			cvResetImageROI(gray);
 		break;
 	case CDT_LSVM:
+		span = trace_begin();
 		faces =	cvLatentSvmDetectObjects(d->params.dstframe,
 						 (CvLatentSvmDetector*)(
 							 d->params.algorithm),
 						 d->params.scratchbuf,
-						 0.15f, /* overlap threshold */
+						 d->live.overlap / 100.0f,
 						 -1     /* threads number*/ );
+		trace_end("cvLatentSvmDetectObjects", span);
 		break;
 	default:
 		faces = 0;
@@ -233,17 +475,48 @@ int detect_run(struct detector *d)
 	}
 	else 
 		d->stats.facecount = faces->total;
+	__atomic_add_fetch(&d->stats.faces, d->stats.facecount,
+			   __ATOMIC_RELAXED);
+	/* degraded for one frame per overrun */
+	d->roi = 0;
 
-	d->params.faceboxs = detect_store(faces, d->params.srcframe, 1);
+	d->params.faceboxs = detect_result(d);
 	if (!d->params.faceboxs)
-		return -ENOMEM;
+		return -ENOBUFS;
+	view = detect_view(d);
+	detect_store(d->params.faceboxs, faces, view, s, offset);
+	d->last[d->camera] = d->params.faceboxs->box;
 
-	cvShowImage("FLL detection", (CvArr*)(d->params.srcframe));
-	cvWaitKey(10);
+	if (view)
+		detect_publish(view);
 	return 0;
 
 }
 
+/*
+ * Before the first frame: one detection on an image of the camera's size
+ * creates the gray and display images, the cascade's internal buffers,
+ * the storage blocks and the window, so that no frame pays for them later.
+ */
+int detect_prepare(struct detector *d, void *image, int scale, int camera)
+{
+	int ret;
+
+	d->params.srcframe = image;
+	d->scale = scale;
+	d->camera = camera;
+	d->live = *d->params.tunables;
+	ret = detect_run(d);
+	if (d->params.faceboxs)
+		store_result_put(d->params.faceboxs);
+	d->params.faceboxs = NULL;
+	d->params.srcframe = NULL;
+	d->last[d->camera].scan = 1;
+	d->stats.facecount = 0;
+	d->stats.faces = 0;
+	return ret;
+}
+
 static CvSeq* detect_run_Haar_algorithm(IplImage* frame,
 					CvMemStorage* const buf,
 					void *algo)
@@ -285,21 +558,21 @@ static CvSeq* detect_run_latentSVM_algorithm(IplImage* frame,
 	return faces;
 }
 
-static struct store_box* detect_store(CvSeq* faces, IplImage* img, int scale)
+/*
+ * Every face is drawn, if there is an image to draw on; only the first
+ * one goes on to the tracker, in pixels of the full size frame.
+ */
+static void detect_store(struct facepos *bbpos, CvSeq* faces, IplImage* img,
+			 int scale, CvPoint offset)
 {
-	int i, nbbox;
+	int i;
 	CvPoint ptA, ptB;
 	CvFont font;
-	struct store_box *bbpos;
-	char *text;
+	char text[32];
 
-	nbbox = faces->total ? faces->total : 1;
-	bbpos = calloc(nbbox, sizeof(*bbpos));
-	if (!bbpos)
-		return NULL;
 	if (!faces || !faces->total) {
-		bbpos->scan = 1;
-		goto done;
+		bbpos->box.scan = 1;
+		return;
 	}
 	
 	cvInitFont(&font, CV_FONT_HERSHEY_PLAIN, 1.0, 1.0, 0, 1, 8);
@@ -308,27 +581,32 @@ static struct store_box* detect_store(CvSeq* faces, IplImage* img, int scale)
 	for (i = 0; i < faces->total; i++)
 	{
 		CvRect* rAB = (CvRect*)cvGetSeqElem(faces, i);
-		ptA.x = rAB->x * scale;
-		ptB.x = (rAB->x + rAB->width)*scale;
-		ptA.y = rAB->y*scale;
-		ptB.y = (rAB->y+rAB->height)*scale;
-		cvRectangle(img, ptA, ptB, CV_RGB(255,0,0), 3, 8, 0 );
+		ptA.x = rAB->x + offset.x;
+		ptB.x = rAB->x + offset.x + rAB->width;
+		ptA.y = rAB->y + offset.y;
+		ptB.y = rAB->y + offset.y + rAB->height;
+		if (img)
+			cvRectangle(img, ptA, ptB, CV_RGB(255,0,0), 3, 8, 0 );
+		ptA.x *= scale;
+		ptA.y *= scale;
+		ptB.x *= scale;
+		ptB.y *= scale;
 		printf("(%d,%d) and (%d,%d).\n", ptA.x, ptA.y, ptB.x, ptB.y);
 		
-		bbpos[i].ptA_x = ptA.x;
-		bbpos[i].ptA_y = ptA.y;
-		bbpos[i].ptB_x = ptB.x;
-		bbpos[i].ptB_y = ptB.y;
-
-		asprintf(&text, "detected: %dx%d", rAB->width, rAB->height);
-		ptB.y += 15;
-		ptB.x = ptA.x;
-		cvPutText(img, text, ptB, &font, CV_RGB(0,255,0));
-
-		free(text);
+		if (!i) {
+			bbpos->box.ptA_x = ptA.x;
+			bbpos->box.ptA_y = ptA.y;
+			bbpos->box.ptB_x = ptB.x;
+			bbpos->box.ptB_y = ptB.y;
+		}
+
+		snprintf(text, sizeof(text), "detected: %dx%d", rAB->width,
+			 rAB->height);
+		ptB.y = rAB->y + offset.y + rAB->height + 15;
+		ptB.x = rAB->x + offset.x;
+		if (img)
+			cvPutText(img, text, ptB, &font, CV_RGB(0,255,0));
 	}
-done:
-	return bbpos;
 }
 
 #else
@@ -343,6 +621,16 @@ int detect_run(struct detector *d)
 {
 	return -EINVAL;
 }
+
+int detect_prepare(struct detector *d, void *image, int scale, int camera)
+{
+	return -ENODEV;
+}
+
+void detect_show(void)
+{
+	return;
+}
 	
 void detect_teardown(struct detector *d)
 {
@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include "pipeline.h"
+#include "store.h"
 
 #if defined(HAVE_OPENCV2)
 #include "opencv2/highgui/highgui_c.h"
@@ -17,19 +18,45 @@ enum object_detector_t {
 	CDT_UNKNOWN = 2,
 };
 
+/* results on their way: reorder window, queues and the tracker */
+#define DETECT_RESULTS 96
+
+/* OpenCV defaults are 110 and 3, these find faces sooner */
+#define DETECT_SCALE 120
+#define DETECT_NEIGHBOURS 2
+#define DETECT_OVERLAP 15
+
+/*
+ * Settings that may change between two frames, shared by every detector
+ * and taken once per frame with control_snapshot(). Face sizes are in
+ * pixels; scale (Haar scale factor) and overlap (LSVM threshold) in %.
+ */
+struct detector_tunables {
+	int min_size;
+	int max_size;
+	int scale;
+	int neighbours;
+	int overlap;
+};
+
 #if defined(HAVE_OPENCV2)
 
 struct detector_params {
 	const char *name;
 	enum object_detector_t odt;
 	char *cascade_xml;
+	struct store_frame *frame;
 	IplImage* srcframe;
 	IplImage* dstframe;
 	void *algorithm;
 	CvMemStorage* scratchbuf;
-	struct store_box *faceboxs;
-	int min_size;
-	int max_size;
+	struct facepos *faceboxs;
+	struct detector_tunables *tunables;
+	/* draw and show the faces; BGR is only made from luma for it */
+	int display;
+	IplImage *view;
+	/* header over the pixels of a luma frame, see detect_luma() */
+	IplImage luma;
 };
 
 #else
@@ -37,13 +64,15 @@ struct detector_params {
 	const char *name;
 	enum object_detector_t odt;
 	char *cascade_xml;
+	struct store_frame *frame;
 	void* srcframe;
 	void* dstframe;
 	void *algorithm;
 	void *scratchbuf;
-	struct store_box *faceboxs;
-	int min_size;
-	int max_size;
+	struct facepos *faceboxs;
+	struct detector_tunables *tunables;
+	int display;
+	void *view;
 };
 
 #endif
@@ -51,19 +80,35 @@ struct detector_params {
 struct detector_stats {
 	int frameidx;
 	int facecount;
+	/* all runs, read live by --shm */
+	unsigned long faces;
+	/* no result free in the pool */
+	unsigned long nobuf;
 };
 
 struct detector {
 	struct stage step;
 	struct detector_params params;
 	struct detector_stats stats;
+	/* last face found on each camera, where a degraded run looks */
+	struct store_box last[STORE_MAX_CAMERAS];
+	int roi;
+	/* of the frame being worked on, see store_frame */
+	int scale;
+	int camera;
+	/* params.tunables as of the frame being worked on */
+	struct detector_tunables live;
+	struct facepos results[DETECT_RESULTS];
+	int nextresult;
 	int status;
 };
   
 int detect_initialize(struct detector *d, struct detector_params *p,
 		      struct pipeline *pipe);
 void detect_teardown(struct detector *d);
+int detect_prepare(struct detector *d, void *image, int scale, int camera);
 int detect_run(struct detector *d);
+void detect_show(void);
 int detect_get_objcount(struct detector *d);
 int detect_print_stats(struct detector *d);
 
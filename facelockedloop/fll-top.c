@@ -0,0 +1,141 @@
+/**
+ * @file facelockedloop/fll-top.c
+ * live view of the statistics a running fll publishes with --shm.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmstats.h"
+#include "time_utils.h"
+
+static const char *const cmds[SERVOLIB_NUM_SERVO_CMDS] = {
+	"reset", "check", "read", "config", "write",
+};
+
+static double ms(unsigned long long ns)
+{
+	return (double)ns / FLL_NANOSECONDS_IN_MILISECOND;
+}
+
+static void show(struct shmstats *s)
+{
+	static const char *const servos[] = { "pan", "tilt" };
+	struct shmstats_camera *sc;
+	struct shmstats_stage *ss;
+	struct servo_stats *sv;
+	struct timespec now;
+	int n, c, k;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	printf("fll pid %d%s, up %.1fs, updated %.1fs ago, %lu updates\n",
+	       s->pid, kill(s->pid, 0) && errno == ESRCH ? " (gone)" : "",
+	       (double)timespec_delta(&s->started, &now) /
+	       FLL_NANOSECONDS_IN_SECOND,
+	       (double)timespec_delta(&s->updated, &now) /
+	       FLL_NANOSECONDS_IN_SECOND, s->updates);
+	printf("frames %lu, faces %lu\n\n", s->frames, s->faces);
+
+	printf("%-3s %8s %4s %5s %8s %8s\n", "cam", "frames", "fps", "1 in",
+	       "e2e p50", "e2e p99");
+	for (k = 0; k < s->ncameras && k < SHMSTATS_MAX_CAMERAS; k++) {
+		sc = &s->cameras[k];
+		printf("%-3d %8lu %4d %5d %8.2f %8.2f\n", k, sc->frames,
+		       sc->fps, sc->cadence, ms(sc->e2e_p50),
+		       ms(sc->e2e_p99));
+	}
+	printf("\n");
+
+	printf("%-3s %-15s %8s %5s %8s %8s %8s %8s %7s %7s %7s %7s\n",
+	       "#", "stage", "runs", "/s", "run p50", "run p99", "lat p50",
+	       "lat p99", "dropped", "supers", "overrun", "skipped");
+	for (n = 0; n < s->nstages && n < SHMSTATS_MAX_STAGES; n++) {
+		ss = &s->stages[n];
+		printf("%-3d %-15.15s %8lu %5lu %8.2f %8.2f %8.2f %8.2f "
+		       "%7lu %7lu %7lu %7lu%s\n", ss->nth, ss->name, ss->runs,
+		       ss->persecond, ms(ss->run_p50), ms(ss->run_p99),
+		       ms(ss->latency_p50), ms(ss->latency_p99), ss->dropped,
+		       ss->superseded, ss->overruns, ss->skipped,
+		       ss->fused ? " fused" : "");
+	}
+
+	printf("\n%-3s %3s %-5s %4s %6s %6s %7s %7s %6s", "cam", "dev",
+	       "servo", "chan", "min", "max", "min err", "max err", "err");
+	for (c = 0; c < SERVOLIB_NUM_SERVO_CMDS; c++)
+		printf(" %7s", cmds[c]);
+	printf("\n");
+	for (k = 0; k < s->ncameras && k < SHMSTATS_MAX_CAMERAS; k++) {
+		sc = &s->cameras[k];
+		for (n = 0; n < 2; n++) {
+			sv = &sc->servos[n];
+			printf("%-3d %3d %-5s %4d %6d %6d %7d %7d %6d", k,
+			       sc->dev, servos[n], sv->channel, sv->min_pos,
+			       sv->max_pos, sv->min_poserr, sv->max_poserr,
+			       sv->rt_err);
+			for (c = 0; c < SERVOLIB_NUM_SERVO_CMDS; c++)
+				printf(" %7d", sv->cmdstally[c]);
+			printf("\n");
+		}
+	}
+}
+
+int main(int argc, char *const argv[])
+{
+	const char *name = SHMSTATS_NAME;
+	struct shmstats *s, copy;
+	int fd, period = 1;
+
+	if (argc > 1)
+		name = argv[1];
+	if (argc > 2)
+		period = atoi(argv[2]);
+	if (argc > 3 || period < 0) {
+		printf("usage: fll-top [segment, default %s] "
+		       "[seconds between updates, 0: once]\n", SHMSTATS_NAME);
+		return -EINVAL;
+	}
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		printf("cannot open %s: %s, is fll running with --shm?\n",
+		       name, strerror(errno));
+		return -errno;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		printf("cannot map %s: %s.\n", name, strerror(errno));
+		return -errno;
+	}
+	if (__atomic_load_n(&s->magic, __ATOMIC_ACQUIRE) != SHMSTATS_MAGIC ||
+	    s->version != SHMSTATS_VERSION) {
+		printf("%s is not an fll statistics segment of version %d.\n",
+		       name, SHMSTATS_VERSION);
+		return -EINVAL;
+	}
+
+	for (;;) {
+		if (shmstats_read(s, &copy)) {
+			usleep(1000);
+			continue;
+		}
+		if (period)
+			printf("\033[H\033[2J");
+		show(&copy);
+		if (!period)
+			break;
+		sleep(period);
+	}
+
+	munmap(s, sizeof(*s));
+	return 0;
+}
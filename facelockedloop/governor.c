@@ -0,0 +1,152 @@
+/**
+ * @file facelockedloop/governor.c
+ * @brief Frame rate and detection cadence driven by the stage timings.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "governor.h"
+#include "time_utils.h"
+#include "debug.h"
+
+int governor_initialize(struct governor *g, struct governor_params *p,
+			struct imager *camera, struct histogram *latency)
+{
+	if (!p->target || p->min_fps < 1 || p->max_fps < p->min_fps ||
+	    p->max_cadence < 1 || !p->period)
+		return -EINVAL;
+
+	memset(g, 0, sizeof(*g));
+	g->params = *p;
+	g->camera = camera;
+	g->latency = latency;
+	g->fps = p->max_fps;
+	g->cadence = 1;
+	clock_gettime(CLOCK_MONOTONIC, &g->updated);
+
+	return capture_set_rate(camera, g->fps, g->cadence);
+}
+
+int governor_add_detector(struct governor *g, struct stage *s)
+{
+	if (g->ndetectors == GOVERNOR_MAX_DETECTORS)
+		return -ENOSPC;
+
+	g->overall[g->ndetectors] = s->stats.overall;
+	g->detectors[g->ndetectors++] = s;
+	return 0;
+}
+
+/* share of the period the detectors spent working, in % */
+static int governor_busy(struct governor *g, unsigned long long period)
+{
+	unsigned long long worked = 0;
+	struct timespec overall;
+	int n;
+
+	if (!g->ndetectors || !period)
+		return 0;
+
+	for (n = 0; n < g->ndetectors; n++) {
+		overall = g->detectors[n]->stats.overall;
+		worked += timespec_delta(&g->overall[n], &overall);
+		g->overall[n] = overall;
+	}
+
+	return worked * 100 / (period * g->ndetectors);
+}
+
+/* more headroom: stretch the cadence first, the camera keeps its rate */
+static int governor_slow_down(struct governor *g)
+{
+	if (g->cadence < g->params.max_cadence) {
+		++(g->cadence);
+		return 1;
+	}
+	if (g->fps > g->params.min_fps) {
+		g->fps -= g->fps / 4 ? g->fps / 4 : 1;
+		if (g->fps < g->params.min_fps)
+			g->fps = g->params.min_fps;
+		return 1;
+	}
+	return 0;
+}
+
+/* spare cpu: frames first, then detect more of them */
+static int governor_speed_up(struct governor *g)
+{
+	if (g->fps < g->params.max_fps) {
+		g->fps += g->fps / 4 ? g->fps / 4 : 1;
+		if (g->fps > g->params.max_fps)
+			g->fps = g->params.max_fps;
+		return 1;
+	}
+	if (g->cadence > 1) {
+		--(g->cadence);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Cheap unless a period went by; call once per pipeline_run(). Returns 1
+ * when the rate changed.
+ */
+int governor_update(struct governor *g)
+{
+	struct histogram recent;
+	struct timespec now;
+	unsigned long long period, latency;
+	int busy, changed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = timespec_delta(&g->updated, &now);
+	if (period < (unsigned long long)g->params.period *
+	    FLL_NANOSECONDS_IN_MILISECOND)
+		return 0;
+	g->updated = now;
+
+	busy = governor_busy(g, period);
+	latency = 0;
+	if (g->latency) {
+		histogram_since(&recent, g->latency, &g->seen);
+		latency = histogram_percentile(&recent, 90.0);
+		memcpy(g->seen.buckets, g->latency->buckets,
+		       sizeof(g->seen.buckets));
+	}
+	++(g->stats.updates);
+	g->stats.busy = busy;
+	g->stats.latency = latency;
+
+	if (latency > g->params.target || busy > GOVERNOR_BUSY_HIGH) {
+		changed = governor_slow_down(g);
+		g->stats.slowed += changed;
+	} else if (latency < g->params.target * 7 / 10 &&
+		   busy < GOVERNOR_BUSY_LOW) {
+		changed = governor_speed_up(g);
+		g->stats.sped += changed;
+	}
+	if (!changed)
+		return 0;
+
+	debug(g, "p90 %lluus, detectors %d%% busy: %d fps, "
+	      "detect 1 frame in %d.\n",
+	      latency / FLL_NANOSECONDS_IN_MICROSECOND, busy, g->fps,
+	      g->cadence);
+	capture_set_rate(g->camera, g->fps, g->cadence);
+	return 1;
+}
+
+void governor_print_stats(struct governor *g)
+{
+	printf("%s: %d fps, detect 1 frame in %d, %lu updates, "
+	       "slowed %lu, sped up %lu; last p90 %lluus, detectors %d%% "
+	       "busy.\n", g->params.name, g->fps, g->cadence, g->stats.updates,
+	       g->stats.slowed, g->stats.sped,
+	       g->stats.latency / FLL_NANOSECONDS_IN_MICROSECOND,
+	       g->stats.busy);
+}
@@ -0,0 +1,73 @@
+#ifndef __GOVERNOR_H_
+#define __GOVERNOR_H_
+
+#include <time.h>
+
+#include "pipeline.h"
+#include "capture.h"
+#include "histogram.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GOVERNOR_MAX_DETECTORS STAGE_MAX_LINKS
+
+/*
+ * Detectors busier than this share of the time are about to build a
+ * backlog; below the lower one there is room for more frames.
+ */
+#define GOVERNOR_BUSY_HIGH 90
+#define GOVERNOR_BUSY_LOW 60
+
+struct governor_params {
+	const char *name;
+	/* end to end latency to stay under, ns */
+	unsigned long long target;
+	int min_fps;
+	int max_fps;
+	int max_cadence;
+	/* how often to look at the stage timings, ms */
+	unsigned int period;
+};
+
+struct governor_stats {
+	unsigned long updates;
+	unsigned long slowed;
+	unsigned long sped;
+	/* as of the last update: p90 latency, detector load (%) */
+	unsigned long long latency;
+	int busy;
+};
+
+/*
+ * Keeps the latency measured by the tracker under a target by trading
+ * detection cadence (one frame out of 'cadence' handed to detection) and
+ * camera frame rate against the load of the detectors.
+ */
+struct governor {
+	struct governor_params params;
+	struct imager *camera;
+	struct stage *detectors[GOVERNOR_MAX_DETECTORS];
+	int ndetectors;
+	struct histogram *latency;
+	/* where things stood at the last update */
+	struct histogram seen;
+	struct timespec overall[GOVERNOR_MAX_DETECTORS];
+	struct timespec updated;
+	int fps;
+	int cadence;
+	struct governor_stats stats;
+};
+
+int governor_initialize(struct governor *g, struct governor_params *p,
+			struct imager *camera, struct histogram *latency);
+int governor_add_detector(struct governor *g, struct stage *s);
+int governor_update(struct governor *g);
+void governor_print_stats(struct governor *g);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __GOVERNOR_H_ */
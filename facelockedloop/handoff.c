@@ -0,0 +1,127 @@
+/**
+ * @file facelockedloop/handoff.c
+ * @brief Spin-then-block wakeups between the pipeline threads.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "handoff.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__arm__) || defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static inline void futex_wait(int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+int handoff_init(struct handoff *h, enum handoff_kind kind,
+		 unsigned int spin)
+{
+	if (spin > HANDOFF_MAX_SPIN)
+		return -EINVAL;
+
+	h->kind = kind;
+	h->count = 0;
+	h->waiters = 0;
+	h->spin = spin;
+	h->spun = 0;
+	h->slept = 0;
+	if (kind == HANDOFF_SEM && sem_init(&h->sem, 0, 0))
+		return -errno;
+
+	return 0;
+}
+
+void handoff_destroy(struct handoff *h)
+{
+	if (h->kind == HANDOFF_SEM)
+		sem_destroy(&h->sem);
+}
+
+void handoff_post(struct handoff *h)
+{
+	if (h->kind == HANDOFF_SEM) {
+		sem_post(&h->sem);
+		return;
+	}
+
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST))
+		futex_wake(&h->count, 1);
+}
+
+static inline int handoff_take(struct handoff *h)
+{
+	int c = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+	while (c > 0)
+		if (__atomic_compare_exchange_n(&h->count, &c, c - 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return 1;
+	return 0;
+}
+
+int handoff_trywait(struct handoff *h)
+{
+	if (h->kind == HANDOFF_SEM)
+		return sem_trywait(&h->sem) ? -errno : 0;
+
+	return handoff_take(h) ? 0 : -EAGAIN;
+}
+
+/*
+ * Like sem_wait(), a cancellation point: the futex system call is not
+ * one, so whoever cancels a waiter must post once to wake it up. A
+ * cancel is acted upon after the take too, whether that post or another
+ * one was taken, so a cancelled waiter never returns to run a step.
+ */
+int handoff_wait(struct handoff *h)
+{
+	unsigned int n;
+	int ret;
+
+	if (h->kind == HANDOFF_SEM) {
+		ret = sem_wait(&h->sem) ? -errno : 0;
+		pthread_testcancel();
+		return ret;
+	}
+
+	pthread_testcancel();
+	for (n = 0; n < h->spin; n++) {
+		if (handoff_take(h)) {
+			++(h->spun);
+			pthread_testcancel();
+			return 0;
+		}
+		cpu_relax();
+	}
+
+	__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+	while (!handoff_take(h)) {
+		futex_wait(&h->count, 0);
+		pthread_testcancel();
+	}
+	__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+	++(h->slept);
+	pthread_testcancel();
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __HANDOFF_H_
+#define __HANDOFF_H_
+
+#include <semaphore.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* polls of the futex word before giving up the cpu, at most */
+#define HANDOFF_MAX_SPIN 100000
+
+/*
+ * HANDOFF_SEM is a plain POSIX semaphore.
+ * HANDOFF_FUTEX is a counting semaphore on a futex word that first spins
+ * for a while, so a wakeup that comes soon costs no system call on
+ * either side, and only then sleeps in the kernel.
+ */
+enum handoff_kind {
+	HANDOFF_SEM = 0,
+	HANDOFF_FUTEX = 1,
+};
+
+struct handoff {
+	enum handoff_kind kind;
+	sem_t sem;
+	int count;
+	int waiters;
+	unsigned int spin;
+	/* futex only: waits served while spinning, and the others */
+	unsigned long spun;
+	unsigned long slept;
+};
+
+int handoff_init(struct handoff *h, enum handoff_kind kind,
+		 unsigned int spin);
+void handoff_destroy(struct handoff *h);
+void handoff_post(struct handoff *h);
+int handoff_wait(struct handoff *h);
+int handoff_trywait(struct handoff *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HANDOFF_H_ */
@@ -0,0 +1,102 @@
+/**
+ * @file facelockedloop/histogram.c
+ * @brief Percentiles out of fixed-size log-bucketed histograms.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+/* largest value a bucket may hold */
+static unsigned long long bucket_top(int idx)
+{
+	int bits;
+
+	if (idx < HISTOGRAM_SUB)
+		return idx;
+
+	bits = idx / HISTOGRAM_SUB - 1 + HISTOGRAM_SUB_BITS;
+	return ((unsigned long long)(HISTOGRAM_SUB + idx % HISTOGRAM_SUB + 1)
+		<< (bits - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+/* not atomic with respect to the writer, a few samples may survive */
+void histogram_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+unsigned long histogram_count(struct histogram *h)
+{
+	unsigned long count = 0;
+	int n;
+
+	for (n = 0; n < HISTOGRAM_BUCKETS; n++)
+		count += __atomic_load_n(&h->buckets[n], __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/* samples recorded in 'now' since it looked like 'then' */
+void histogram_since(struct histogram *r, struct histogram *now,
+		     struct histogram *then)
+{
+	unsigned long b;
+	int n;
+
+	for (n = 0; n < HISTOGRAM_BUCKETS; n++) {
+		b = __atomic_load_n(&now->buckets[n], __ATOMIC_RELAXED);
+		r->buckets[n] = b > then->buckets[n] ? b - then->buckets[n] : 0;
+	}
+	r->max = 0;
+}
+
+/* value below which 'percent' of the samples fall, never above max */
+unsigned long long histogram_percentile(struct histogram *h,
+					double percent)
+{
+	unsigned long long top, max;
+	unsigned long count, seen = 0, target;
+	double rank;
+	int n;
+
+	count = histogram_count(h);
+	if (!count)
+		return 0;
+
+	rank = count * percent / 100.0;
+	target = (unsigned long)rank;
+	if (target < rank || target < 1)
+		++target;
+	if (target > count)
+		target = count;
+
+	max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	for (n = 0; n < HISTOGRAM_BUCKETS; n++) {
+		seen += __atomic_load_n(&h->buckets[n], __ATOMIC_RELAXED);
+		if (seen >= target)
+			break;
+	}
+	top = bucket_top(n < HISTOGRAM_BUCKETS ? n : HISTOGRAM_BUCKETS - 1);
+
+	return (max && top > max) ? max : top;
+}
+
+void histogram_print(const char *label, struct histogram *h)
+{
+	unsigned long count = histogram_count(h);
+
+	if (!count)
+		return;
+
+	printf("    %-8s n %lu, p50 %lluus, p90 %lluus, p99 %lluus, "
+	       "p99.9 %lluus, max %lluus.\n", label, count,
+	       histogram_percentile(h, 50.0) / 1000,
+	       histogram_percentile(h, 90.0) / 1000,
+	       histogram_percentile(h, 99.0) / 1000,
+	       histogram_percentile(h, 99.9) / 1000,
+	       __atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1000);
+}
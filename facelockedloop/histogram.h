@@ -0,0 +1,66 @@
+#ifndef __HISTOGRAM_H_
+#define __HISTOGRAM_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Log-bucketed histogram of nanosecond values: every power of two is
+ * split in HISTOGRAM_SUB buckets, so a reported value is at most 1/8 off,
+ * from 1ns up to about 18 minutes, in a fixed 2.4KiB.
+ */
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+/*
+ * One writer, any number of readers: the writer never locks nor
+ * allocates, readers may see a sample in the buckets before it reaches
+ * 'max'.
+ */
+struct histogram {
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+	unsigned long long max;
+};
+
+static inline int histogram_bucket(unsigned long long ns)
+{
+	int bits;
+
+	if (ns < HISTOGRAM_SUB)
+		return ns;
+
+	bits = 63 - __builtin_clzll(ns);
+	if (bits >= HISTOGRAM_MAX_BITS)
+		return HISTOGRAM_BUCKETS - 1;
+
+	return (bits - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+		((ns >> (bits - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+static inline void histogram_record(struct histogram *h,
+				    unsigned long long ns)
+{
+	unsigned long *b = &h->buckets[histogram_bucket(ns)];
+
+	__atomic_store_n(b, *b + 1, __ATOMIC_RELAXED);
+	if (ns > h->max)
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void histogram_reset(struct histogram *h);
+unsigned long histogram_count(struct histogram *h);
+void histogram_since(struct histogram *r, struct histogram *now,
+		     struct histogram *then);
+unsigned long long histogram_percentile(struct histogram *h,
+					double percent);
+void histogram_print(const char *label, struct histogram *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HISTOGRAM_H_ */
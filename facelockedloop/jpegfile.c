@@ -0,0 +1,483 @@
+/**
+ * @file facelockedloop/jpegfile.c
+ * @brief MJPEG and JPEG files as a capture source, decoded to luma.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "jpegfile.h"
+#include "kernel_utils.h"
+#include "time_utils.h"
+#include "debug.h"
+
+#define MARKER_SOI 0xd8
+#define MARKER_EOI 0xd9
+#define MARKER_SOS 0xda
+#define MARKER_RST0 0xd0
+#define MARKER_RST7 0xd7
+#define MARKER_TEM 0x01
+
+static int jpeg_standalone(unsigned char code)
+{
+	return code == MARKER_TEM || (code >= MARKER_RST0 && code <= MARKER_RST7);
+}
+
+/*
+ * Length of the JPEG image at p, up to and including its EOI, walking
+ * the marker segments and the entropy coded data of every scan; so an
+ * SOI within, such as that of an EXIF thumbnail, is not taken for the
+ * next image. -EINVAL if p is not the start of a whole image.
+ */
+long jpeg_frame_len(const unsigned char *p, size_t len)
+{
+	unsigned char code;
+	size_t n = 2;
+
+	if (len < 4 || p[0] != 0xff || p[1] != MARKER_SOI)
+		return -EINVAL;
+
+	for (;;) {
+		if (n + 1 >= len || p[n] != 0xff)
+			return -EINVAL;
+		/* fill bytes */
+		while (n + 1 < len && p[n + 1] == 0xff)
+			n++;
+		if (n + 1 >= len)
+			return -EINVAL;
+		code = p[n + 1];
+		n += 2;
+		if (code == MARKER_EOI)
+			return n;
+		if (jpeg_standalone(code))
+			continue;
+		if (n + 2 > len)
+			return -EINVAL;
+		n += (size_t)p[n] << 8 | p[n + 1];
+		if (code != MARKER_SOS)
+			continue;
+		/* up to the next marker, stuffed 0xff00 and RSTn are data */
+		while (n + 1 < len && !(p[n] == 0xff && p[n + 1] &&
+					p[n + 1] != 0xff &&
+					!jpeg_standalone(p[n + 1])))
+			n++;
+	}
+}
+
+/* as far down as a face of min_face pixels is still found */
+int jpeg_denom(int min_face)
+{
+	int denom = 1;
+
+	while (denom < JPEG_MAX_DENOM &&
+	       min_face / (denom * 2) >= JPEG_MIN_WINDOW)
+		denom *= 2;
+	return denom;
+}
+
+/* the spec of a JPEG source, for --video: see jpegfile_open() */
+int jpegfile_match(const char *spec)
+{
+	static const char *const suffixes[] = {
+		".mjpg", ".mjpeg", ".jpg", ".jpeg",
+	};
+	const char *at = strrchr(spec, '@');
+	size_t len = at ? (size_t)(at - spec) : strlen(spec), n, slen;
+
+	if (memchr(spec, '%', len))
+		return 1;
+	for (n = 0; n < sizeof(suffixes) / sizeof(suffixes[0]); n++) {
+		slen = strlen(suffixes[n]);
+		if (len > slen &&
+		    !strncasecmp(spec + len - slen, suffixes[n], slen))
+			return 1;
+	}
+	return 0;
+}
+
+#if defined(HAVE_LIBJPEG)
+
+static void jpegdec_error(j_common_ptr c)
+{
+	struct jpegdec *d = container_of(c->err, struct jpegdec, jerr);
+
+	longjmp(d->fail, 1);
+}
+
+/* corrupt data is counted, not printed for every frame */
+static void jpegdec_message(j_common_ptr c)
+{
+}
+
+int jpegdec_init(struct jpegdec *d)
+{
+	d->cinfo.err = jpeg_std_error(&d->jerr);
+	d->jerr.error_exit = jpegdec_error;
+	d->jerr.output_message = jpegdec_message;
+	d->errors = 0;
+	if (setjmp(d->fail))
+		return -ENOMEM;
+	jpeg_create_decompress(&d->cinfo);
+	return 0;
+}
+
+void jpegdec_fini(struct jpegdec *d)
+{
+	jpeg_destroy_decompress(&d->cinfo);
+}
+
+/*
+ * Decodes one image to gray at 1/denom of its size, in rows of stride
+ * bytes of the size bytes at out. Returns -ENOSPC, with the size it
+ * needs in width and height, if it does not fit.
+ */
+int jpegdec_gray(struct jpegdec *d, const unsigned char *data, size_t len,
+		 int denom, unsigned char *out, size_t stride, size_t size,
+		 int *width, int *height)
+{
+	struct jpeg_decompress_struct *c = &d->cinfo;
+	JSAMPROW row;
+
+	if (setjmp(d->fail)) {
+		jpeg_abort_decompress(c);
+		++(d->errors);
+		return -EBADMSG;
+	}
+
+	jpeg_mem_src(c, (unsigned char *)data, len);
+	jpeg_read_header(c, TRUE);
+	c->out_color_space = JCS_GRAYSCALE;
+	c->scale_num = 1;
+	c->scale_denom = denom;
+	c->dct_method = JDCT_IFAST;
+	jpeg_calc_output_dimensions(c);
+	*width = c->output_width;
+	*height = c->output_height;
+	if (c->output_width > stride ||
+	    (size_t)c->output_height * stride > size) {
+		jpeg_abort_decompress(c);
+		return -ENOSPC;
+	}
+
+	jpeg_start_decompress(c);
+	while (c->output_scanline < c->output_height) {
+		row = out + (size_t)c->output_scanline * stride;
+		jpeg_read_scanlines(c, &row, 1);
+	}
+	jpeg_finish_decompress(c);
+	return 0;
+}
+
+#endif /* HAVE_LIBJPEG */
+
+#if defined(HAVE_OPENCV2)
+
+#if defined(HAVE_LIBJPEG)
+
+/* where every image of a mapped file starts, or just how many there are */
+static unsigned long jpegfile_index(struct jpegfile *j)
+{
+	unsigned long count = 0;
+	size_t off = 0;
+	long n;
+
+	while (off < j->len) {
+		n = j->map[off] == 0xff ?
+			jpeg_frame_len(j->map + off, j->len - off) : -EINVAL;
+		if (n < 0) {
+			/* padding, or a truncated image */
+			off++;
+			continue;
+		}
+		if (j->offsets) {
+			j->offsets[count] = off;
+			j->sizes[count] = n;
+		}
+		count++;
+		off += n;
+	}
+	return count;
+}
+
+static int jpegfile_map(struct jpegfile *j, const char *path)
+{
+	struct stat st;
+
+	j->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (j->fd < 0 || fstat(j->fd, &st))
+		return -errno;
+	j->len = st.st_size;
+	j->map = mmap(NULL, j->len, PROT_READ, MAP_SHARED, j->fd, 0);
+	if (j->map == MAP_FAILED) {
+		j->map = NULL;
+		return -errno;
+	}
+	madvise(j->map, j->len, MADV_SEQUENTIAL);
+
+	j->nframes = jpegfile_index(j);
+	if (!j->nframes)
+		return -ENODATA;
+	j->offsets = malloc(j->nframes * sizeof(*j->offsets));
+	j->sizes = malloc(j->nframes * sizeof(*j->sizes));
+	if (!j->offsets || !j->sizes)
+		return -ENOMEM;
+	jpegfile_index(j);
+	return 0;
+}
+
+/* one integer conversion, such as %d or %05d, and nothing else */
+static int jpegfile_pattern(const char *pattern)
+{
+	const char *p = strchr(pattern, '%');
+
+	if (!p)
+		return 0;
+	for (p++; isdigit((unsigned char)*p); p++)
+		;
+	return *p == 'd' && !strchr(p, '%');
+}
+
+/* files numbered from 0 or 1, up to the first one missing */
+static int jpegfile_sequence(struct jpegfile *j, const char *pattern)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	int n;
+
+	if (!jpegfile_pattern(pattern))
+		return -EINVAL;
+	j->pattern = pattern;
+	for (j->first = 0; j->first < 2; j->first++) {
+		snprintf(name, sizeof(name), pattern, j->first);
+		if (!stat(name, &st))
+			break;
+	}
+	for (n = j->first; ; n++) {
+		snprintf(name, sizeof(name), pattern, n);
+		if (stat(name, &st))
+			break;
+		if ((size_t)st.st_size > j->buflen)
+			j->buflen = st.st_size;
+		++(j->nframes);
+	}
+	if (!j->nframes)
+		return -ENOENT;
+	j->buf = malloc(j->buflen);
+	return j->buf ? 0 : -ENOMEM;
+}
+
+static int jpegfile_read(struct jpegfile *j, int n)
+{
+	char name[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(name, sizeof(name), j->pattern, n);
+	fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, j->buf, j->buflen);
+	close(fd);
+	if (len < 0)
+		return -EIO;
+	j->data = j->buf;
+	j->datalen = len;
+	return 0;
+}
+
+static void jpegfile_close(struct imager *i)
+{
+	struct jpegfile *j = i->params.jpeg;
+
+	if (!j)
+		return;
+	if (j->decoded)
+		printf("%s: %lu images decoded at 1/%d, %llu us each, "
+		       "%lu corrupt.\n", j->path, j->decoded, j->denom,
+		       j->decode_ns / j->decoded / FLL_NANOSECONDS_IN_MICROSECOND,
+		       j->dec.errors);
+	if (j->denom)
+		jpegdec_fini(&j->dec);
+	if (j->image)
+		cvReleaseImage(&j->image);
+	if (j->map)
+		munmap(j->map, j->len);
+	if (j->fd >= 0)
+		close(j->fd);
+	free(j->offsets);
+	free(j->sizes);
+	free(j->buf);
+	free((char *)j->path);
+	free(j);
+	i->params.jpeg = NULL;
+}
+
+/*
+ * <file.mjpg|file.jpg|pattern>[@<fps>], a pattern such as img%04d.jpg
+ * for a sequence. Images are decoded as small as i->params.min_face
+ * allows, and that is the scale faces are found at.
+ */
+static int jpegfile_open(struct imager *i)
+{
+	struct jpegfile *j;
+	char *spec, *at;
+	int fps = -1, ret;
+
+	j = calloc(1, sizeof(*j));
+	spec = strdup(i->params.path);
+	if (!j || !spec) {
+		free(j);
+		free(spec);
+		return -ENOMEM;
+	}
+	j->fd = -1;
+	j->path = spec;
+	i->params.jpeg = j;
+
+	at = strrchr(spec, '@');
+	if (at) {
+		*at++ = '\0';
+		fps = atoi(at);
+	}
+	ret = strchr(spec, '%') ? jpegfile_sequence(j, spec) :
+		jpegfile_map(j, spec);
+	if (ret) {
+		printf("%s: no JPEG images to play: %s.\n", spec,
+		       strerror(-ret));
+		goto fail;
+	}
+	ret = jpegdec_init(&j->dec);
+	if (ret)
+		goto fail;
+
+	j->denom = jpeg_denom(i->params.min_face);
+	j->fps = fps >= 0 ? fps : CAPTURE_DEFAULT_FPS;
+	i->params.scale = j->denom;
+	if (j->fps) {
+		i->rate.fps = j->fps;
+		i->rate.applied_fps = j->fps;
+	}
+	printf("%s: %lu JPEG images, luma at 1/%d, %d fps.\n", spec,
+	       j->nframes, j->denom, j->fps);
+	return 0;
+fail:
+	jpegfile_close(i);
+	return ret;
+}
+
+static int jpegfile_grab(struct imager *i)
+{
+	struct jpegfile *j = i->params.jpeg;
+
+	capture_pace(&j->due, j->fps);
+
+	if (j->next == j->nframes) {
+		j->next = 0;
+		++(j->loops);
+	}
+	if (j->pattern)
+		return jpegfile_read(j, j->first + j->next++);
+
+	j->data = j->map + j->offsets[j->next];
+	j->datalen = j->sizes[j->next];
+	j->next++;
+	return 0;
+}
+
+static int jpegfile_decode(struct jpegfile *j, int *width, int *height)
+{
+	IplImage *img = j->image;
+
+	if (!img)
+		return jpegdec_gray(&j->dec, j->data, j->datalen, j->denom,
+				    NULL, 0, 0, width, height);
+	return jpegdec_gray(&j->dec, j->data, j->datalen, j->denom,
+			    (unsigned char *)img->imageData, img->widthStep,
+			    img->imageSize, width, height);
+}
+
+/* decoded only now, frames skipped by the cadence never are */
+static void *jpegfile_retrieve(struct imager *i)
+{
+	struct jpegfile *j = i->params.jpeg;
+	struct timespec start, stop;
+	int width, height, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = jpegfile_decode(j, &width, &height);
+	if (ret == -ENOSPC) {
+		/* the first image, or one of another size */
+		debug(i, "allocate %dx%d decode image\n", width, height);
+		if (j->image)
+			cvReleaseImage(&j->image);
+		j->image = cvCreateImage(cvSize(width, height), IPL_DEPTH_8U,
+					 1);
+		if (!j->image)
+			return NULL;
+		ret = jpegfile_decode(j, &width, &height);
+	}
+	if (ret)
+		return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	++(j->decoded);
+	j->decode_ns += timespec_delta(&start, &stop);
+
+	return j->image;
+}
+
+static enum capture_format jpegfile_format(struct imager *i)
+{
+	return CAPTURE_FORMAT_GRAY;
+}
+
+static int jpegfile_set_fps(struct imager *i, int fps)
+{
+	i->params.jpeg->fps = fps;
+	timespec_zero(&i->params.jpeg->due);
+	return 0;
+}
+
+const struct capture_source jpegfile_source = {
+	.name = "jpeg",
+	.stable = 0,
+	.open = jpegfile_open,
+	.grab = jpegfile_grab,
+	.retrieve = jpegfile_retrieve,
+	.format = jpegfile_format,
+	.set_fps = jpegfile_set_fps,
+	.close = jpegfile_close,
+};
+
+#else
+
+static int jpegfile_open(struct imager *i)
+{
+	printf("%s: fll was built without libjpeg.\n", i->params.path);
+	return -ENOTSUP;
+}
+
+static void jpegfile_close(struct imager *i)
+{
+}
+
+const struct capture_source jpegfile_source = {
+	.name = "jpeg",
+	.open = jpegfile_open,
+	.close = jpegfile_close,
+};
+
+#endif /* HAVE_LIBJPEG */
+
+#endif /* HAVE_OPENCV2 */
@@ -0,0 +1,96 @@
+#ifndef __JPEGFILE_H_
+#define __JPEGFILE_H_
+
+#include <sys/types.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(HAVE_LIBJPEG)
+#include <jpeglib.h>
+#endif
+
+#include "capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* smallest face the frontal cascades find, in pixels */
+#define JPEG_MIN_WINDOW 24
+/* libjpeg scales down by 1/2, 1/4 or 1/8 in the DCT */
+#define JPEG_MAX_DENOM 8
+
+#if defined(HAVE_LIBJPEG)
+
+/*
+ * A decoder of JPEG images straight to gray, optionally scaled down in
+ * the DCT, so that neither the chroma nor the skipped coefficients are
+ * ever worked on.
+ */
+struct jpegdec {
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	jmp_buf fail;
+	unsigned long errors;
+};
+
+int jpegdec_init(struct jpegdec *d);
+void jpegdec_fini(struct jpegdec *d);
+int jpegdec_gray(struct jpegdec *d, const unsigned char *data, size_t len,
+		 int denom, unsigned char *out, size_t stride, size_t size,
+		 int *width, int *height);
+
+#endif
+
+long jpeg_frame_len(const unsigned char *p, size_t len);
+int jpeg_denom(int min_face);
+int jpegfile_match(const char *spec);
+
+#if defined(HAVE_OPENCV2)
+
+/*
+ * MJPEG (JPEG images back to back) or single JPEG files, mapped, or a
+ * numbered sequence of JPEG files (a printf pattern) read one at a time
+ * into a buffer the size of the largest; as a capture source of luma
+ * frames, decoded at 1/denom of their size.
+ */
+struct jpegfile {
+	const char *path;
+	int fd;
+	unsigned char *map;
+	size_t len;
+	/* where each image starts in the mapping, and its length */
+	off_t *offsets;
+	size_t *sizes;
+	/* sequence: pattern, number of the first file and the buffer */
+	const char *pattern;
+	int first;
+	unsigned char *buf;
+	size_t buflen;
+	/* the image grabbed, to be decoded on retrieve */
+	const unsigned char *data;
+	size_t datalen;
+	unsigned long nframes;
+	unsigned long next;
+	unsigned long loops;
+	int fps;
+	struct timespec due;
+	int denom;
+#if defined(HAVE_LIBJPEG)
+	struct jpegdec dec;
+#endif
+	IplImage *image;
+	unsigned long decoded;
+	unsigned long long decode_ns;
+};
+
+extern const struct capture_source jpegfile_source;
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __JPEGFILE_H_ */
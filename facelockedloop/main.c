@@ -6,6 +6,7 @@
  *
  */
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <signal.h>
 #include <pthread.h>
@@ -15,18 +16,48 @@
 #include <getopt.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "pipeline.h"
 #include "capture.h"
 #include "detect.h"
 #include "track.h"
+#include "reorder.h"
+#include "threads.h"
+#include "trace.h"
+#include "governor.h"
+#include "shmstats.h"
+#include "control.h"
+#include "rt.h"
 #include "time_utils.h"
 #include "debug.h"
 
 extern const char *fll_version_name;
 #define FLL_MAX_SERVO_COUNT SERVOLIB_MAX_SERVO_COUNT
 #define FLL_SERVO_COUNT 2
+#define FLL_MAX_DETECTORS STAGE_MAX_LINKS
+#define FLL_MAX_CAMERAS STORE_MAX_CAMERAS
 #define FLL ((struct stage *)NULL)
+/* detector runs on the capture worker */
+#define FLL_FUSE_DETECT 0x1
+/* tracker runs on the worker of the stage feeding it */
+#define FLL_FUSE_TRACK 0x2
+/* fuse whatever turns out cheaper to run back to back */
+#define FLL_FUSE_AUTO 0x4
+/* runs of a stage before judging it */
+#define FLL_AUTOFUSE_SAMPLES 100
+/* one per kind of stage: capture, detect, reorder, track */
+#define FLL_MAX_BUDGETS 4
+/* governor: slowest camera rate, sparsest detection, ms between looks */
+#define FLL_GOVERNOR_MIN_FPS 5
+#define FLL_GOVERNOR_MAX_CADENCE 8
+#define FLL_GOVERNOR_PERIOD 1000
+/* ms between updates of the --shm segment */
+#define FLL_SHM_PERIOD 200
+/* widest face size, highest frame rate the control socket accepts */
+#define FLL_MAX_FACE_SIZE 4096
+#define FLL_MAX_FPS 120
+#define FLL_MAX_CADENCE 64
 
 static struct pipeline fllpipe;
 static volatile sigset_t set;
@@ -101,6 +132,208 @@ static const struct option options[] = {
 		.has_arg = 1,
 		.flag = NULL,
 	},
+	{
+#define pmode_opt 11
+		.name = "pipeline",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define qdepth_opt 12
+		.name = "depth",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define ndet_opt 13
+		.name = "detectors",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define latest_opt 14
+		.name = "latest",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+#define sched_opt 15
+		.name = "sched",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define config_opt 16
+		.name = "config",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define stats_opt 17
+		.name = "stats",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define trace_opt 18
+		.name = "trace",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define handoff_opt 19
+		.name = "handoff",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define fuse_opt 20
+		.name = "fuse",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define budget_opt 21
+		.name = "budget",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define governor_opt 22
+		.name = "governor",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define shm_opt 23
+		.name = "shm",
+		.has_arg = 2,
+		.flag = NULL,
+	},
+	{
+#define control_opt 24
+		.name = "control",
+		.has_arg = 2,
+		.flag = NULL,
+	},
+	{
+#define rt_opt 25
+		.name = "rt",
+		.has_arg = 2,
+		.flag = NULL,
+	},
+	{
+#define display_opt 26
+		.name = "display",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define grabber_opt 27
+		.name = "grabber",
+		.has_arg = 0,
+		.flag = NULL,
+	},
+	{
+#define servos_opt 28
+		.name = "servos",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+#define size_opt 29
+		.name = "size",
+		.has_arg = 1,
+		.flag = NULL,
+	},
+	{
+		.name = NULL,
+	},
+};
+
+/* settings from the command line and the configuration file */
+static struct fll_config {
+	char *outfile;
+	char *xmlfile;
+	/* one per --video, played from a file when there is a path */
+	struct fll_camera {
+		int video;
+		const char *path;
+		/* --servos, camera 0 defaults to servodev and its channels */
+		int servos;
+		int servodev;
+		int pan;
+		int tilt;
+	} cameras[FLL_MAX_CAMERAS];
+	int ncameras;
+	enum object_detector_t dtype;
+	enum pipeline_mode pmode;
+	int servodevnode;
+	int panchannel;
+	int tiltchannel;
+	int loops;
+	int dmins;
+	int dmaxs;
+	int qdepth;
+	int ndetectors;
+	int latest;
+	int stats;
+	enum handoff_kind handoff;
+	unsigned int spin;
+	int fuse;
+	struct fll_budget {
+		char stage[8];
+		unsigned long long ns;
+		enum stage_overrun action;
+	} budgets[FLL_MAX_BUDGETS];
+	int nbudgets;
+	struct governor_params governor;
+	const char *shmname;
+	const char *ctlpath;
+	/* worker stack size, 0: no real-time mode */
+	size_t rt;
+	/* draw and show the faces found */
+	int display;
+	/* grab on a thread of its own, see capture_start_grabber() */
+	int grabber;
+	/* asked of the cameras, 0: their default */
+	int width;
+	int height;
+} config = {
+	.outfile = NULL,
+	.xmlfile = "haarcascade_frontalface_default.xml",
+	.ncameras = 0,
+	.dtype = CDT_HAAR,
+	.pmode = PIPELINE_OVERLAPPED,
+	.servodevnode = 0,
+	.panchannel = 1,
+	.tiltchannel = 5,
+	.loops = 0,
+	.dmins = 100,
+	.dmaxs = 180,
+	.qdepth = STAGE_QUEUE_DEFAULT_DEPTH,
+	.ndetectors = 1,
+	.latest = 0,
+	.stats = 0,
+	.handoff = HANDOFF_SEM,
+	.spin = 0,
+	.fuse = 0,
+	.nbudgets = 0,
+	.governor = {
+		.name = "GOV",
+		.target = 0,
+		.min_fps = FLL_GOVERNOR_MIN_FPS,
+		.max_fps = CAPTURE_DEFAULT_FPS,
+		.max_cadence = FLL_GOVERNOR_MAX_CADENCE,
+		.period = FLL_GOVERNOR_PERIOD,
+	},
+	.shmname = NULL,
+	.ctlpath = NULL,
+	.rt = 0,
+	.display = 1,
+	.grabber = 0,
+	.width = 0,
+	.height = 0,
 };
 
 static void usage(void)
@@ -110,8 +343,27 @@ static void usage(void)
 		":specifies detector config file (default: ~/cascade.xml)\n");
 	fprintf(stderr, "            --output[=<file-tmpl>]          "
 		":dump output data (default: discard)                    \n");
-	fprintf(stderr, "            --video[=<camera-index>] 	     "
-		":specifies which camera to use (default: any camera)    \n");
+	fprintf(stderr, "            --video[=<camera-index>|<file>] "
+		":specifies which camera to use (default: any camera)    \n"
+		"                                             "
+		" or plays a video file: <file.y4m>[@<fps>], or        \n"
+		"                                             "
+		" <file>:<w>x<h>[:gray|i420|nv12][@<fps>] for raw frames,\n"
+		"                                             "
+		" <file.mjpg|file.jpg|img%%04d.jpg>[@<fps>] for JPEG,    \n"
+		"                                             "
+		" or draws faces: scene[:<w>x<h>][:faces=<n>][:size=<px>]\n"
+		"                                             "
+		"  [:path=<circle|bounce|line|still>][:speed=<px>]      \n"
+		"                                             "
+		"  [:noise=<n>][:light=<frames>][:image=<face.png>]     \n"
+		"                                             "
+		"  [:truth=<file>][@<fps>], truth: where the faces were \n"
+		"                                             "
+		" looping over it; fps 0: as fast as fll goes;          \n"
+		"                                             "
+		" repeat for up to %d cameras, one tracker each         \n",
+		FLL_MAX_CAMERAS);
 	fprintf(stderr, "            --algorithm[=<haar>|<lsvm>]     "
 		":select which detection algorithm to use (default: haar)\n");
 	fprintf(stderr, "            --servodevnode=<dev-node-index> "
@@ -122,6 +374,13 @@ static void usage(void)
 	fprintf(stderr, "            --tiltchannel[=<channel-index>] "
 		":specifies which channel the tilt servo is connected to "
 		"(default: 5)\n");
+	fprintf(stderr, "            --servos=<camera>:<dev>:<pan>:<tilt>"
+		"\n"
+		"                                            "
+		":servo device and channels steered by the second and "
+		"next\n"
+		"                                            "
+		" cameras (default: camera 0 on the options above)\n");
 	fprintf(stderr, "            --nloops=<n>                    "
 		":specifies number of pipeline iterations to run, if 0 run "
 		"forever (default: 0)\n");
@@ -129,11 +388,674 @@ static void usage(void)
 		":specifies min size for the detector (default: 80)     \n");
 	fprintf(stderr, "            --max_s=<n>]                    "
 		":specifies max size for the detector (default: 180)    \n");
+	fprintf(stderr, "            --pipeline=<overlapped|lockstep|"
+		"cooperative>\n"
+		"                                            "
+		":run stages concurrently, one at a time, or all on the "
+		"main thread (default: overlapped)\n");
+	fprintf(stderr, "            --depth=<n>                     "
+		":frames queued between two stages, 1 to 16 (default: 1)\n");
+	fprintf(stderr, "            --detectors=<n>                 "
+		":detector instances working in parallel, 1 to 8 "
+		"(default: 1)\n");
+	fprintf(stderr, "            --latest                        "
+		":frames and results not yet taken are overwritten by "
+		"newer ones (default: queued)\n");
+	fprintf(stderr, "            --sched=<thread>:<cpus>"
+		"[:<policy>[:<prio>]][:isolate]\n"
+		"                                            "
+		":cpus (any, 1, 2-3, 0,2) and policy (other, fifo, rr) of\n"
+		"                                            "
+		" the capture, grab, detect, reorder, track, override,\n"
+		"                                            "
+		" signal, control or main threads, repeat for each one\n"
+		"                                            "
+		" (default: any cpu)\n");
+	fprintf(stderr, "            --config=<file>                 "
+		":read options from file, one <option>[=<value>] per line\n");
+	fprintf(stderr, "            --stats=<s>                     "
+		":print stage statistics every s seconds, SIGUSR1 prints "
+		"them at once (default: on exit only)\n");
+	fprintf(stderr, "            --trace=<file>                  "
+		":save stage, servo and cascade activity as Chrome trace "
+		"JSON on exit (default: off)\n");
+	fprintf(stderr, "            --handoff=<sem|futex[:<spin>]>  "
+		":how stages wake up, futex polls up to spin times before "
+		"sleeping (default: sem)\n");
+	fprintf(stderr, "            --fuse=<detect|track|auto>[,...]"
+		":run detection on the capture thread, tracking on the "
+		"thread feeding it,\n"
+		"                                            "
+		" or any stage cheaper than its handoff (default: none)\n");
+	fprintf(stderr, "            --budget=<stage>:<ms>[:<action>]"
+		":time a capture, detect, reorder or track step may take;\n"
+		"                                            "
+		" on overrun count, skip the next item, or roi: detect "
+		"around\n"
+		"                                            "
+		" the last face only (default: none, action: count)\n");
+	fprintf(stderr, "            --governor=<ms>[:<min>-<max fps>"
+		"[:<n>]]\n"
+		"                                            "
+		":keep the p90 latency under ms, trading camera fps and\n"
+		"                                            "
+		" detecting 1 frame in up to n (default: off, 5-30 fps, "
+		"n 8)\n");
+	fprintf(stderr, "            --shm[=<name>]                  "
+		":publish live statistics in shared memory for fll-top\n"
+		"                                            "
+		" (default: off, name: %s)\n", SHMSTATS_NAME);
+	fprintf(stderr, "            --control[=<path>]              "
+		":change settings while running through a UNIX socket,\n"
+		"                                            "
+		" e.g. echo list | nc -U <path> (default: off, path: %s)\n",
+		CONTROL_PATH);
+	fprintf(stderr, "            --rt[=<KiB>]                    "
+		":lock memory, prefault worker stacks of KiB and buffers,\n"
+		"                                            "
+		" report faults and allocations after warm-up "
+		"(default: off, %d KiB)\n", RT_STACK_DEFAULT / 1024);
+	fprintf(stderr, "            --display=<0|1>                 "
+		":draw and show the faces found; with 0, luma frames are\n"
+		"                                            "
+		" never converted to BGR (default: 1)\n");
+	fprintf(stderr, "            --grabber                       "
+		":grab every frame on a thread of its own as it comes,\n"
+		"                                            "
+		" the pipeline takes the newest; reports grab jitter\n");
+	fprintf(stderr, "            --size=<w>x<h>                  "
+		":frame size asked of the cameras, e.g. 320x240 to grab\n"
+		"                                            "
+		" and detect 4 times less; --min_s/--max_s are in pixels\n"
+		"                                            "
+		" of that size (default: the camera's)\n");
 	fprintf(stderr, "            --help                          "
 		"this help\n");
 }
 
 
+static int load_config(const char *path);
+
+static int parse_fuse(const char *arg)
+{
+	char *copy, *tok, *save;
+	int ret = 0;
+
+	copy = strdup(arg);
+	if (!copy)
+		return -ENOMEM;
+
+	config.fuse = 0;
+	for (tok = strtok_r(copy, ",", &save); tok && !ret;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "detect"))
+			config.fuse |= FLL_FUSE_DETECT;
+		else if (!strcmp(tok, "track"))
+			config.fuse |= FLL_FUSE_TRACK;
+		else if (!strcmp(tok, "auto"))
+			config.fuse |= FLL_FUSE_AUTO;
+		else
+			ret = -EINVAL;
+	}
+	free(copy);
+	return ret;
+}
+
+/* frame rate and cpu time of the main loop, to compare the executors */
+static void print_rate(struct timespec *start, struct rusage *before,
+		       unsigned long frames)
+{
+	struct timespec now;
+	struct rusage after;
+	unsigned long usecs, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	getrusage(RUSAGE_SELF, &after);
+	usecs = timespec_delta(start, &now) / FLL_NANOSECONDS_IN_MICROSECOND;
+	cpu = timeval_usecs(&after.ru_utime) + timeval_usecs(&after.ru_stime) -
+		timeval_usecs(&before->ru_utime) -
+		timeval_usecs(&before->ru_stime);
+	if (!usecs)
+		return;
+
+	printf("%lu frames, %lu.%02lu fps, cpu %lu%% of one core, "
+	       "%ld+%ld context switches.\n", frames,
+	       frames * FLL_MICROSECONDS_IN_SECOND / usecs,
+	       frames * FLL_MICROSECONDS_IN_SECOND * 100 / usecs % 100,
+	       cpu * 100 / usecs, after.ru_nvcsw - before->ru_nvcsw,
+	       after.ru_nivcsw - before->ru_nivcsw);
+}
+
+/*
+ * Refreshes the --shm segment from the main thread, the stage workers
+ * are not involved: their counters are read as they go, like SIGUSR1.
+ */
+static void publish_stats(struct shmstats *shm, struct imager *camera,
+			  int ncam, struct detector *algorithm,
+			  struct tracker *servo)
+{
+	struct shmstats_camera *sc;
+	int i, k;
+
+	shmstats_begin(shm);
+	shmstats_stages(shm, &fllpipe);
+	shm->frames = 0;
+	shm->faces = 0;
+	for (i = 0; i < config.ndetectors; i++)
+		shm->faces += __atomic_load_n(&algorithm[i].stats.faces,
+					      __ATOMIC_RELAXED);
+	shm->ncameras = ncam;
+	for (k = 0; k < ncam; k++) {
+		sc = &shm->cameras[k];
+		sc->frames = camera[k].step.stats.ofinterest;
+		sc->fps = __atomic_load_n(&camera[k].rate.fps,
+					  __ATOMIC_RELAXED);
+		sc->cadence = __atomic_load_n(&camera[k].rate.cadence,
+					      __ATOMIC_RELAXED);
+		sc->e2e_p50 = histogram_percentile(&servo[k].stats.e2e, 50.0);
+		sc->e2e_p99 = histogram_percentile(&servo[k].stats.e2e, 99.0);
+		sc->dev = servo[k].params.dev;
+		sc->servos[0] = servo[k].stats.pan_stats;
+		sc->servos[1] = servo[k].stats.tilt_stats;
+		shm->frames += sc->frames;
+	}
+	shmstats_end(shm);
+}
+
+/*
+ * What the control socket may change: detection is shared by the pool,
+ * tracking and the rate are set per camera. The governors own the rate.
+ */
+static int control_settings(struct control *ctl,
+			    struct detector_tunables *detection,
+			    struct tracker *servo, struct imager *camera,
+			    int ncam)
+{
+	int k, ret;
+
+	ret = control_register(ctl, "min_s", CONTROL_SHARED,
+			       &detection->min_size, 1, FLL_MAX_FACE_SIZE,
+			       "smallest face, pixels");
+	ret = ret ? : control_register(ctl, "max_s", CONTROL_SHARED,
+				       &detection->max_size, 1,
+				       FLL_MAX_FACE_SIZE,
+				       "largest face, pixels");
+	ret = ret ? : control_register(ctl, "scale", CONTROL_SHARED,
+				       &detection->scale, 101, 200,
+				       "haar scale factor, %");
+	ret = ret ? : control_register(ctl, "neighbours", CONTROL_SHARED,
+				       &detection->neighbours, 0, 16,
+				       "haar neighbours to confirm a face");
+	ret = ret ? : control_register(ctl, "overlap", CONTROL_SHARED,
+				       &detection->overlap, 0, 100,
+				       "lsvm overlap threshold, %");
+	for (k = 0; !ret && k < ncam; k++) {
+		ret = control_register(ctl, "pan_rate", k,
+				       &servo[k].tunables.pan_rate, 1, 1024,
+				       "error pixels per pan step, 640x480");
+		ret = ret ? : control_register(ctl, "tilt_rate", k,
+					       &servo[k].tunables.tilt_rate,
+					       1, 1024, "error pixels per "
+					       "tilt step, 640x480");
+		ret = ret ? : control_register(ctl, "hold", k,
+					       &servo[k].tunables.hold, 0,
+					       10 * FLL_MILISECONDS_IN_SECOND,
+					       "ms to hold still after a move");
+		if (ret || config.governor.target)
+			continue;
+		ret = control_register(ctl, "fps", k, &camera[k].rate.fps, 1,
+				       FLL_MAX_FPS, "camera frame rate");
+		ret = ret ? : control_register(ctl, "cadence", k,
+					       &camera[k].rate.cadence, 1,
+					       FLL_MAX_CADENCE,
+					       "frames per one detected");
+	}
+	return ret;
+}
+
+/*
+ * Startup steps that do not depend on each other: opening the camera,
+ * loading the cascades and homing the servos run side by side, each on
+ * a thread of its own, and are joined before the stages get linked.
+ */
+struct fll_startup {
+	char name[16];
+	int (*init)(struct fll_startup *s);
+	void *stage;
+	void *params;
+	pthread_t tid;
+	int threaded;
+	unsigned long long took;
+	int ret;
+};
+
+static int startup_camera(struct fll_startup *s)
+{
+	return capture_initialize(s->stage, s->params, &fllpipe);
+}
+
+static int startup_detector(struct fll_startup *s)
+{
+	return detect_initialize(s->stage, s->params, &fllpipe);
+}
+
+static int startup_tracker(struct fll_startup *s)
+{
+	return track_initialize(s->stage, s->params, &fllpipe);
+}
+
+static void *startup_step(void *arg)
+{
+	struct fll_startup *s = arg;
+	struct timespec start, stop;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	s->ret = s->init(s);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	s->took = timespec_delta(&start, &stop);
+	return NULL;
+}
+
+/* a step that cannot get a thread runs on the caller's */
+static void startup(struct fll_startup *steps, int n)
+{
+	struct timespec start, stop;
+	unsigned long long serial = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; i++)
+		steps[i].threaded = !pthread_create(&steps[i].tid, NULL,
+						    startup_step, &steps[i]);
+	for (i = 0; i < n; i++) {
+		if (steps[i].threaded)
+			pthread_join(steps[i].tid, NULL);
+		else
+			startup_step(&steps[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+
+	for (i = 0; i < n; i++) {
+		printf("startup: %-12s %6llums%s.\n", steps[i].name,
+		       steps[i].took / FLL_NANOSECONDS_IN_MILISECOND,
+		       steps[i].ret ? ", failed" : "");
+		serial += steps[i].took;
+	}
+	printf("startup: ready in %llums, %llums one after another.\n",
+	       timespec_delta(&start, &stop) / FLL_NANOSECONDS_IN_MILISECOND,
+	       serial / FLL_NANOSECONDS_IN_MILISECOND);
+}
+
+/*
+ * Real-time mode, before the first pipeline_run(): everything the first
+ * frames would otherwise allocate on the way, for every camera, as any
+ * detector of the pool may get the frames of any of them.
+ */
+static void warm_up(struct imager *camera, int ncam,
+		    struct detector *algorithm)
+{
+	void *image;
+	int i, k, ret;
+
+	for (k = 0; k < ncam; k++) {
+		image = capture_prepare(&camera[k]);
+		if (!image) {
+			printf("rt: no frame of camera %d to warm up on.\n",
+			       k);
+			continue;
+		}
+		for (i = 0; i < config.ndetectors; i++) {
+			ret = detect_prepare(&algorithm[i], image,
+					     camera[k].params.scale, k);
+			if (ret)
+				printf("rt: %s warm-up on camera %d failed, "
+				       "ret:%d.\n",
+				       algorithm[i].step.params.name, k, ret);
+		}
+	}
+	printf("rt: warmed up, %d steps per stage to go before faults and "
+	       "allocations are reported.\n", STAGE_RT_WARMUP);
+}
+
+/* <stage>:<ms>[:<count|skip|roi>], the last one given for a stage wins */
+static int parse_budget(const char *arg)
+{
+	static const char *const stages[] = {
+		"capture", "detect", "reorder", "track",
+	};
+	struct fll_budget b, *entry = NULL;
+	char *copy, *tok, *save, *end;
+	double ms;
+	int n, ret = -EINVAL;
+
+	copy = strdup(arg);
+	if (!copy)
+		return -ENOMEM;
+
+	memset(&b, 0, sizeof(b));
+	b.action = STAGE_OVERRUN_COUNT;
+	tok = strtok_r(copy, ":", &save);
+	for (n = 0; tok && n < FLL_MAX_BUDGETS; n++)
+		if (!strcmp(tok, stages[n]))
+			break;
+	if (!tok || n == FLL_MAX_BUDGETS)
+		goto out;
+	strcpy(b.stage, stages[n]);
+
+	tok = strtok_r(NULL, ":", &save);
+	if (!tok)
+		goto out;
+	ms = strtod(tok, &end);
+	if (*end || ms <= 0)
+		goto out;
+	b.ns = ms * FLL_NANOSECONDS_IN_MILISECOND;
+
+	tok = strtok_r(NULL, ":", &save);
+	if (tok) {
+		if (!strcmp(tok, "skip"))
+			b.action = STAGE_OVERRUN_SKIP;
+		else if (!strcmp(tok, "roi") && !strcmp(b.stage, "detect"))
+			b.action = STAGE_OVERRUN_DEGRADE;
+		else if (strcmp(tok, "count"))
+			goto out;
+		if (strtok_r(NULL, ":", &save))
+			goto out;
+	}
+
+	for (n = 0; n < config.nbudgets; n++)
+		if (!strcmp(config.budgets[n].stage, b.stage))
+			entry = &config.budgets[n];
+	if (!entry)
+		entry = &config.budgets[config.nbudgets++];
+	*entry = b;
+	ret = 0;
+out:
+	free(copy);
+	return ret;
+}
+
+/* <ms>[:<min fps>-<max fps>[:<max cadence>]] */
+static int parse_governor(const char *arg)
+{
+	struct governor_params *g = &config.governor;
+	char *end;
+	double ms;
+
+	ms = strtod(arg, &end);
+	if (ms <= 0)
+		return -EINVAL;
+	g->target = ms * FLL_NANOSECONDS_IN_MILISECOND;
+	if (!*end)
+		return 0;
+
+	if (sscanf(end, ":%d-%d:%d", &g->min_fps, &g->max_fps,
+		   &g->max_cadence) < 2)
+		return -EINVAL;
+	if (g->min_fps < 1 || g->max_fps < g->min_fps || g->max_cadence < 1)
+		return -EINVAL;
+	return 0;
+}
+
+/* <camera>:<dev>:<pan channel>:<tilt channel> */
+static int parse_servos(const char *arg)
+{
+	struct fll_camera *cam;
+	int k, dev, pan, tilt;
+	char extra;
+
+	if (sscanf(arg, "%d:%d:%d:%d%c", &k, &dev, &pan, &tilt,
+		   &extra) != 4)
+		return -EINVAL;
+	if (k < 0 || k >= FLL_MAX_CAMERAS || dev < 0 || pan < 0 ||
+	    tilt < 0 || pan == tilt)
+		return -EINVAL;
+
+	cam = &config.cameras[k];
+	cam->servos = 1;
+	cam->servodev = dev;
+	cam->pan = pan;
+	cam->tilt = tilt;
+	return 0;
+}
+
+/* every camera steers two servos of its own */
+static int check_servos(void)
+{
+	struct fll_camera *c, *o;
+	int k, n;
+
+	c = &config.cameras[0];
+	if (!c->servos) {
+		c->servos = 1;
+		c->servodev = config.servodevnode;
+		c->pan = config.panchannel;
+		c->tilt = config.tiltchannel;
+	}
+	for (k = 0; k < config.ncameras; k++) {
+		c = &config.cameras[k];
+		if (!c->servos) {
+			printf("camera %d has no servos, see --servos.\n", k);
+			return -EINVAL;
+		}
+		for (n = 0; n < k; n++) {
+			o = &config.cameras[n];
+			if (o->servodev == c->servodev &&
+			    (o->pan == c->pan || o->pan == c->tilt ||
+			     o->tilt == c->pan || o->tilt == c->tilt)) {
+				printf("cameras %d and %d share a servo.\n",
+				       n, k);
+				return -EINVAL;
+			}
+		}
+	}
+	return 0;
+}
+
+/* reported, not fatal: the stage then runs without a budget */
+static int apply_budget(struct fll_budget *b, struct stage *s)
+{
+	int ret = stage_set_budget(s, b->ns, b->action);
+
+	if (ret)
+		printf("cannot set the %s budget of %s, ret:%d.\n", b->stage,
+		       s->params.name, ret);
+	return ret;
+}
+
+static int parse_option(int lindex, char *arg)
+{
+	struct fll_camera *cam;
+
+	switch (lindex) {
+	case help_opt:
+		usage();
+		exit(0);
+	case xmlfile_opt:
+		config.xmlfile = arg;
+		break;
+	case output_opt:
+		with_output = 1;
+		config.outfile = arg;
+		break;
+	case camera_opt:
+		if (config.ncameras == FLL_MAX_CAMERAS)
+			return -EINVAL;
+		cam = &config.cameras[config.ncameras++];
+		if (arg && arg[strspn(arg, "0123456789")]) {
+			cam->path = arg;
+			break;
+		}
+		cam->path = NULL;
+		cam->video = arg ? atoi(arg) : 0;
+		break;
+	case servos_opt:
+		return parse_servos(arg);
+	case size_opt:
+		if (sscanf(arg, "%dx%d", &config.width, &config.height) != 2 ||
+		    config.width < 1 || config.height < 1)
+			return -EINVAL;
+		break;
+	case algrthm_opt:
+		if (arg && strncmp(arg, "lsvm",4) == 0)
+			config.dtype = CDT_LSVM;
+		break;
+	case trackdev_opt:
+		config.servodevnode = atoi(arg);
+		break;
+	case trackpan_opt:
+		config.panchannel = atoi(arg);
+		break;
+	case tracktilt_opt:
+		config.tiltchannel = atoi(arg);
+		break;
+	case nloops_opt:
+		config.loops = atoi(arg);
+		break;
+	case dmins_opt:
+		config.dmins = atoi(arg);
+		break;
+	case dmaxs_opt:
+		config.dmaxs = atoi(arg);
+		break;
+	case pmode_opt:
+		if (strncmp(arg, "lockstep", 8) == 0)
+			config.pmode = PIPELINE_LOCKSTEP;
+		else if (strncmp(arg, "cooperative", 11) == 0)
+			config.pmode = PIPELINE_COOPERATIVE;
+		else
+			config.pmode = PIPELINE_OVERLAPPED;
+		break;
+	case qdepth_opt:
+		config.qdepth = atoi(arg);
+		break;
+	case ndet_opt:
+		config.ndetectors = atoi(arg);
+		if (config.ndetectors < 1 ||
+		    config.ndetectors > FLL_MAX_DETECTORS)
+			return -EINVAL;
+		break;
+	case latest_opt:
+		config.latest = 1;
+		break;
+	case sched_opt:
+		if (threads_configure(arg)) {
+			printf("invalid thread setting '%s'.\n", arg);
+			return -EINVAL;
+		}
+		break;
+	case config_opt:
+		return load_config(arg);
+	case stats_opt:
+		config.stats = atoi(arg);
+		if (config.stats < 0)
+			return -EINVAL;
+		break;
+	case trace_opt:
+		return trace_start(strdup(arg));
+	case handoff_opt:
+		if (strncmp(arg, "futex", 5) == 0) {
+			config.handoff = HANDOFF_FUTEX;
+			config.spin = arg[5] == ':' ? atoi(arg + 6) : 0;
+			if (config.spin > HANDOFF_MAX_SPIN)
+				return -EINVAL;
+		} else if (strcmp(arg, "sem") == 0) {
+			config.handoff = HANDOFF_SEM;
+		} else {
+			return -EINVAL;
+		}
+		break;
+	case fuse_opt:
+		return parse_fuse(arg);
+	case budget_opt:
+		return parse_budget(arg);
+	case governor_opt:
+		return parse_governor(arg);
+	case shm_opt:
+		config.shmname = arg && *arg ? arg : SHMSTATS_NAME;
+		break;
+	case control_opt:
+		config.ctlpath = arg && *arg ? arg : CONTROL_PATH;
+		break;
+	case rt_opt:
+		config.rt = arg && *arg ? (size_t)atoi(arg) * 1024 :
+			RT_STACK_DEFAULT;
+		if (config.rt <= RT_STACK_MARGIN)
+			return -EINVAL;
+		break;
+	case grabber_opt:
+		config.grabber = 1;
+		break;
+	case display_opt:
+		config.display = atoi(arg);
+		if (config.display != 0 && config.display != 1)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Same options as the command line, without the dashes, one per line;
+ * '#' starts a comment. Options given later on the command line win.
+ */
+static int load_config(const char *path)
+{
+	static int nesting;
+	char line[256], *name, *arg, *end;
+	int lindex, n, ret = 0;
+	FILE *f;
+
+	if (nesting) {
+		printf("%s: nested configuration files.\n", path);
+		return -ELOOP;
+	}
+
+	f = fopen(path, "r");
+	if (!f) {
+		printf("cannot open configuration file %s.\n", path);
+		return -errno;
+	}
+
+	++nesting;
+	for (n = 1; !ret && fgets(line, sizeof(line), f); n++) {
+		end = strchr(line, '#');
+		if (end)
+			*end = '\0';
+		for (end = line + strlen(line);
+		     end > line && isspace((unsigned char)end[-1]); end--)
+			*(end - 1) = '\0';
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		if (!*name)
+			continue;
+
+		arg = strchr(name, '=');
+		if (arg)
+			*arg++ = '\0';
+
+		for (lindex = 0; options[lindex].name; lindex++)
+			if (!strcmp(options[lindex].name, name))
+				break;
+		if (!options[lindex].name ||
+		    (options[lindex].has_arg == 1 && !arg) ||
+		    (!options[lindex].has_arg && arg)) {
+			printf("%s:%d: invalid option '%s'.\n", path, n, name);
+			ret = -EINVAL;
+			break;
+		}
+		ret = parse_option(lindex, arg ? strdup(arg) : NULL);
+		if (ret)
+			printf("%s:%d: invalid value for '%s'.\n", path, n,
+			       name);
+	}
+	--nesting;
+
+	fclose(f);
+	return ret;
+}
+
 /*helper function*/
 static void *signal_catch(void *arg)
 {
@@ -141,7 +1063,11 @@ static void *signal_catch(void *arg)
 	int sig;
 	for (;;) {
 		sigwait(monitorset, &sig);
-		
+		if (sig == SIGUSR1) {
+			pipeline_printstats(&fllpipe);
+			continue;
+		}
+
 		printf("caught signal %d. Terminate!\n", sig);
 		if (sig == SIGINT) {
 			pipeline_terminate(&fllpipe, -EINTR);
@@ -152,7 +1078,7 @@ static void *signal_catch(void *arg)
 }
 
 	
-static void setup_term_signals(void)
+static pthread_t setup_term_signals(void)
 {
 	pthread_attr_t attr;
 	pthread_t id;
@@ -163,6 +1089,7 @@ static void setup_term_signals(void)
 	sigaddset((sigset_t*)&set, SIGHUP);  /* 0x0001 */
 	sigaddset((sigset_t*)&set, SIGINT);  /* 0x0002 */
 	sigaddset((sigset_t*)&set, SIGQUIT); /* 0x0003 */
+	sigaddset((sigset_t*)&set, SIGUSR1); /* statistics */
 	
 	/*all threads created after this point will share same mask.*/
 	pthread_sigmask(SIG_BLOCK, (sigset_t*)&set, NULL);
@@ -170,37 +1097,48 @@ static void setup_term_signals(void)
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 	pthread_create(&id, &attr, signal_catch, (sigset_t*)&set);
 	pthread_attr_destroy(&attr);
+
+	return id;
 }
 
 int main(int argc, char *const argv[])
 {
-	char *outfile, *xmlfile;
-	int video = 0;
-	struct timespec start_time, stop_time, duration;
+	struct timespec start_time, stop_time, duration, now, reported;
+	struct timespec published;
+	struct rusage start_usage;
 	int pos[FLL_MAX_SERVO_COUNT] =
 		{ [0 ... FLL_MAX_SERVO_COUNT -1] = -1};
 	int speed[FLL_MAX_SERVO_COUNT] =
 		{ [0 ... FLL_MAX_SERVO_COUNT -1] = -1};
 	int accel[FLL_MAX_SERVO_COUNT] =
 		{ [0 ... FLL_MAX_SERVO_COUNT -1] = -1};
-	struct tracker_params servo_params;
-	struct imager_params camera_params;
+	struct tracker_params servo_params[FLL_MAX_CAMERAS];
+	struct imager_params camera_params[FLL_MAX_CAMERAS];
 	struct detector_params algorithm_params;
-	struct imager camera;
-	struct detector algorithm;
-	struct tracker servo;
-	enum object_detector_t dtype = CDT_HAAR;
-	int lindex, c, i, l, ret, panchannel, tiltchannel, servodevnode, loops;
-	int dmins, dmaxs;
+	struct detector_params detector_params[FLL_MAX_DETECTORS];
+	/* cameras, detectors, servos */
+	struct fll_startup steps[2 * FLL_MAX_CAMERAS + FLL_MAX_DETECTORS];
+	struct detector_tunables detection;
+	struct reorder_params sequencer_params;
+	struct imager camera[FLL_MAX_CAMERAS];
+	struct detector algorithm[FLL_MAX_DETECTORS];
+	struct reorder sequencer[FLL_MAX_CAMERAS];
+	struct tracker servo[FLL_MAX_CAMERAS];
+	struct stage *results[FLL_MAX_CAMERAS];
+	/* capture, reorder and track stage, and governor, of each camera */
+	char names[FLL_MAX_CAMERAS][4][20];
+	struct fll_camera *cam;
+	struct fll_budget *b;
+	struct governor_params gov_params;
+	struct governor gov[FLL_MAX_CAMERAS];
+	struct shmstats *shm = NULL;
+	struct control ctl;
+	pthread_t sigcatcher;
+	int lindex, c, i, k, n, l, ret;
+	int ncam, ntracker;
+	unsigned long frames;
+	int (*link)(struct pipeline *, struct stage *, struct stage *);
 	char ch;
-	servodevnode = 0;
-	outfile = NULL;
-	xmlfile = "haarcascade_frontalface_default.xml";
-	panchannel = 1;
-	tiltchannel = 5;
-	loops = 0;
-	dmins = 100;
-	dmaxs = 180;
 	
 	/* get local configurations */
 	for (;;) {
@@ -208,110 +1146,327 @@ int main(int argc, char *const argv[])
 		c = getopt_long_only(argc, argv, "", options, &lindex);
 		if (c == EOF)
 			break;
-		switch (lindex) {
-		case help_opt:
-			usage();
-			exit(0);
-		case xmlfile_opt:
-			xmlfile = optarg;
-			break;
-		case output_opt:
-			outfile = optarg;
-			break;
-		case camera_opt:
-			video = atoi(optarg);
-			break;
-		case algrthm_opt:
-			if (optarg && strncmp(optarg, "lsvm",4) == 0)
-				dtype = CDT_LSVM;
-			break;
-		case trackdev_opt:
-			servodevnode = atoi(optarg);
-			break;
-		case trackpan_opt:
-			panchannel = atoi(optarg);
-			break;
-		case tracktilt_opt:
-			tiltchannel = atoi(optarg);
-			break;
-		case nloops_opt:
-			loops = atoi(optarg);
-			break;
-		case dmins_opt:
-			dmins = atoi(optarg);
-			break;
-		case dmaxs_opt:
-			dmaxs = atoi(optarg);
-			break;
-		default:
+		if (c == '?' || parse_option(lindex, optarg)) {
 			usage();
 			exit(1);
 		}
 	}
-	if (xmlfile != NULL)
-		printf("cascade filter:%s.\n", xmlfile);
-	if (outfile != NULL)
-		printf("output data:%s.\n", outfile);
+	if (config.xmlfile != NULL)
+		printf("cascade filter:%s.\n", config.xmlfile);
+	if (config.outfile != NULL)
+		printf("output data:%s.\n", config.outfile);
+	if (!config.ncameras)
+		config.ncameras = 1;
+	if (check_servos())
+		exit(1);
+	ncam = config.ncameras;
+	for (k = 0; k < ncam; k++)
+		camera_params[k].name = NULL;
 
-	setup_term_signals();
+	/* before any thread, the stacks of the later ones are locked too */
+	if (config.rt && !rt_lock_memory())
+		rt_prefault_stack(RT_STACK_DEFAULT - RT_STACK_MARGIN);
+
+	sigcatcher = setup_term_signals();
 
 	pipeline_init(&fllpipe);
+	pipeline_set_mode(&fllpipe, config.pmode);
+	if (config.spin && sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		printf("handoff: spinning on a single cpu only delays the "
+		       "thread it waits for.\n");
+	pipeline_set_handoff(&fllpipe, config.handoff, config.spin);
+	if (pipeline_set_rt(&fllpipe, config.rt)) {
+		printf("rt: stacks of %zu bytes are too small.\n", config.rt);
+		exit(1);
+	}
+	ret = pipeline_set_depth(&fllpipe, config.qdepth);
+	if (ret) {
+		printf("invalid queue depth %d.\n", config.qdepth);
+		exit(1);
+	}
 
 
-	/* first stage */
-	camera_params.name = malloc(10);
-	ret = asprintf(&camera_params.name, "FLL cam%d", video);
-	if (ret < 0)
-		goto terminate;
-	
+	/* first stage, once per camera */
+	for (k = 0; k < ncam; k++) {
+		cam = &config.cameras[k];
+		if (cam->path)
+			ret = asprintf(&camera_params[k].name, "FLL %s",
+				       cam->path);
+		else
+			ret = asprintf(&camera_params[k].name, "FLL cam%d",
+				       cam->video);
+		if (ret < 0) {
+			camera_params[k].name = NULL;
+			goto terminate;
+		}
 
-	camera_params.vididx = video;
-	camera_params.frame = NULL;
-	camera_params.videocam = NULL;
-	ret = capture_initialize(&camera, &camera_params, &fllpipe);
-	if (ret) {
-		printf("capture init ret:%d.\n", ret);
-		goto terminate;
+		camera_params[k].vididx = cam->video;
+		camera_params[k].camera = k;
+		camera_params[k].path = cam->path;
+		camera_params[k].source = NULL;
+		camera_params[k].file = NULL;
+		camera_params[k].jpeg = NULL;
+		camera_params[k].scene = NULL;
+		camera_params[k].min_face = config.dmins;
+		camera_params[k].width = config.width;
+		camera_params[k].height = config.height;
+		camera_params[k].grabber = config.grabber;
+		camera_params[k].frame = NULL;
+		camera_params[k].videocam = NULL;
+		snprintf(steps[k].name, sizeof(steps[k].name), "camera %d", k);
+		steps[k].init = startup_camera;
+		steps[k].stage = &camera[k];
+		steps[k].params = &camera_params[k];
 	}
-	/* second stage */
-	algorithm_params.odt = dtype;
-	algorithm_params.cascade_xml = xmlfile;
+	/*
+	 * second stage: a pool of detectors, each with its own cascade copy
+	 * and scratch buffers, fed round-robin by the capture stages and
+	 * shared by every camera.
+	 */
+	algorithm_params.odt = config.dtype;
+	algorithm_params.cascade_xml = config.xmlfile;
 	algorithm_params.srcframe = NULL;
 	algorithm_params.dstframe = NULL;
 	algorithm_params.algorithm = NULL;
 	algorithm_params.scratchbuf = NULL;
-	algorithm_params.min_size = dmins;
-	algorithm_params.max_size = dmaxs;
-	ret = detect_initialize(&algorithm, &algorithm_params, &fllpipe);
+	algorithm_params.display = config.display;
+	algorithm_params.view = NULL;
+	detection.min_size = config.dmins;
+	detection.max_size = config.dmaxs;
+	detection.scale = DETECT_SCALE;
+	detection.neighbours = DETECT_NEIGHBOURS;
+	detection.overlap = DETECT_OVERLAP;
+	algorithm_params.tunables = &detection;
+	algorithm_params.name = config.ndetectors > 1 ?
+		"FLL det pool" : "FLL det";
+	for (i = 0; i < config.ndetectors; i++) {
+		detector_params[i] = algorithm_params;
+		snprintf(steps[ncam + i].name, sizeof(steps[ncam + i].name),
+			 "cascade %d", i);
+		steps[ncam + i].init = startup_detector;
+		steps[ncam + i].stage = &algorithm[i];
+		steps[ncam + i].params = &detector_params[i];
+	}
+	/* third stage, the servos of each camera */
+	ntracker = ncam + config.ndetectors;
+	for (k = 0; k < ncam; k++) {
+		cam = &config.cameras[k];
+		servo_params[k].name = NULL;
+		servo_params[k].pan_tgt = 0;
+		servo_params[k].tilt_tgt = 0;
+		servo_params[k].dev = cam->servodev;
+		servo_params[k].pan_params.channel = cam->pan;
+		servo_params[k].tilt_params.channel = cam->tilt;
+		snprintf(steps[ntracker + k].name,
+			 sizeof(steps[ntracker + k].name), "servos %d", k);
+		steps[ntracker + k].init = startup_tracker;
+		steps[ntracker + k].stage = &servo[k];
+		steps[ntracker + k].params = &servo_params[k];
+	}
+
+	startup(steps, ntracker + ncam);
+	for (k = 0; k < ncam; k++) {
+		if (steps[k].ret) {
+			printf("capture %d init ret:%d.\n", k, steps[k].ret);
+			goto terminate;
+		}
+	}
+	for (i = 0; i < config.ndetectors; i++) {
+		if (steps[ncam + i].ret) {
+			printf("detection %d init ret:%d.\n", i,
+			       steps[ncam + i].ret);
+			goto terminate;
+		}
+	}
+	for (k = 0; k < ncam; k++) {
+		if (steps[ntracker + k].ret) {
+			printf("tracking %d init ret:%d.\n", k,
+			       steps[ntracker + k].ret);
+			goto terminate;
+		}
+	}
+
+	for (k = 0; config.ndetectors > 1 && k < ncam; k++) {
+		stage_set_dispatch(&camera[k].step, STAGE_DISPATCH_RR);
+		sequencer_params.name = "FLL reorder";
+		sequencer_params.window = 0;
+		sequencer_params.latest = config.latest;
+		ret = reorder_initialize(&sequencer[k], &sequencer_params,
+					 &fllpipe);
+		if (ret) {
+			printf("reorder %d init ret:%d.\n", k, ret);
+			goto terminate;
+		}
+	}
+
+	/* several cameras: their stages are told apart in the statistics */
+	for (k = 0; ncam > 1 && k < ncam; k++) {
+		snprintf(names[k][0], sizeof(names[k][0]), "CAP_STG%d", k);
+		snprintf(names[k][1], sizeof(names[k][1]), "REO_STG%d", k);
+		snprintf(names[k][2], sizeof(names[k][2]), "TRA_STG%d", k);
+		snprintf(names[k][3], sizeof(names[k][3]), "%s%d",
+			 config.governor.name, k);
+		stage_set_name(&camera[k].step, names[k][0]);
+		if (config.ndetectors > 1)
+			stage_set_name(&sequencer[k].step, names[k][1]);
+		stage_set_name(&servo[k].step, names[k][2]);
+	}
+
+	/*
+	 * capture(s) -> detection(s) [-> reorder] -> tracking, per camera.
+	 * The output links of a detector are in camera order: with several
+	 * cameras, each result goes to the one its frame came from.
+	 */
+	link = config.latest ? pipeline_link_latest : pipeline_link;
+	for (k = 0; k < ncam; k++)
+		results[k] = config.ndetectors > 1 ?
+			&sequencer[k].step : &servo[k].step;
+	for (k = 0; !ret && k < ncam; k++)
+		for (i = 0; !ret && i < config.ndetectors; i++)
+			ret = link(&fllpipe, &camera[k].step,
+				   &algorithm[i].step);
+	for (i = 0; !ret && i < config.ndetectors; i++) {
+		for (k = 0; !ret && k < ncam; k++)
+			ret = link(&fllpipe, &algorithm[i].step, results[k]);
+		if (!ret && ncam > 1)
+			ret = stage_set_dispatch(&algorithm[i].step,
+						 STAGE_DISPATCH_KEY);
+	}
+	for (k = 0; !ret && config.ndetectors > 1 && k < ncam; k++)
+		ret = link(&fllpipe, &sequencer[k].step, &servo[k].step);
 	if (ret) {
-		printf("detection init ret:%d.\n", ret);
+		printf("cannot link fll stages, ret:%d.\n", ret);
 		goto terminate;
 	}
-	/* third stage */
-	servo_params.pan_tgt = 0;
-	servo_params.tilt_tgt = 0;
-	servo_params.dev = servodevnode;
-	servo_params.pan_params.channel = panchannel;
-	servo_params.tilt_params.channel = tiltchannel;
 
-	ret = track_initialize(&servo , &servo_params, &fllpipe);
+	ret = pipeline_build(&fllpipe);
 	if (ret) {
-		printf("tracking init ret:%d.\n", ret);
+		printf("invalid fll pipeline, ret:%d.\n", ret);
 		goto terminate;
 	}
 
-	ret =pipeline_getcount(&fllpipe);
-	if (ret != PIPELINE_MAX_STAGE) {
-		printf("missing stages for fll, only %d present.\n", ret);
-		goto terminate;
+	/* a failed fusion leaves the stages on their own threads */
+	if (config.fuse & FLL_FUSE_DETECT) {
+		ret = pipeline_fuse(&fllpipe, &camera[0].step,
+				    &algorithm[0].step);
+		if (ret)
+			printf("cannot fuse detection, ret:%d.\n", ret);
 	}
+	for (k = 0; (config.fuse & FLL_FUSE_TRACK) && k < ncam; k++) {
+		results[k] = config.ndetectors > 1 ?
+			&sequencer[k].step : &algorithm[0].step;
+		ret = pipeline_fuse(&fllpipe, results[k], &servo[k].step);
+		if (ret)
+			printf("cannot fuse tracking %d, ret:%d.\n", k, ret);
+	}
+	ret = 0;
+	if (config.fuse & FLL_FUSE_AUTO)
+		pipeline_set_autofuse(&fllpipe, FLL_AUTOFUSE_SAMPLES);
+
+	for (i = 0; i < config.nbudgets; i++) {
+		b = &config.budgets[i];
+		if (!strcmp(b->stage, "capture"))
+			for (k = 0; k < ncam; k++)
+				apply_budget(b, &camera[k].step);
+		else if (!strcmp(b->stage, "track"))
+			for (k = 0; k < ncam; k++)
+				apply_budget(b, &servo[k].step);
+		else if (!strcmp(b->stage, "reorder") &&
+			 config.ndetectors > 1)
+			for (k = 0; k < ncam; k++)
+				apply_budget(b, &sequencer[k].step);
+		else if (!strcmp(b->stage, "detect"))
+			for (n = 0; n < config.ndetectors; n++)
+				apply_budget(b, &algorithm[n].step);
+	}
+
+	/*
+	 * A governor per camera, on the latency of its own tracker. They all
+	 * weigh the load of the shared detector pool, so a busy pool slows
+	 * every camera down.
+	 */
+	for (k = 0; config.governor.target && k < ncam; k++) {
+		gov_params = config.governor;
+		if (ncam > 1)
+			gov_params.name = names[k][3];
+		ret = governor_initialize(&gov[k], &gov_params, &camera[k],
+					  &servo[k].stats.e2e);
+		for (i = 0; !ret && i < config.ndetectors; i++)
+			ret = governor_add_detector(&gov[k],
+						    &algorithm[i].step);
+		if (ret) {
+			printf("cannot start the governor of camera %d, "
+			       "ret:%d.\n", k, ret);
+			config.governor.target = 0;
+		}
+	}
+	ret = 0;
+
+	if (config.shmname) {
+		shm = shmstats_open(config.shmname);
+		if (!shm)
+			printf("live statistics disabled.\n");
+	}
+
+	if (config.ctlpath) {
+		control_initialize(&ctl, config.ctlpath, &fllpipe);
+		ret = control_settings(&ctl, &detection, servo, camera,
+				       ncam);
+		ret = ret ? : control_start(&ctl);
+		if (ret) {
+			printf("runtime control disabled, ret:%d.\n", ret);
+			config.ctlpath = NULL;
+		}
+		ret = 0;
+	}
+
+	/* placement report, whether or not anything was asked for */
+	if (config.pmode != PIPELINE_COOPERATIVE) {
+		for (k = 0; k < ncam; k++)
+			threads_apply("capture", camera[k].step.params.name,
+				      camera[k].step.worker);
+		for (i = 0; i < config.ndetectors; i++)
+			threads_apply("detect", algorithm[i].step.params.name,
+				      algorithm[i].step.worker);
+		for (k = 0; config.ndetectors > 1 && k < ncam; k++)
+			threads_apply("reorder", sequencer[k].step.params.name,
+				      sequencer[k].step.worker);
+		for (k = 0; k < ncam; k++)
+			threads_apply("track", servo[k].step.params.name,
+				      servo[k].step.worker);
+	}
+	for (k = 0; k < ncam; k++)
+		if (servo[k].with_override)
+			threads_apply("override", "override",
+				      servo[k].override);
+	if (config.ctlpath)
+		threads_apply("control", "control", ctl.thread);
+	threads_apply("signal", "signal", sigcatcher);
+	threads_apply("main", "main", pthread_self());
 
 	
 	for (i=0; i < FLL_MAX_SERVO_COUNT; i++)
 		debug(FLL, "servo channel %d, pos:%d, speedLim:%d, accelLim:%d.\n",
 		       i, pos[i], speed[i], accel[i]);
 
+	if (config.rt)
+		warm_up(camera, ncam, algorithm);
+
+	for (k = 0; config.grabber && k < ncam; k++) {
+		ret = capture_start_grabber(&camera[k]);
+		if (ret)
+			printf("cannot start grabber %d, ret:%d, capture "
+			       "grabs on its own.\n", k, ret);
+		else
+			threads_apply("grab", "grabber",
+				      camera[k].grab.thread);
+		ret = 0;
+	}
+
 	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	getrusage(RUSAGE_SELF, &start_usage);
+	reported = start_time;
+	published = start_time;
 	for (l=0; ret >= 0; l++)  {
 		debug(FLL, "loop:%d.\n", l);
 		ret = pipeline_run(&fllpipe);
@@ -329,16 +1484,62 @@ int main(int argc, char *const argv[])
         	if (fllpipe.status == STAGE_ABRT)
 			break;
 
-		if (loops && (l >= loops))
+		if (config.loops && (l >= config.loops))
 			break;
+
+		if (config.display)
+			detect_show();
+
+		for (k = 0; config.governor.target && k < ncam; k++)
+			governor_update(&gov[k]);
+
+		if (shm) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespec_delta(&published, &now) >=
+			    FLL_SHM_PERIOD * FLL_NANOSECONDS_IN_MILISECOND) {
+				publish_stats(shm, camera, ncam, algorithm,
+					      servo);
+				published = now;
+			}
+		}
+
+		if (config.stats) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec - reported.tv_sec >= config.stats) {
+				pipeline_printstats(&fllpipe);
+				reported = now;
+			}
+		}
 	};
+	pipeline_printstats(&fllpipe);
+	for (k = 0; k < ncam; k++)
+		capture_print_stats(&camera[k]);
+	for (k = 0; config.ndetectors > 1 && k < ncam; k++)
+		reorder_print_stats(&sequencer[k]);
+	for (k = 0; config.governor.target && k < ncam; k++)
+		governor_print_stats(&gov[k]);
+	for (k = 0, frames = 0; k < ncam; k++)
+		frames += camera[k].step.stats.ofinterest;
+	print_rate(&start_time, &start_usage, frames);
+	if (shm) {
+		publish_stats(shm, camera, ncam, algorithm, servo);
+		shmstats_close(shm, config.shmname);
+	}
+	if (config.ctlpath) {
+		control_stop(&ctl);
+		control_print_stats(&ctl);
+	}
 terminate:
-	printf("camara %d: %s.\n", camera_params.vididx, camera_params.name);
+	for (k = 0; k < ncam && camera_params[k].name; k++)
+		printf("camara %d: %s.\n", camera_params[k].vididx,
+		       camera_params[k].name);
 	pipeline_teardown(&fllpipe);
+	trace_stop();
 	clock_gettime(CLOCK_MONOTONIC, &stop_time);
 	timespec_substract(&duration, &stop_time, &start_time);
 	printf("duration->  %lds %ldns .\n", duration.tv_sec , duration.tv_nsec );
-        free(camera_params.name);	
+	for (k = 0; k < ncam; k++)
+		free(camera_params[k].name);
 	printf("press a key to continue\n");
 	ch = getchar();
 	if (ch)
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <string.h>
@@ -7,8 +9,15 @@
 #include "pipeline.h"
 #include "time_utils.h"
 #include "debug.h"
+#include "trace.h"
+#include "rt.h"
+
+#define PIPELINE_GROW 4
 
 static void *stage_worker(void *arg);
+static void stage_step(struct stage *step);
+static void stage_release(struct stage *stg);
+static void stage_account(struct stage *s, struct timespec *delta);
 
 void stage_up(struct stage *stg, struct stage_params *p,
 	     struct stage_ops *o, struct pipeline *pipe)
@@ -18,131 +27,633 @@ void stage_up(struct stage *stg, struct stage_params *p,
 	stg->params = *p;
 	stg->ops = o;
 	stg->pipeline = pipe;
+	stg->flags = 0;
+	stg->reset = 0;
 	timespec_zero(&stg->duration);
 	timespec_zero(&stg->stats.lastrun);
 	timespec_zero(&stg->stats.overall);
 	stg->stats.ofinterest = 0;
 	stg->stats.persecond = 0;
-	stg->next = NULL;
-	sem_init(&stg->nowait, 0, 0);
-	sem_init(&stg->done, 0, 0);
-	pthread_mutex_init(&stg->lock, NULL);
-	pthread_cond_init(&stg->sync, NULL);
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	pthread_create(&stg->worker, &attr, stage_worker, stg);
-	pthread_attr_destroy(&attr);
+	memset(stg->stats.links, 0, sizeof(stg->stats.links));
+	histogram_reset(&stg->stats.run);
+	histogram_reset(&stg->stats.wait);
+	histogram_reset(&stg->stats.latency);
+	stg->nin = 0;
+	stg->nout = 0;
+	stg->inrr = 0;
+	stg->outrr = 0;
+	stg->inlast = 0;
+	stg->fused = NULL;
+	memset(&stg->budget, 0, sizeof(stg->budget));
+	memset(&stg->rt, 0, sizeof(stg->rt));
+	if (!stg->params.depth)
+		stg->params.depth = pipe->depth;
+	handoff_init(&stg->nowait, pipe->handoff, pipe->spin);
+	handoff_init(&stg->done, pipe->handoff, pipe->spin);
+	if (pipe->mode == PIPELINE_COOPERATIVE) {
+		stg->flags |= STAGE_INLINE;
+		stg->worker = pthread_self();
+	} else {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+		if (pipe->rt_stack)
+			pthread_attr_setstacksize(&attr, pipe->rt_stack);
+		pthread_create(&stg->worker, &attr, stage_worker, stg);
+		pthread_attr_destroy(&attr);
+	}
+	stg->self = stg;
 }
 
 static void *stage_worker(void *arg)
 {
-	struct timespec start, stop;
 	struct stage *step = arg;
 	int ret;
-	
+
+	trace_thread(step->params.name);
+	if (step->pipeline->rt_stack)
+		rt_prefault_stack(step->pipeline->rt_stack - RT_STACK_MARGIN);
 	for (;;)
 	{
 		/*wait for 'go' signal*/
-		ret = sem_wait(&step->nowait);
+		ret = handoff_wait(&step->nowait);
 		if (ret)
 			debug(step, "step %d wait error %d.\n",
 			       step->params.nth_stage, ret);
-		clock_gettime(CLOCK_MONOTONIC, &start);
-		if (step->ops->input)
-			ret = step->ops->input(step, NULL);
-		if (ret)
+		stage_step(step);
+		stage_release(step);
+		handoff_post(&step->done);
+		if (step->pipeline->mode == PIPELINE_OVERLAPPED)
+			handoff_post(&step->pipeline->completed);
+	}
+
+	return NULL;
+}
+
+/*
+ * The scheduler may start a producer on the slot a busy consumer is
+ * about to free. The producer then sleeps until that consumer takes its
+ * item, or ends its step without doing so; spinning instead would never
+ * let a lower priority consumer on the same cpu run. Returns whether the
+ * slot was freed.
+ */
+static int link_wait(struct stage_link *l)
+{
+	while (!handoff_trywait(&l->room))
+		;
+	__atomic_store_n(&l->waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (stage_queue_consumed(&l->q) <
+	       __atomic_load_n(&l->claim, __ATOMIC_RELAXED))
+		handoff_wait(&l->room);
+	__atomic_store_n(&l->waiting, 0, __ATOMIC_RELAXED);
+
+	return stage_queue_space(&l->q);
+}
+
+/* consumer side, once it popped an item or gave up its claim */
+static void link_wake(struct stage_link *l)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&l->waiting, __ATOMIC_RELAXED))
+		handoff_post(&l->room);
+}
+
+/* the step the stage was started for is over, and so are its claims */
+static void stage_release(struct stage *stg)
+{
+	struct stage_link *l;
+	int n;
+
+	for (n = 0; n < stg->nin; n++) {
+		l = stg->in[n];
+		__atomic_store_n(&l->claim, 0, __ATOMIC_RELAXED);
+		link_wake(l);
+	}
+}
+
+static void stage_step_fused(struct stage *s)
+{
+	while (stage_queue_count(&s->in[0]->q)) {
+		clock_gettime(CLOCK_MONOTONIC, &s->stats.lastrun);
+		stage_step(s);
+		stage_account(s, &s->duration);
+	}
+}
+
+/* the item goes back to whoever produced it, as if it were superseded */
+static void stage_skip(struct stage *stg)
+{
+	struct stage_link *l;
+	void *it;
+	int n;
+
+	++(stg->budget.skipped);
+	for (n = 0; n < stg->nin; n++) {
+		l = stg->in[(stg->inrr + n) % stg->nin];
+		if (!stage_queue_pop(&l->q, &it)) {
+			link_wake(l);
+			stg->inrr = (stg->inrr + n + 1) % stg->nin;
+			l->from->ops->discard(l->from, it);
+			return;
+		}
+	}
+}
+
+static void stage_overrun(struct stage *stg, struct timespec *at,
+			  unsigned long long took)
+{
+	struct stage_budget *b = &stg->budget;
+	struct overrun *o = &b->log[b->overruns % STAGE_OVERRUN_LOG];
+
+	o->at = *at;
+	o->took = took;
+	++(b->overruns);
+	if (took > b->worst)
+		b->worst = took;
+	trace_end("overrun", timespec_nsecs(at) - took);
+	debug(stg, "%s: step took %lluns, budget %lluns.\n",
+	      stg->params.name, took, b->ns);
+
+	if (b->action == STAGE_OVERRUN_SKIP)
+		b->skip = 1;
+	else if (b->action == STAGE_OVERRUN_DEGRADE)
+		stg->ops->degrade(stg);
+}
+
+/*
+ * Latencies, drops and overruns start over; the counters the stages keep
+ * of their own, such as frames captured, are left alone.
+ */
+static void stage_clear_stats(struct stage *stg)
+{
+	struct stage_budget *b = &stg->budget;
+
+	histogram_reset(&stg->stats.run);
+	histogram_reset(&stg->stats.wait);
+	histogram_reset(&stg->stats.latency);
+	memset(stg->stats.links, 0, sizeof(stg->stats.links));
+	b->overruns = 0;
+	b->skipped = 0;
+	b->worst = 0;
+	memset(b->log, 0, sizeof(b->log));
+	stg->rt.dirty = 0;
+	stg->rt.faults = 0;
+	stg->rt.allocs = 0;
+	if (stg->ops->reset)
+		stg->ops->reset(stg);
+}
+
+/* past warm-up, a step should neither fault nor touch the heap */
+static void stage_rt_check(struct stage *stg, struct rt_sample *s)
+{
+	int dirty = rt_since(s);
+
+	rt_watch(0);
+	if (stg->rt.steps++ < STAGE_RT_WARMUP || !dirty)
+		return;
+
+	stg->rt.faults += s->minflt + s->majflt;
+	stg->rt.allocs += s->allocs;
+	if (++(stg->rt.dirty) <= STAGE_RT_REPORT)
+		printf("rt: %s step %lu: %ld minor, %ld major page faults, "
+		       "%lu allocations.\n", stg->params.name, stg->rt.steps,
+		       s->minflt, s->majflt, s->allocs);
+}
+
+/* takes one item, if the stage has inputs, runs on it and hands it over */
+static void stage_step(struct stage *step)
+{
+	struct timespec start, taken, ran, stop;
+	struct rt_sample rt;
+	unsigned long long span;
+	int ret;
+
+	/* on the worker, so nothing is recorded while it happens */
+	if (__atomic_exchange_n(&step->reset, 0, __ATOMIC_ACQUIRE))
+		stage_clear_stats(step);
+
+	if (step->budget.skip) {
+		step->budget.skip = 0;
+		stage_skip(step);
+		timespec_zero(&step->duration);
+		return;
+	}
+
+	if (step->pipeline->rt_stack) {
+		rt_watch(1);
+		rt_sample(&rt);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	timespec_zero(&taken);
+	step->params.data_out = NULL;
+	if (step->ops->input) {
+		span = trace_begin();
+		ret = step->ops->input(step, NULL);
+		trace_end("input", span);
+		if (ret) {
 			debug(step, "step %d input error %d.\n",
 			       step->params.nth_stage, ret);
-		ret = step->ops->run(step);
+			goto done;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &taken);
+	} else {
+		taken = start;
+	}
+	span = trace_begin();
+	ret = step->ops->run(step);
+	trace_end("run", span);
+	if (ret)
+		debug(step, "step %d run error %d.\n",
+		       step->params.nth_stage, ret);
+	clock_gettime(CLOCK_MONOTONIC, &ran);
+	histogram_record(&step->stats.run, timespec_delta(&taken, &ran));
+	if (step->ops->output && step->params.data_out) {
+		span = trace_begin();
+		ret = step->ops->output(step, step->params.data_out);
+		trace_end("output", span);
 		if (ret)
-			debug(step, "step %d run error %d.\n",
+			debug(step, "step %d output error %d.\n",
 			       step->params.nth_stage, ret);
-		clock_gettime(CLOCK_MONOTONIC, &stop);
-		timespec_substract(&step->duration, &stop, &start);
-		sem_post(&step->done);
 	}
-	if (ret < 0)
-		debug(step, "step %d failed.\n", step->params.nth_stage);
-
-	debug(step, "step %d performance: nofinterest=%ld.\n",
-	       step->params.nth_stage,
-	       step->stats.ofinterest);
+done:
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	timespec_substract(&step->duration, &stop, &start);
+	if (taken.tv_sec || taken.tv_nsec)
+		histogram_record(&step->stats.latency,
+				 timespec_delta(&taken, &stop));
+	if (step->budget.ns &&
+	    timespec_nsecs(&step->duration) > step->budget.ns)
+		stage_overrun(step, &stop, timespec_nsecs(&step->duration));
+	if (step->pipeline->rt_stack)
+		stage_rt_check(step, &rt);
 
-	return NULL;
+	/* a fused consumer gets the item while it is still in cache */
+	if (step->fused)
+		stage_step_fused(step->fused);
 }
 
 void stage_go(struct stage *stg)
 {
-	sem_post(&stg->nowait);
+	if (stg->flags & STAGE_INLINE) {
+		stage_step(stg);
+		stage_release(stg);
+		handoff_post(&stg->done);
+		return;
+	}
+	handoff_post(&stg->nowait);
 }
 
 void stage_wait(struct stage *stg)
 {
-	int ret = sem_wait(&stg->done);
+	int ret = handoff_wait(&stg->done);
 	if (ret)
 		debug(stg, "%s: step %d wait error %d.\n",
 		       __func__, stg->params.nth_stage, ret);
 
 }
 
+/* number of consumers each output item is handed to */
+int stage_fanout(struct stage *stg)
+{
+	if (stg->params.dispatch != STAGE_DISPATCH_ALL)
+		return stg->nout ? 1 : 0;
+
+	return stg->nout;
+}
+
+int stage_set_dispatch(struct stage *stg, enum stage_dispatch dispatch)
+{
+	if (dispatch == STAGE_DISPATCH_KEY && !stg->ops->route)
+		return -EINVAL;
+
+	stg->params.dispatch = dispatch;
+	return 0;
+}
+
+/*
+ * As reported in the statistics; the name must outlive the stage. Traces
+ * keep the one the worker started with.
+ */
+void stage_set_name(struct stage *stg, const char *name)
+{
+	stg->params.name = name;
+}
+
+/* how long the worker of this stage polls for its next item */
+int stage_set_spin(struct stage *stg, unsigned int spin)
+{
+	if (spin > HANDOFF_MAX_SPIN)
+		return -EINVAL;
+
+	stg->nowait.spin = spin;
+	return 0;
+}
+
+/*
+ * Time a step (taking the item, running, handing it over) may take. Call
+ * once the stage is linked: skipping hands its items back to the discard
+ * op of their producers, so they must all have one.
+ */
+int stage_set_budget(struct stage *stg, unsigned long long ns,
+		     enum stage_overrun action)
+{
+	int n;
+
+	if (action == STAGE_OVERRUN_DEGRADE && !stg->ops->degrade)
+		return -EINVAL;
+	if (action == STAGE_OVERRUN_SKIP)
+		for (n = 0; n < stg->nin; n++)
+			if (!stg->in[n]->from->ops->discard)
+				return -EINVAL;
+
+	stg->budget.ns = ns;
+	stg->budget.action = action;
+	return 0;
+}
+
+/* hands the item to one link, releasing whatever it overwrote */
+static int stage_push(struct stage *stg, int idx, void *it)
+{
+	struct stage_link *l = stg->out[idx];
+	void *old;
+	int ret;
+
+	ret = stage_queue_replace(&l->q, it, &old);
+	if (ret == -EAGAIN && link_wait(l))
+		ret = stage_queue_replace(&l->q, it, &old);
+	if (old) {
+		++(stg->stats.links[idx].superseded);
+		stg->ops->discard(stg, old);
+	}
+	return ret;
+}
+
+/*
+ * Returns how many of the targeted consumers refused the item, or -EPIPE
+ * when the stage has no output link. An accepted item belongs to its
+ * consumer; refused ones stay with the caller, who must release them.
+ * Latest-only links never refuse: the item they held goes back to the
+ * producer through its discard op instead.
+ */
 int stage_output(struct stage *stg, void *it)
 {
-	struct stage *next = stg->next;
+	int n, idx, refused = 0;
+
+	if (!stg->nout)
+		return -EPIPE;
 
-	if (next) {
-		pthread_mutex_lock(&next->lock);
-		next->params.data_in = it;
-		pthread_cond_signal(&next->sync);
-		pthread_mutex_unlock(&next->lock);
+	if (stg->params.dispatch == STAGE_DISPATCH_KEY) {
+		idx = stg->ops->route(stg, it);
+		if (idx < 0 || idx >= stg->nout)
+			return 1;
+		if (stage_push(stg, idx, it)) {
+			++(stg->stats.links[idx].dropped);
+			return 1;
+		}
+		return 0;
 	}
-	return 0;
+
+	if (stg->params.dispatch == STAGE_DISPATCH_RR) {
+		for (n = 0; n < stg->nout; n++) {
+			idx = (stg->outrr + n) % stg->nout;
+			if (!stage_push(stg, idx, it)) {
+				stg->outrr = (idx + 1) % stg->nout;
+				return 0;
+			}
+		}
+		/* charged to the link whose turn it was */
+		++(stg->stats.links[stg->outrr].dropped);
+		return 1;
+	}
+
+	for (n = 0; n < stg->nout; n++)
+		if (stage_push(stg, n, it)) {
+			++(stg->stats.links[n].dropped);
+			++refused;
+		}
+
+	return refused;
 }
 
+/*
+ * Never blocks: -EAGAIN when nothing was queued for this stage. Input
+ * links are served round-robin, starting with the one the scheduler saw
+ * filled.
+ */
 int stage_input(struct stage *stg, void **it)
 {
-	pthread_mutex_lock(&stg->lock);
-	while (stg->params.data_in == NULL)
-		pthread_cond_wait(&stg->sync, &stg->lock);
+	int n, idx;
 
-	*it = stg->params.data_in;
-	pthread_mutex_unlock(&stg->lock);
-	return 0;
+	for (n = 0; n < stg->nin; n++) {
+		idx = (stg->inrr + n) % stg->nin;
+		if (!stage_queue_pop(&stg->in[idx]->q, it)) {
+			link_wake(stg->in[idx]);
+			histogram_record(&stg->stats.wait,
+					 stg->in[idx]->q.cons.waited);
+			stg->inrr = (idx + 1) % stg->nin;
+			stg->inlast = idx;
+			stg->params.data_in = *it;
+			return 0;
+		}
+	}
+	return -EAGAIN;
 }
 	
 void stage_down(struct stage *stg)
 {
-	pthread_cancel(stg->worker);
-	pthread_join(stg->worker, NULL);
-	pthread_cond_destroy(&stg->sync);
-	pthread_mutex_destroy(&stg->lock);
-	sem_destroy(&stg->nowait);
-	sem_destroy(&stg->done);
+	int n;
+
+	if (!(stg->flags & STAGE_INLINE)) {
+		pthread_cancel(stg->worker);
+		/* a worker asleep on a futex only notices once woken up */
+		if (stg->nowait.kind == HANDOFF_FUTEX) {
+			handoff_post(&stg->nowait);
+			for (n = 0; n < stg->nout; n++)
+				handoff_post(&stg->out[n]->room);
+		}
+		pthread_join(stg->worker, NULL);
+	}
+	handoff_destroy(&stg->nowait);
+	handoff_destroy(&stg->done);
+}
+
+static void stage_printbudget(struct stage *stg)
+{
+	static const char *const actions[] = { "count", "skip", "degrade" };
+	struct stage_budget *b = &stg->budget;
+	struct overrun *o;
+	unsigned long n;
+
+	if (!b->ns)
+		return;
+
+	printf("    budget   %lluus, %s: %lu overruns, worst %lluus, "
+	       "%lu skipped.\n", b->ns / FLL_NANOSECONDS_IN_MICROSECOND,
+	       actions[b->action], b->overruns,
+	       b->worst / FLL_NANOSECONDS_IN_MICROSECOND, b->skipped);
+	/* newest first */
+	for (n = 0; n < b->overruns && n < STAGE_OVERRUN_LOG; n++) {
+		o = &b->log[(b->overruns - 1 - n) % STAGE_OVERRUN_LOG];
+		printf("      overrun at %ld.%06lds: %lluus.\n", o->at.tv_sec,
+		       o->at.tv_nsec / FLL_NANOSECONDS_IN_MICROSECOND,
+		       o->took / FLL_NANOSECONDS_IN_MICROSECOND);
+	}
 }
 
+/*
+ * consumed: items the consumer took; superseded: items overwritten on a
+ * latest-only link before the consumer got to them; dropped: items a
+ * full link refused. On input links, as the queue counted them: pushes,
+ * pops, pushes that found it full and pops that found it empty.
+ */
 void stage_printstats(struct stage *stg)
 {
-	return;
+	struct link_stats *ls;
+	struct stage_queue *q;
+	int n;
+
+	printf("%s (stage %d): %lu of interest, %lu/s, overall %lds %ldns.\n",
+	       stg->params.name, stg->params.nth_stage, stg->stats.ofinterest,
+	       stg->stats.persecond, stg->stats.overall.tv_sec,
+	       stg->stats.overall.tv_nsec);
+
+	for (n = 0; n < stg->nout; n++) {
+		ls = &stg->stats.links[n];
+		ls->consumed = stage_queue_consumed(&stg->out[n]->q);
+		printf("  -> %s (stage %d)%s%s: consumed %lu, superseded %lu, "
+		       "dropped %lu.\n", stg->out[n]->to->params.name,
+		       stg->out[n]->to->params.nth_stage,
+		       stg->out[n]->q.policy == STAGE_QUEUE_LATEST ?
+		       " latest" : "",
+		       stg->out[n]->to == stg->fused ? " fused" : "",
+		       ls->consumed, ls->superseded, ls->dropped);
+	}
+	for (n = 0; n < stg->nin; n++) {
+		q = &stg->in[n]->q;
+		printf("  <- %s (stage %d): enqueued %lu, dequeued %lu, "
+		       "full %lu, empty %lu.\n", stg->in[n]->from->params.name,
+		       stg->in[n]->from->params.nth_stage, q->prod.enqueued,
+		       q->cons.dequeued, q->prod.full, q->cons.empty);
+	}
+	if (stg->nowait.kind == HANDOFF_FUTEX)
+		printf("    wakeups  spun %lu, slept %lu.\n", stg->nowait.spun,
+		       stg->nowait.slept);
+	histogram_print("run", &stg->stats.run);
+	histogram_print("wait", &stg->stats.wait);
+	histogram_print("latency", &stg->stats.latency);
+	stage_printbudget(stg);
+	if (stg->pipeline->rt_stack)
+		printf("    rt       %lu steps, %lu dirty past warm-up: "
+		       "%lu page faults, %lu allocations.\n", stg->rt.steps,
+		       stg->rt.dirty, stg->rt.faults, stg->rt.allocs);
+}
+
+/* from any thread, the stage clears them itself before its next step */
+void stage_reset_stats(struct stage *stg)
+{
+	__atomic_store_n(&stg->reset, 1, __ATOMIC_RELEASE);
 }
 
 void pipeline_init(struct pipeline *pipe)
 {
+	pipe->stgs = NULL;
+	pipe->nstgs = 0;
+	pipe->size = 0;
+	pipe->links = NULL;
+	pipe->nlinks = 0;
 	pipe->count = 0;
 	pipe->status = 0;
-	memset(pipe->stgs, 0, PIPELINE_MAX_STAGE);
+	pipe->depth = STAGE_QUEUE_DEFAULT_DEPTH;
+	pipe->mode = PIPELINE_OVERLAPPED;
+	pipe->handoff = HANDOFF_SEM;
+	pipe->spin = 0;
+	pipe->rt_stack = 0;
+	pipe->autofuse = 0;
+	pthread_mutex_init(&pipe->lock, NULL);
+	handoff_init(&pipe->completed, pipe->handoff, pipe->spin);
+}
+
+/* stages get a worker thread or not when set up: call before that */
+int pipeline_set_mode(struct pipeline *pipe, enum pipeline_mode mode)
+{
+	if (pipe->nstgs)
+		return -EBUSY;
+
+	pipe->mode = mode;
+	return 0;
+}
+
+/* applies to the stages set up afterwards */
+int pipeline_set_depth(struct pipeline *pipe, int depth)
+{
+	if (depth < 1 || depth > STAGE_QUEUE_MAX_DEPTH)
+		return -EINVAL;
+
+	pipe->depth = depth;
+	return 0;
+}
+
+/*
+ * How stages and the scheduler wake each other up; call before setting
+ * up any stage.
+ */
+int pipeline_set_handoff(struct pipeline *pipe, enum handoff_kind kind,
+			 unsigned int spin)
+{
+	int ret;
+
+	if (pipe->nstgs)
+		return -EBUSY;
+
+	handoff_destroy(&pipe->completed);
+	ret = handoff_init(&pipe->completed, kind, spin);
+	if (ret)
+		return ret;
+
+	pipe->handoff = kind;
+	pipe->spin = spin;
+	return 0;
+}
+
+/*
+ * Workers get stacks of that size, prefaulted, and report the steps that
+ * fault or allocate once warmed up; memory itself is locked by the
+ * caller, see rt_lock_memory().
+ */
+int pipeline_set_rt(struct pipeline *pipe, size_t stack)
+{
+	if (pipe->nstgs)
+		return -EBUSY;
+	if (stack && stack < (size_t)PTHREAD_STACK_MIN + RT_STACK_MARGIN)
+		return -EINVAL;
+
+	pipe->rt_stack = stack;
+	return 0;
 }
 
 int pipeline_register(struct pipeline *pipe, struct stage *stg)
 {
+	struct stage **stgs;
+
 	if (!stg)
 		return -EINVAL;
 
-	pipe->stgs[stg->params.nth_stage] = stg;
-
-	if (stg->params.nth_stage > 0)
-		if (stg->params.nth_stage <= PIPELINE_MAX_STAGE)
-			pipe->stgs[stg->params.nth_stage-1]->next = stg;
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->nstgs == pipe->size) {
+		stgs = realloc(pipe->stgs, (pipe->size + PIPELINE_GROW) *
+			       sizeof(*stgs));
+		if (!stgs) {
+			pthread_mutex_unlock(&pipe->lock);
+			return -ENOMEM;
+		}
+		pipe->stgs = stgs;
+		pipe->size += PIPELINE_GROW;
+	}
 
+	stg->params.nth_stage = pipe->nstgs;
+	pipe->stgs[pipe->nstgs++] = stg;
 	++(pipe->count);
+	pthread_mutex_unlock(&pipe->lock);
 	return 0;	
 }
 
@@ -151,14 +662,293 @@ int pipeline_deregister(struct pipeline *pipe, struct stage *stg)
 	if (!stg)
 		return -EINVAL;
 	
+	pthread_mutex_lock(&pipe->lock);
 	pipe->stgs[stg->params.nth_stage] = NULL;
 	--(pipe->count);
+	pthread_mutex_unlock(&pipe->lock);
 	return 0;	
 }
 
-int pipeline_run(struct pipeline *pipe)
+static int pipeline_link_policy(struct pipeline *pipe, struct stage *from,
+				struct stage *to,
+				enum stage_queue_policy policy)
 {
-	int n, ret;
+	struct stage_link **links, *l;
+	int ret;
+
+	if (!from || !to || from == to)
+		return -EINVAL;
+
+	if (from->nout == STAGE_MAX_LINKS || to->nin == STAGE_MAX_LINKS)
+		return -ENOSPC;
+
+	links = realloc(pipe->links, (pipe->nlinks + 1) * sizeof(*links));
+	if (!links)
+		return -ENOMEM;
+	pipe->links = links;
+
+	l = calloc(1, sizeof(*l));
+	if (!l)
+		return -ENOMEM;
+
+	ret = stage_queue_init(&l->q, to->params.depth, policy);
+	if (ret) {
+		free(l);
+		return ret;
+	}
+	ret = handoff_init(&l->room, pipe->handoff, pipe->spin);
+	if (ret) {
+		stage_queue_destroy(&l->q);
+		free(l);
+		return ret;
+	}
+	l->from = from;
+	l->to = to;
+	l->claim = 0;
+	l->waiting = 0;
+
+	pipe->links[pipe->nlinks++] = l;
+	from->out[from->nout++] = l;
+	to->in[to->nin++] = l;
+	return 0;
+}
+
+/*
+ * Items produced by 'from' are queued for 'to'. The queue takes the
+ * input depth of 'to'. Several links out of a stage make a fan-out,
+ * several links into a stage make a fan-in.
+ */
+int pipeline_link(struct pipeline *pipe, struct stage *from,
+		  struct stage *to)
+{
+	return pipeline_link_policy(pipe, from, to, STAGE_QUEUE_FIFO);
+}
+
+/*
+ * Like pipeline_link(), but 'to' only ever sees the newest item: one
+ * still waiting when the next arrives is overwritten and handed back to
+ * the discard op of 'from', which must have one. 'from' is then never
+ * held back by 'to'.
+ */
+int pipeline_link_latest(struct pipeline *pipe, struct stage *from,
+			 struct stage *to)
+{
+	if (!from || !from->ops->discard)
+		return -EINVAL;
+
+	return pipeline_link_policy(pipe, from, to, STAGE_QUEUE_LATEST);
+}
+
+/*
+ * Checks the stage graph and sorts the stages so that every producer
+ * comes before its consumers. Call once, after all stages are linked
+ * and before the first pipeline_run().
+ */
+int pipeline_build(struct pipeline *pipe)
+{
+	struct stage **sorted, *s, *to;
+	int *pending;
+	int n, m, l, nsorted, ret = 0;
+
+	sorted = calloc(pipe->count ? pipe->count : 1, sizeof(*sorted));
+	pending = calloc(pipe->nstgs ? pipe->nstgs : 1, sizeof(*pending));
+	if (!sorted || !pending) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	nsorted = 0;
+	for (n = 0; n < pipe->nstgs; n++) {
+		s = pipe->stgs[n];
+		if (!s)
+			continue;
+		if (!s->nin && s->ops->input) {
+			printf("%s: stage %s has no input.\n", __func__,
+			       s->params.name);
+			ret = -ENOLINK;
+			goto out;
+		}
+		if (s->nin && !s->ops->input) {
+			printf("%s: stage %s takes no input.\n", __func__,
+			       s->params.name);
+			ret = -EINVAL;
+			goto out;
+		}
+		pending[n] = s->nin;
+		if (!s->nin)
+			sorted[nsorted++] = s;
+	}
+	if (!nsorted) {
+		ret = -ENOLINK;
+		goto out;
+	}
+
+	for (m = 0; m < nsorted; m++) {
+		s = sorted[m];
+		for (l = 0; l < s->nout; l++) {
+			to = s->out[l]->to;
+			if (--pending[to->params.nth_stage] == 0)
+				sorted[nsorted++] = to;
+		}
+	}
+	if (nsorted != pipe->count) {
+		printf("%s: stage graph has a loop.\n", __func__);
+		ret = -ELOOP;
+		goto out;
+	}
+
+	for (n = 0; n < nsorted; n++) {
+		sorted[n]->params.nth_stage = n;
+		pipe->stgs[n] = sorted[n];
+	}
+	pipe->nstgs = nsorted;
+out:
+	free(pending);
+	free(sorted);
+	return ret;
+}
+
+/*
+ * Runs 'to' on the worker of 'from', right after each of its steps, so
+ * the item changes hands without a wakeup and while it is still in
+ * cache. 'to' must be the only consumer of 'from' and 'from' its only
+ * producer. Both must be idle, so only call between pipeline_run()s;
+ * -EBUSY means try again later.
+ */
+int pipeline_fuse(struct pipeline *pipe, struct stage *from,
+		  struct stage *to)
+{
+	if (!from || !to || from->nout != 1 || to->nin != 1 ||
+	    from->out[0]->to != to)
+		return -EINVAL;
+
+	/* nothing to save without threads */
+	if (pipe->mode == PIPELINE_COOPERATIVE)
+		return -EINVAL;
+
+	if ((to->flags & STAGE_FUSED) || from->fused)
+		return -EALREADY;
+
+	if ((from->flags & STAGE_BUSY) || (to->flags & STAGE_BUSY) ||
+	    stage_queue_count(&from->out[0]->q))
+		return -EBUSY;
+
+	to->flags |= STAGE_FUSED;
+	from->fused = to;
+	printf("fuse: %s (stage %d) runs on the worker of %s (stage %d).\n",
+	       to->params.name, to->params.nth_stage, from->params.name,
+	       from->params.nth_stage);
+	return 0;
+}
+
+/*
+ * Fuses on its own every one to one link whose consumer, once it ran
+ * 'samples' times, typically runs for less time than an item waits to
+ * reach it when nothing is queued ahead: its thread then costs more than
+ * it gains. Overlapped mode only.
+ */
+void pipeline_set_autofuse(struct pipeline *pipe, unsigned long samples)
+{
+	pipe->autofuse = samples;
+}
+
+static void pipeline_autofuse(struct pipeline *pipe)
+{
+	unsigned long long run, handoff;
+	struct stage_link *l;
+	int n;
+
+	for (n = 0; n < pipe->nlinks; n++) {
+		l = pipe->links[n];
+		if (l->judged || l->from->nout != 1 || l->to->nin != 1)
+			continue;
+		if (histogram_count(&l->to->stats.run) < pipe->autofuse)
+			continue;
+
+		/* the fastest handoffs are the ones not stuck in the queue */
+		run = histogram_percentile(&l->to->stats.run, 50);
+		handoff = histogram_percentile(&l->to->stats.wait, 10);
+		if (run >= handoff) {
+			l->judged = 1;
+			continue;
+		}
+		if (pipeline_fuse(pipe, l->from, l->to) == -EBUSY)
+			continue;
+		printf("fuse: run %lluus, handoff %lluus.\n",
+		       run / FLL_NANOSECONDS_IN_MICROSECOND,
+		       handoff / FLL_NANOSECONDS_IN_MICROSECOND);
+		l->judged = 1;
+	}
+}
+
+/*
+ * Scheduler helpers: only the thread calling pipeline_run() touches the
+ * BUSY and STARTED flags, the workers just report completion. Queue
+ * levels read here are only ever underestimated for idle stages, so a
+ * stage is never started without input or room for its output.
+ */
+static int link_room(struct stage_link *l)
+{
+	if (stage_queue_space(&l->q))
+		return 1;
+
+	/* a started consumer that has not popped yet will free one slot */
+	return (l->to->flags & STAGE_BUSY) &&
+		stage_queue_consumed(&l->q) <
+		__atomic_load_n(&l->claim, __ATOMIC_RELAXED);
+}
+
+static int stage_room(struct stage *s)
+{
+	int n, room = 0;
+
+	for (n = 0; n < s->nout; n++) {
+		if (link_room(s->out[n]))
+			++room;
+		else if (s->params.dispatch == STAGE_DISPATCH_ALL)
+			return 0;
+	}
+
+	if (s->nout && !room)
+		return 0;
+
+	/* a fused consumer hands its output over in the same step */
+	return !s->fused || stage_room(s->fused);
+}
+
+static int stage_ready(struct stage *s)
+{
+	int n, idx;
+
+	if (!stage_room(s))
+		return 0;
+
+	if (!s->nin)
+		return 1;
+
+	for (n = 0; n < s->nin; n++) {
+		idx = (s->inrr + n) % s->nin;
+		if (stage_queue_count(&s->in[idx]->q)) {
+			s->inrr = idx;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void stage_account(struct stage *s, struct timespec *delta)
+{
+	timespec_add(&s->stats.overall, delta);
+	s->stats.persecond =
+		(s->stats.overall.tv_sec != 0) ?
+		((s->stats.ofinterest) /
+		 (s->stats.overall.tv_sec)) :
+		s->stats.ofinterest;
+}
+
+static int pipeline_run_lockstep(struct pipeline *pipe)
+{
+	int n, ret, runs;
 	struct stage *s;
 	struct timespec delta, now, before;
 	ret = 0;
@@ -166,60 +956,217 @@ int pipeline_run(struct pipeline *pipe)
 	timespec_zero(&now);
 	timespec_zero(&before);
 	
-	for (n=CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+	for (n = 0; n < pipe->nstgs; n++) {
 		s = pipe->stgs[n];
-		debug(s, "%s: run stage %d in:%p %p.\n", __func__,
-		       s->params.nth_stage, s->params.data_in,
-		       s->params.data_out);
+		if (!s || (s->flags & STAGE_FUSED))
+			continue;
 
-		clock_gettime(CLOCK_MONOTONIC, &before);
-		s->stats.lastrun.tv_sec = before.tv_sec;
-		s->stats.lastrun.tv_nsec = before.tv_nsec;
+		/* sources run once, the others drain what reached them */
+		for (runs = 0; s->nin ? stage_ready(s) : !runs; runs++) {
+			debug(s, "%s: run stage %d in:%p %p.\n", __func__,
+			       s->params.nth_stage, s->params.data_in,
+			       s->params.data_out);
 
-		s->ops->go(s);
-		ret = sem_wait(&s->done);
-		if (ret) {
-			debug(s, "step %d done error %d.\n",
-			       s->params.nth_stage, ret);
-			break;
-		}
-		if (s->ops->output && s->next) 
-			s->ops->output(s, s->params.data_out);
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			s->stats.lastrun.tv_sec = before.tv_sec;
+			s->stats.lastrun.tv_nsec = before.tv_nsec;
 
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		timespec_substract(&delta, &now, &before);
-		timespec_add(&s->stats.overall, &delta);
+			s->ops->go(s);
+			ret = handoff_wait(&s->done);
+			if (ret) {
+				debug(s, "step %d done error %d.\n",
+				       s->params.nth_stage, ret);
+				return ret;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespec_substract(&delta, &now, &before);
+			stage_account(s, &delta);
 		
-		debug(s, "stage %d: delta->  %lds %ldns .\n", s->params.nth_stage,
-		       delta.tv_sec , delta.tv_nsec);
-		debug(s, "stage %d: count: %ld. \n", s->params.nth_stage,
-		       s->stats.ofinterest);
-
-		debug(s, "stage %d: overall: %lds %ldns. \n", s->params.nth_stage,
-		       s->stats.overall.tv_sec,
-		       s->stats.overall.tv_nsec);
-
-		if (!(s->params.data_out))
-		    break;
-
-		s->stats.persecond =
-			(s->stats.overall.tv_sec != 0) ?
-			((s->stats.ofinterest) /
-			 (s->stats.overall.tv_sec)) :
-			s->stats.ofinterest;
-
-		debug(s, "stage %d: frequency (count/s) : %ld .\n",
-		       s->params.nth_stage,
-		       s->stats.persecond);
+			debug(s, "stage %d: delta->  %lds %ldns .\n", s->params.nth_stage,
+			       delta.tv_sec , delta.tv_nsec);
+			debug(s, "stage %d: count: %ld. \n", s->params.nth_stage,
+			       s->stats.ofinterest);
+
+			debug(s, "stage %d: overall: %lds %ldns. \n", s->params.nth_stage,
+			       s->stats.overall.tv_sec,
+			       s->stats.overall.tv_nsec);
+
+			debug(s, "stage %d: frequency (count/s) : %ld .\n",
+			       s->params.nth_stage,
+			       s->stats.persecond);
 		
+			if (pipe->status) {
+				printf("exiting pipeline...\n");
+				return pipe->status;
+			}
+		}
+	};
+	return ret;
+}
+
+static int pipeline_dispatch(struct pipeline *pipe)
+{
+	struct stage *s;
+	int n, busy = 0;
+
+	/* downstream first, so producers see the slots about to be freed */
+	for (n = pipe->nstgs - 1; n >= 0; n--) {
+		s = pipe->stgs[n];
+		if (!s || (s->flags & STAGE_FUSED))
+			continue;
+		if (s->flags & STAGE_BUSY) {
+			++busy;
+			continue;
+		}
+		if (!s->nin && (s->flags & STAGE_STARTED))
+			continue;
+		if (!stage_ready(s))
+			continue;
+		if (!s->nin)
+			s->flags |= STAGE_STARTED;
+		else
+			__atomic_store_n(&s->in[s->inrr]->claim,
+				stage_queue_consumed(&s->in[s->inrr]->q) + 1,
+				__ATOMIC_RELAXED);
+
+		clock_gettime(CLOCK_MONOTONIC, &s->stats.lastrun);
+		s->flags |= STAGE_BUSY;
+		s->ops->go(s);
+		++busy;
+	}
+	return busy;
+}
+
+static void pipeline_collect(struct pipeline *pipe)
+{
+	struct stage *s;
+	int n;
+
+	for (n = 0; n < pipe->nstgs; n++) {
+		s = pipe->stgs[n];
+		if (!s || !(s->flags & STAGE_BUSY))
+			continue;
+		if (handoff_trywait(&s->done))
+			continue;
+
+		s->flags &= ~STAGE_BUSY;
+		stage_account(s, &s->duration);
+		debug(s, "stage %d: run %lds %ldns, overall %lds %ldns.\n",
+		      s->params.nth_stage,
+		      s->duration.tv_sec, s->duration.tv_nsec,
+		      s->stats.overall.tv_sec, s->stats.overall.tv_nsec);
+	}
+}
+
+/* every source ran once in this pipeline_run() and is idle again */
+static int pipeline_sourced(struct pipeline *pipe)
+{
+	struct stage *s;
+	int n;
+
+	for (n = 0; n < pipe->nstgs; n++) {
+		s = pipe->stgs[n];
+		if (!s || s->nin)
+			continue;
+		if (!(s->flags & STAGE_STARTED) || (s->flags & STAGE_BUSY))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * One call makes every source produce once; the stages downstream keep
+ * running in their workers meanwhile and may span calls.
+ */
+static int pipeline_run_overlapped(struct pipeline *pipe)
+{
+	int n, busy, ret;
+
+	for (n = 0; n < pipe->nstgs; n++)
+		if (pipe->stgs[n])
+			pipe->stgs[n]->flags &= ~STAGE_STARTED;
+
+	for (;;) {
+		if (pipe->autofuse)
+			pipeline_autofuse(pipe);
+		busy = pipeline_dispatch(pipe);
+		if (pipeline_sourced(pipe))
+			break;
+		if (!busy)
+			return -EPIPE;
 		if (pipe->status) {
 			printf("exiting pipeline...\n");
-			ret = pipe->status;
-			break;
+			return pipe->status;
+		}
+		ret = handoff_wait(&pipe->completed);
+		if (ret) {
+			debug((struct stage *)NULL, "%s: wait error %d.\n",
+			      __func__, ret);
+			return ret;
+		}
+		pipeline_collect(pipe);
+	}
+
+	return pipe->status;
+}
+
+/*
+ * Same contract as the overlapped mode, with every step run to completion
+ * on this thread: stages take turns, downstream first so items move on
+ * before new ones come in, until none is left with work to do.
+ */
+static int pipeline_run_cooperative(struct pipeline *pipe)
+{
+	struct timespec before, now, delta;
+	struct stage *s;
+	int n, ran, ret;
+
+	for (n = 0; n < pipe->nstgs; n++)
+		if (pipe->stgs[n])
+			pipe->stgs[n]->flags &= ~STAGE_STARTED;
 
+	do {
+		ran = 0;
+		for (n = pipe->nstgs - 1; n >= 0; n--) {
+			s = pipe->stgs[n];
+			if (!s)
+				continue;
+			if (!s->nin && (s->flags & STAGE_STARTED))
+				continue;
+			if (!stage_ready(s))
+				continue;
+			if (!s->nin)
+				s->flags |= STAGE_STARTED;
+
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			s->stats.lastrun = before;
+			s->ops->go(s);
+			ret = handoff_wait(&s->done);
+			if (ret)
+				return ret;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timespec_substract(&delta, &now, &before);
+			stage_account(s, &delta);
+			++ran;
+
+			if (pipe->status) {
+				printf("exiting pipeline...\n");
+				return pipe->status;
+			}
 		}
-	};
-	return ret;
+	} while (ran);
+
+	return pipe->status;
+}
+
+int pipeline_run(struct pipeline *pipe)
+{
+	if (pipe->mode == PIPELINE_OVERLAPPED)
+		return pipeline_run_overlapped(pipe);
+	if (pipe->mode == PIPELINE_COOPERATIVE)
+		return pipeline_run_cooperative(pipe);
+
+	return pipeline_run_lockstep(pipe);
 }
 
 void pipeline_terminate(struct pipeline *pipe, int reason)
@@ -234,8 +1181,10 @@ int pipeline_pause(struct pipeline *pipe)
 	struct stage *s;
 	
 	ret = 0;
-	for (n=CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+	for (n = 0; n < pipe->nstgs; n++) {
 		s = pipe->stgs[n];
+		if (!s)
+			continue;
 		printf("%s: pause stage %d.\n", __func__,
 		       s->params.nth_stage);
 		s->ops->wait(s);
@@ -243,6 +1192,32 @@ int pipeline_pause(struct pipeline *pipe)
 	return ret;
 }
 
+int pipeline_printstats(struct pipeline *pipe)
+{
+	struct stage *s;
+	int n;
+
+	for (n = 0; n < pipe->nstgs; n++) {
+		s = pipe->stgs[n];
+		if (!s)
+			continue;
+		if (s->ops->printstats)
+			s->ops->printstats(s);
+		else
+			stage_printstats(s);
+	}
+	return 0;
+}
+
+void pipeline_reset_stats(struct pipeline *pipe)
+{
+	int n;
+
+	for (n = 0; n < pipe->nstgs; n++)
+		if (pipe->stgs[n])
+			stage_reset_stats(pipe->stgs[n]);
+}
+
 int pipeline_getcount(struct pipeline *pipe)
 {
 	return pipe->count;
@@ -253,7 +1228,7 @@ void pipeline_teardown(struct pipeline *pipe)
 	struct stage *s;
 	int n;
 	
-	for (n=CAPTURE_STAGE; n < PIPELINE_MAX_STAGE; n++) {
+	for (n = 0; n < pipe->nstgs; n++) {
 		s = pipe->stgs[n];
 		if (s && s->self) {
 			printf("%s: run stage %d.\n", __func__,
@@ -261,4 +1236,17 @@ void pipeline_teardown(struct pipeline *pipe)
 			s->ops->down(s);
 		};
 	};
+	for (n = 0; n < pipe->nlinks; n++) {
+		stage_queue_destroy(&pipe->links[n]->q);
+		handoff_destroy(&pipe->links[n]->room);
+		free(pipe->links[n]);
+	}
+	free(pipe->links);
+	free(pipe->stgs);
+	pipe->links = NULL;
+	pipe->stgs = NULL;
+	pipe->nlinks = 0;
+	pipe->nstgs = 0;
+	handoff_destroy(&pipe->completed);
+	pthread_mutex_destroy(&pipe->lock);
 }
@@ -4,24 +4,97 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+#include "queue.h"
+#include "histogram.h"
+#include "handoff.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define PIPELINE_MAX_STAGE 3
-#define CAPTURE_STAGE 0
-#define DETECTION_STAGE 1
-#define TRACKING_STAGE 2
+/* links per stage and direction, enough for a fan-out/fan-in of 8 */
+#define STAGE_MAX_LINKS 8
 
 struct pipeline;
 struct stage;
 
 
 #define STAGE_ABRT 0x1 /*abort received*/
-	
+#define STAGE_BUSY 0x2 /*worker running, overlapped mode only*/
+#define STAGE_STARTED 0x4 /*source already ran in this pipeline_run()*/
+#define STAGE_INLINE 0x8 /*no worker, runs on the scheduler thread*/
+#define STAGE_FUSED 0x10 /*runs on the worker of its producer, after it*/
+
+/*
+ * PIPELINE_LOCKSTEP runs one stage at a time, so the frame period is the
+ * sum of all stage times; useful for debugging.
+ * PIPELINE_OVERLAPPED lets every stage work on a different frame at the
+ * same time, so the frame period tends to the slowest stage time.
+ * PIPELINE_COOPERATIVE runs every stage on the thread calling
+ * pipeline_run(), one step (input, run, output) at a time, with no worker
+ * threads to switch to; for boards with one or two cores.
+ */
+enum pipeline_mode {
+	PIPELINE_LOCKSTEP = 0,
+	PIPELINE_OVERLAPPED = 1,
+	PIPELINE_COOPERATIVE = 2,
+};
+
+/*
+ * How a stage with several output links spreads its items:
+ * STAGE_DISPATCH_ALL hands every item to every link, so the item is
+ * shared and must be reference counted by its producer.
+ * STAGE_DISPATCH_RR hands each item to one link, round-robin.
+ * STAGE_DISPATCH_KEY hands each item to the link ops->route picks for it,
+ * such as the one of the camera the item came from.
+ */
+enum stage_dispatch {
+	STAGE_DISPATCH_ALL = 0,
+	STAGE_DISPATCH_RR = 1,
+	STAGE_DISPATCH_KEY = 2,
+};
+
+/*
+ * What a stage does after a step that overran its budget, besides
+ * counting it: STAGE_OVERRUN_SKIP drops its next item unprocessed (a
+ * source skips its next run), STAGE_OVERRUN_DEGRADE has ops->degrade
+ * make the next step cheaper.
+ */
+enum stage_overrun {
+	STAGE_OVERRUN_COUNT = 0,
+	STAGE_OVERRUN_SKIP = 1,
+	STAGE_OVERRUN_DEGRADE = 2,
+};
+
+/*
+ * Real-time mode: steps a stage takes to warm up, after which page
+ * faults and heap allocations are counted; the first ones are reported.
+ */
+#define STAGE_RT_WARMUP 2
+#define STAGE_RT_REPORT 8
+
+/* overruns remembered per stage, the oldest are overwritten */
+#define STAGE_OVERRUN_LOG 8
+
+struct stage_budget {
+	unsigned long long ns; /*0: no budget*/
+	enum stage_overrun action;
+	int skip;
+	unsigned long overruns;
+	unsigned long skipped;
+	unsigned long long worst;
+	/* when each of the last overrunning steps ended, how long it took */
+	struct overrun {
+		struct timespec at;
+		unsigned long long took;
+	} log[STAGE_OVERRUN_LOG];
+};
+
 struct stage_params {
 	const char *name;
 	int nth_stage;
+	int depth; /*input queue depth, 0: pipeline default*/
+	enum stage_dispatch dispatch;
 	void *data_in;
 	void *data_out;
 };
@@ -37,6 +110,27 @@ struct stage_ops {
 	int (*input)(struct stage *stg, void **it);
 	int (*count)(struct stage *step);
 	void (*printstats)(struct stage *step);
+	/* release an output item overwritten on a latest-only link */
+	void (*discard)(struct stage *stg, void *it);
+	/* the last step overran its budget, make the next one cheaper */
+	void (*degrade)(struct stage *stg);
+	/* clear the statistics of the stage itself, on its worker */
+	void (*reset)(struct stage *stg);
+	/* output link of an item, for STAGE_DISPATCH_KEY */
+	int (*route)(struct stage *stg, void *it);
+};
+
+/* producer 'from' feeds consumer 'to' through q */
+struct stage_link {
+	struct stage *from;
+	struct stage *to;
+	struct stage_queue q;
+	/* items popped once the busy consumer took its own, 0 when done */
+	unsigned long claim;
+	/* the producer waits here for the claimed slot, see stage_push() */
+	struct handoff room;
+	int waiting;
+	int judged; /*automatic fusion already decided on*/
 };
 
 struct stage {
@@ -44,47 +138,113 @@ struct stage {
 	struct stage_ops *ops;
 	struct stage_params params;
 	struct pipeline *pipeline;
-	struct stage* next;
+	struct stage_link *in[STAGE_MAX_LINKS];
+	struct stage_link *out[STAGE_MAX_LINKS];
+	int nin;
+	int nout;
+	int inrr;
+	int outrr;
+	/* input link of the item last taken by stage_input() */
+	int inlast;
+	/* consumer run right after each step of this stage, on its worker */
+	struct stage *fused;
 	struct timespec duration;
 	pthread_t worker;
-	pthread_mutex_t lock;
-	pthread_cond_t sync;
-	sem_t nowait;
-	sem_t done;
+	struct handoff nowait;
+	struct handoff done;
+	struct stage_budget budget;
+	/* real-time mode: steps taken, what the ones past warm-up did */
+	struct stage_rt {
+		unsigned long steps;
+		unsigned long dirty;
+		unsigned long faults;
+		unsigned long allocs;
+	} rt;
 	int flags;
+	int reset; /*statistics to be cleared before the next step*/
 	struct performance {
 		struct timespec lastrun;
 		struct timespec overall;
 		unsigned long ofinterest;
 		unsigned long persecond;
+		/*
+		 * run: ops->run alone; wait: time the item sat in the
+		 * input queue; latency: from taking the item (or starting,
+		 * for a source) until its result was handed over.
+		 */
+		struct histogram run;
+		struct histogram wait;
+		struct histogram latency;
+		/* per output link, same index as out[] */
+		struct link_stats {
+			unsigned long consumed;
+			unsigned long superseded;
+			unsigned long dropped;
+		} links[STAGE_MAX_LINKS];
 	} stats;
 };
 
 void stage_up(struct stage *stg,  struct stage_params *p,
 	     struct stage_ops *o, struct pipeline *pipe);
-void stage_down(struct stage *stg);	
+void stage_down(struct stage *stg);
 void stage_go(struct stage *stg);
-void stage_wait(struct stage *stg); 
+void stage_wait(struct stage *stg);
 int stage_output(struct stage *stg, void *it);
 int stage_input(struct stage *stg, void **it);
+int stage_fanout(struct stage *stg);
+int stage_set_dispatch(struct stage *stg, enum stage_dispatch dispatch);
+void stage_set_name(struct stage *stg, const char *name);
+int stage_set_spin(struct stage *stg, unsigned int spin);
+int stage_set_budget(struct stage *stg, unsigned long long ns,
+		     enum stage_overrun action);
 void stage_printstats(struct stage *stg);
+void stage_reset_stats(struct stage *stg);
 
 struct pipeline {
-	struct stage *stgs[PIPELINE_MAX_STAGE];
+	struct stage **stgs;
+	int nstgs;
+	int size;
+	struct stage_link **links;
+	int nlinks;
 	int count;
 	int status;
+	int depth;
+	enum pipeline_mode mode;
+	enum handoff_kind handoff;
+	unsigned int spin;
+	struct handoff completed;
+	/* runs of a consumer to look at before fusing it, 0: never */
+	unsigned long autofuse;
+	/* worker stack size, prefaulted; 0: not in real-time mode */
+	size_t rt_stack;
+	/* stages may be set up from several threads at once */
+	pthread_mutex_t lock;
 };
 
 void pipeline_init(struct pipeline *pipe);
+int pipeline_set_mode(struct pipeline *pipe, enum pipeline_mode mode);
+int pipeline_set_depth(struct pipeline *pipe, int depth);
+int pipeline_set_handoff(struct pipeline *pipe, enum handoff_kind kind,
+			 unsigned int spin);
+int pipeline_set_rt(struct pipeline *pipe, size_t stack);
 int pipeline_register(struct pipeline *pipe, struct stage *stg);
 int pipeline_deregister(struct pipeline *pipe, struct stage *stg);
+int pipeline_link(struct pipeline *pipe, struct stage *from,
+		  struct stage *to);
+int pipeline_link_latest(struct pipeline *pipe, struct stage *from,
+			 struct stage *to);
+int pipeline_build(struct pipeline *pipe);
+int pipeline_fuse(struct pipeline *pipe, struct stage *from,
+		  struct stage *to);
+void pipeline_set_autofuse(struct pipeline *pipe, unsigned long samples);
 void pipeline_teardown(struct pipeline *pipe);
 int pipeline_run(struct pipeline *pipe);
 int pipeline_pause(struct pipeline *pipe);
 int pipeline_printstats(struct pipeline *pipe);
+void pipeline_reset_stats(struct pipeline *pipe);
 int pipeline_getcount(struct pipeline *pipe);
 void pipeline_terminate(struct pipeline *pipe, int reason);
-	
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,178 @@
+/**
+ * @file facelockedloop/queue.c
+ * @brief Lock-free single-producer/single-consumer queue between stages.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+
+#include "queue.h"
+#include "time_utils.h"
+
+static inline unsigned long long queue_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_nsecs(&now);
+}
+
+int stage_queue_init(struct stage_queue *q, unsigned int depth,
+		     enum stage_queue_policy policy)
+{
+	unsigned int size = 1;
+
+	if (depth == 0 || depth > STAGE_QUEUE_MAX_DEPTH)
+		return -EINVAL;
+
+	/* a single slot, whatever depth the consumer asked for */
+	if (policy == STAGE_QUEUE_LATEST)
+		depth = 1;
+
+	while (size < depth)
+		size <<= 1;
+
+	q->slots = calloc(size, sizeof(*q->slots));
+	q->stamps = calloc(size, sizeof(*q->stamps));
+	if (!q->slots || !q->stamps) {
+		free(q->slots);
+		free(q->stamps);
+		return -ENOMEM;
+	}
+
+	q->depth = depth;
+	q->mask = size - 1;
+	q->policy = policy;
+	q->prod.tail = 0;
+	q->prod.enqueued = 0;
+	q->prod.full = 0;
+	q->prod.superseded = 0;
+	q->cons.head = 0;
+	q->cons.dequeued = 0;
+	q->cons.empty = 0;
+	q->cons.waited = 0;
+
+	return 0;
+}
+
+void stage_queue_destroy(struct stage_queue *q)
+{
+	free(q->slots);
+	free(q->stamps);
+	q->slots = NULL;
+	q->stamps = NULL;
+}
+
+/* producer side */
+int stage_queue_push(struct stage_queue *q, void *it)
+{
+	unsigned long head, tail;
+
+	if (q->policy == STAGE_QUEUE_LATEST)
+		return -EINVAL;
+
+	tail = q->prod.tail;
+	head = __atomic_load_n(&q->cons.head, __ATOMIC_ACQUIRE);
+	if (tail - head >= q->depth) {
+		++(q->prod.full);
+		return -EAGAIN;
+	}
+
+	q->slots[tail & q->mask] = it;
+	q->stamps[tail & q->mask] = queue_now();
+	__atomic_store_n(&q->prod.tail, tail + 1, __ATOMIC_RELEASE);
+	++(q->prod.enqueued);
+
+	return 0;
+}
+
+/*
+ * Producer side, for either policy. On a LATEST queue the item always
+ * goes in and the one it displaced, if the consumer had not taken it
+ * yet, is handed back through 'old' for the producer to release. On a
+ * FIFO queue 'old' is always NULL and this behaves as a push.
+ */
+int stage_queue_replace(struct stage_queue *q, void *it, void **old)
+{
+	*old = NULL;
+	if (q->policy == STAGE_QUEUE_FIFO)
+		return stage_queue_push(q, it);
+
+	/*
+	 * The stamp is not swapped along with the item: a pop racing with
+	 * this may report the wait of the newer item, a bit short.
+	 */
+	__atomic_store_n(&q->stamps[0], queue_now(), __ATOMIC_RELAXED);
+	*old = __atomic_exchange_n(&q->slots[0], it, __ATOMIC_ACQ_REL);
+	if (*old)
+		++(q->prod.superseded);
+	__atomic_store_n(&q->prod.tail, q->prod.tail + 1, __ATOMIC_RELEASE);
+	++(q->prod.enqueued);
+
+	return 0;
+}
+
+/* consumer side */
+int stage_queue_pop(struct stage_queue *q, void **it)
+{
+	unsigned long long now, stamp;
+	unsigned long head, tail;
+
+	if (q->policy == STAGE_QUEUE_LATEST) {
+		*it = __atomic_exchange_n(&q->slots[0], NULL,
+					  __ATOMIC_ACQ_REL);
+		if (!*it) {
+			++(q->cons.empty);
+			return -EAGAIN;
+		}
+		now = queue_now();
+		stamp = __atomic_load_n(&q->stamps[0], __ATOMIC_RELAXED);
+		q->cons.waited = now > stamp ? now - stamp : 0;
+		__atomic_store_n(&q->cons.head, q->cons.head + 1,
+				 __ATOMIC_RELEASE);
+		++(q->cons.dequeued);
+		return 0;
+	}
+
+	head = q->cons.head;
+	tail = __atomic_load_n(&q->prod.tail, __ATOMIC_ACQUIRE);
+	if (tail == head) {
+		++(q->cons.empty);
+		return -EAGAIN;
+	}
+
+	*it = q->slots[head & q->mask];
+	q->cons.waited = queue_now() - q->stamps[head & q->mask];
+	__atomic_store_n(&q->cons.head, head + 1, __ATOMIC_RELEASE);
+	++(q->cons.dequeued);
+
+	return 0;
+}
+
+/*
+ * Either side may ask; the answer is exact for the caller's own end and
+ * conservative for the other one.
+ */
+unsigned int stage_queue_count(struct stage_queue *q)
+{
+	unsigned long head, tail;
+
+	if (q->policy == STAGE_QUEUE_LATEST)
+		return __atomic_load_n(&q->slots[0], __ATOMIC_ACQUIRE) != NULL;
+
+	head = __atomic_load_n(&q->cons.head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&q->prod.tail, __ATOMIC_ACQUIRE);
+
+	return tail - head;
+}
+
+/* a LATEST queue always has room, at the cost of the item it holds */
+unsigned int stage_queue_space(struct stage_queue *q)
+{
+	if (q->policy == STAGE_QUEUE_LATEST)
+		return 1;
+
+	return q->depth - stage_queue_count(q);
+}
@@ -0,0 +1,69 @@
+#ifndef __QUEUE_H_
+#define __QUEUE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STAGE_QUEUE_DEFAULT_DEPTH 1
+#define STAGE_QUEUE_MAX_DEPTH 16
+
+#define __cacheline_aligned __attribute__((aligned(64)))
+
+/*
+ * STAGE_QUEUE_FIFO keeps every item until the consumer pops it and
+ * refuses new ones when full.
+ * STAGE_QUEUE_LATEST holds a single item that each push overwrites, so
+ * the consumer always gets the newest one and the producer never waits.
+ */
+enum stage_queue_policy {
+	STAGE_QUEUE_FIFO = 0,
+	STAGE_QUEUE_LATEST = 1,
+};
+
+/*
+ * Bounded single-producer/single-consumer ring linking two stages.
+ * The producer only writes 'tail' and the consumer only writes 'head',
+ * so neither side needs a lock. A successful push transfers ownership of
+ * the item to the consumer; on -EAGAIN the producer keeps it.
+ */
+struct stage_queue {
+	void **slots;
+	unsigned long long *stamps;	/* push time of each slot */
+	unsigned int depth;
+	unsigned int mask;
+	enum stage_queue_policy policy;
+	struct {
+		unsigned long tail;
+		unsigned long enqueued;
+		unsigned long full;
+		unsigned long superseded;
+	} prod __cacheline_aligned;
+	struct {
+		unsigned long head;
+		unsigned long dequeued;
+		unsigned long empty;
+		unsigned long long waited;	/* by the last item popped */
+	} cons __cacheline_aligned;
+};
+
+int stage_queue_init(struct stage_queue *q, unsigned int depth,
+		     enum stage_queue_policy policy);
+void stage_queue_destroy(struct stage_queue *q);
+int stage_queue_push(struct stage_queue *q, void *it);
+int stage_queue_replace(struct stage_queue *q, void *it, void **old);
+int stage_queue_pop(struct stage_queue *q, void **it);
+unsigned int stage_queue_count(struct stage_queue *q);
+unsigned int stage_queue_space(struct stage_queue *q);
+
+/* number of items ever popped */
+static inline unsigned long stage_queue_consumed(struct stage_queue *q)
+{
+	return __atomic_load_n(&q->cons.head, __ATOMIC_ACQUIRE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* __QUEUE_H_ */
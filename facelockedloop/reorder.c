@@ -0,0 +1,251 @@
+/**
+ * @file facelockedloop/reorder.c
+ * @brief Sequence-ordered reassembly of detector pool results.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "reorder.h"
+#include "kernel_utils.h"
+#include "debug.h"
+
+static void reorder_stage_up(struct stage *stg, struct stage_params *p,
+			     struct stage_ops *o, struct pipeline *pipe)
+{
+	stage_up(stg, p, o, pipe);
+	pipeline_register(pipe, stg);
+}
+
+static void reorder_stage_down(struct stage *stg)
+{
+	struct reorder *r = container_of(stg, struct reorder, step);
+
+	reorder_teardown(r);
+	stage_down(stg);
+	pipeline_deregister(stg->pipeline, stg);
+}
+
+static int reorder_stage_input(struct stage *stg, void **it)
+{
+	struct reorder *r = container_of(stg, struct reorder, step);
+	void *itin = NULL;
+	int ret;
+
+	ret = stage_input(stg, &itin);
+	if (ret)
+		return ret;
+
+	r->pos = itin;
+	r->from = stg->inlast;
+	return 0;
+}
+
+static int reorder_stage_run(struct stage *stg)
+{
+	struct reorder *r = container_of(stg, struct reorder, step);
+	int ret;
+
+	ret = reorder_run(r);
+	stg->params.data_out = r->held[r->next % r->params.window];
+	stg->stats.ofinterest = r->stats.delivered;
+
+	return ret;
+}
+
+/* no need to wait for the results known to be lost */
+static void reorder_skip_lost(struct reorder *r)
+{
+	while (r->next < r->lost && !r->held[r->next % r->params.window]) {
+		++(r->stats.skipped);
+		++(r->next);
+	}
+}
+
+/* hand over every result that is next in line */
+static int reorder_stage_output(struct stage *stg, void *it)
+{
+	struct reorder *r = container_of(stg, struct reorder, step);
+	struct facepos **slot;
+	int ret = 0;
+
+	for (;;) {
+		reorder_skip_lost(r);
+		slot = &r->held[r->next % r->params.window];
+		if (!*slot)
+			break;
+		ret = stage_output(stg, *slot);
+		if (ret)
+			break;	/* keep it, the tracker is still busy */
+		*slot = NULL;
+		++(r->next);
+		++(r->stats.delivered);
+	}
+	return ret;
+}
+
+static void reorder_stage_discard(struct stage *stg, void *it)
+{
+	store_result_put(it);
+}
+
+static void reorder_stage_wait(struct stage *stg)
+{
+	stage_wait(stg);
+}
+
+static void reorder_stage_go(struct stage *stg)
+{
+	stage_go(stg);
+}
+
+static struct stage_ops reorder_ops = {
+	.up = reorder_stage_up,
+	.down = reorder_stage_down,
+	.run = reorder_stage_run,
+	.wait = reorder_stage_wait,
+	.go = reorder_stage_go,
+	.input = reorder_stage_input,
+	.output = reorder_stage_output,
+	.discard = reorder_stage_discard,
+};
+
+int reorder_initialize(struct reorder *r, struct reorder_params *p,
+		       struct pipeline *pipe)
+{
+	struct stage_params stgparams;
+	int n;
+
+	if (p->window < 0 || p->window > REORDER_MAX_WINDOW)
+		return -EINVAL;
+
+	stgparams.nth_stage = 0;
+	stgparams.data_in = NULL;
+	stgparams.depth = 0;
+	stgparams.dispatch = STAGE_DISPATCH_ALL;
+	stgparams.data_out = NULL;
+	stgparams.name = "REO_STG";
+
+	r->params = *p;
+	r->pos = NULL;
+	r->next = 0;
+	r->from = 0;
+	r->lost = 0;
+	for (n = 0; n < STAGE_MAX_LINKS; n++)
+		r->seen[n] = 0;
+	r->stats.delivered = 0;
+	r->stats.stale = 0;
+	r->stats.skipped = 0;
+	for (n = 0; n < REORDER_MAX_WINDOW; n++)
+		r->held[n] = NULL;
+
+	reorder_stage_up(&r->step, &stgparams, &reorder_ops, pipe);
+	return 0;
+}
+
+void reorder_teardown(struct reorder *r)
+{
+	int n;
+
+	for (n = 0; n < REORDER_MAX_WINDOW; n++) {
+		if (r->held[n])
+			store_result_put(r->held[n]);
+		r->held[n] = NULL;
+	}
+}
+
+/*
+ * Every worker and link may hold a result that is older than the one
+ * just received; anything further ahead means an older result was lost.
+ */
+static int reorder_window(struct reorder *r)
+{
+	int n, window = 1;
+
+	for (n = 0; n < r->step.nin; n++)
+		window += r->step.in[n]->q.depth + 1;
+
+	return window > REORDER_MAX_WINDOW ? REORDER_MAX_WINDOW : window;
+}
+
+/* the oldest of the newest results of all links bounds the lost ones */
+static void reorder_seen(struct reorder *r, unsigned long seq)
+{
+	unsigned long lost = ~0UL;
+	int n;
+
+	if (seq + 1 > r->seen[r->from])
+		r->seen[r->from] = seq + 1;
+	for (n = 0; n < r->step.nin; n++) {
+		/* a link with nothing yet may still bring anything */
+		if (!r->seen[n])
+			return;
+		if (r->seen[n] - 1 < lost)
+			lost = r->seen[n] - 1;
+	}
+	if (lost > r->lost)
+		r->lost = lost;
+}
+
+int reorder_run(struct reorder *r)
+{
+	struct facepos *pos = r->pos;
+	struct facepos **slot;
+	unsigned long ahead;
+
+	if (!r->params.window)
+		r->params.window = reorder_window(r);
+
+	r->pos = NULL;
+	if (!pos)
+		return -EINVAL;
+
+	reorder_seen(r, pos->box.seq);
+	if (pos->box.seq < r->next) {
+		debug(r, "stale result %lu, expecting %lu\n", pos->box.seq,
+		      r->next);
+		++(r->stats.stale);
+		store_result_put(pos);
+		return 0;
+	}
+
+	/*
+	 * Too far ahead: give up on the missing ones. Without a full history
+	 * any newer result goes straight out and whatever is older is
+	 * given up on.
+	 */
+	ahead = r->params.latest ? 0 : r->params.window - 1;
+	while (pos->box.seq > r->next + ahead) {
+		slot = &r->held[r->next % r->params.window];
+		if (*slot) {
+			++(r->stats.stale);
+			store_result_put(*slot);
+			*slot = NULL;
+		} else {
+			++(r->stats.skipped);
+		}
+		++(r->next);
+	}
+
+	slot = &r->held[pos->box.seq % r->params.window];
+	if (*slot) {
+		/* same sequence number twice, keep the latest */
+		++(r->stats.stale);
+		store_result_put(*slot);
+	}
+	*slot = pos;
+	reorder_skip_lost(r);
+
+	return 0;
+}
+
+int reorder_print_stats(struct reorder *r)
+{
+	printf("%s: delivered %lu, stale %lu, skipped %lu\n",
+	       r->step.params.name, r->stats.delivered, r->stats.stale,
+	       r->stats.skipped);
+	return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef __REORDER_H_
+#define __REORDER_H_
+
+#include "pipeline.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REORDER_MAX_WINDOW 64
+
+struct reorder_params {
+	const char *name;
+	/* results held while waiting for an older one, 0: from the links */
+	int window;
+	/* frames may be superseded upstream, do not wait for missing ones */
+	int latest;
+};
+
+struct reorder_stats {
+	unsigned long delivered;
+	unsigned long stale;
+	unsigned long skipped;
+};
+
+/*
+ * Puts the results of a detector pool back in capture order before they
+ * reach the tracker. Results older than the last one delivered are
+ * discarded. In latest mode sequence gaps are expected, so nothing is held
+ * back waiting for them.
+ * Each detector hands its results over in order, so a result missing
+ * once every input link has delivered a newer one is lost (no result
+ * buffer, refused, or skipped on overrun) and is not waited for.
+ */
+struct reorder {
+	struct stage step;
+	struct reorder_params params;
+	struct reorder_stats stats;
+	struct facepos *held[REORDER_MAX_WINDOW];
+	struct facepos *pos;
+	/* input link pos came from */
+	int from;
+	unsigned long next;
+	/* newest sequence number + 1 from each input link, 0: none yet */
+	unsigned long seen[STAGE_MAX_LINKS];
+	/* results missing below this one are lost */
+	unsigned long lost;
+	int status;
+};
+
+int reorder_initialize(struct reorder *r, struct reorder_params *p,
+		       struct pipeline *pipe);
+void reorder_teardown(struct reorder *r);
+int reorder_run(struct reorder *r);
+int reorder_print_stats(struct reorder *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __REORDER_H_ */
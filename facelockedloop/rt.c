@@ -0,0 +1,88 @@
+/**
+ * @file facelockedloop/rt.c
+ * @brief Memory locking and page fault accounting for real-time kernels.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rt.h"
+
+/* counted by the allocators of rtalloc.c, when linked in */
+__thread int rt_watching;
+__thread unsigned long rt_allocs;
+
+/*
+ * Everything mapped now and later stays in memory, and the heap neither
+ * shrinks nor goes to mmap, so memory freed after warm-up is reused
+ * without faulting again.
+ */
+int rt_lock_memory(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char *reserve;
+	size_t n;
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		printf("rt: cannot lock memory: %s, check ulimit -l.\n",
+		       strerror(errno));
+		return -errno;
+	}
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	reserve = malloc(RT_HEAP_RESERVE);
+	if (!reserve)
+		return -ENOMEM;
+	for (n = 0; n < RT_HEAP_RESERVE; n += page)
+		reserve[n] = 0;
+	free(reserve);
+
+	return 0;
+}
+
+/* from the thread owning the stack, as early as possible */
+void rt_prefault_stack(size_t bytes)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	volatile char *p = alloca(bytes);
+	size_t n;
+
+	for (n = 0; n < bytes; n += page)
+		p[n] = 0;
+}
+
+void rt_watch(int on)
+{
+	rt_watching = on;
+}
+
+void rt_sample(struct rt_sample *s)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_THREAD, &usage);
+	s->minflt = usage.ru_minflt;
+	s->majflt = usage.ru_majflt;
+	s->allocs = rt_allocs;
+}
+
+int rt_since(struct rt_sample *before)
+{
+	struct rt_sample now;
+
+	rt_sample(&now);
+	before->minflt = now.minflt - before->minflt;
+	before->majflt = now.majflt - before->majflt;
+	before->allocs = now.allocs - before->allocs;
+
+	return before->minflt || before->majflt || before->allocs;
+}
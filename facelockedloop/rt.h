@@ -0,0 +1,42 @@
+#ifndef __RT_H_
+#define __RT_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* worker stacks, all of it prefaulted but a margin for the prefault itself */
+#define RT_STACK_DEFAULT (1024 * 1024)
+#define RT_STACK_MARGIN (16 * 1024)
+/* heap faulted in, and kept, before any thread starts */
+#define RT_HEAP_RESERVE (8 * 1024 * 1024)
+
+/*
+ * Page faults and heap allocations of the calling thread over a stretch
+ * of code, such as one stage step. Allocations are only counted in the
+ * programs linking rtalloc.c, where malloc can be wrapped (glibc), and
+ * only while rt_watch() is on.
+ */
+struct rt_sample {
+	long minflt;
+	long majflt;
+	unsigned long allocs;
+};
+
+extern __thread int rt_watching;
+extern __thread unsigned long rt_allocs;
+
+int rt_lock_memory(void);
+void rt_prefault_stack(size_t bytes);
+void rt_watch(int on);
+void rt_sample(struct rt_sample *s);
+/* what happened since 'before', in 'before' */
+int rt_since(struct rt_sample *before);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RT_H_ */
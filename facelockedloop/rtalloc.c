@@ -0,0 +1,92 @@
+/**
+ * @file facelockedloop/rtalloc.c
+ * @brief Heap allocations counted per thread, see rt_watch().
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+#include "rt.h"
+
+#if defined(__GLIBC__)
+/*
+ * Every allocation of fll and of the libraries it uses, OpenCV included,
+ * goes through here, aligned ones too; the count is per thread and costs
+ * nothing to the threads not watched. Only fll links this file, so no
+ * other program has its allocator replaced.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+void *malloc(size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (!alignment || alignment % sizeof(void *) ||
+	    (alignment & (alignment - 1)))
+		return EINVAL;
+	if (rt_watching)
+		++rt_allocs;
+	p = __libc_memalign(alignment, size);
+	if (!p)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+void *valloc(size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size)
+{
+	if (rt_watching)
+		++rt_allocs;
+	return __libc_pvalloc(size);
+}
+#endif
@@ -0,0 +1,401 @@
+/**
+ * @file facelockedloop/scene.c
+ * @brief Synthetic scenes of moving faces as a capture source.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(HAVE_OPENCV2)
+#include "opencv2/imgproc/imgproc_c.h"
+#endif
+
+#include "scene.h"
+#include "time_utils.h"
+#include "debug.h"
+
+int scene_match(const char *spec)
+{
+	return !strncmp(spec, "scene", 5) &&
+		(!spec[5] || spec[5] == ':' || spec[5] == '@');
+}
+
+#if defined(HAVE_OPENCV2)
+
+static int scene_path(const char *name)
+{
+	static const char *const paths[] = {
+		[SCENE_CIRCLE] = "circle",
+		[SCENE_BOUNCE] = "bounce",
+		[SCENE_LINE] = "line",
+		[SCENE_STILL] = "still",
+	};
+	unsigned int n;
+
+	for (n = 0; n < sizeof(paths) / sizeof(paths[0]); n++)
+		if (!strcmp(name, paths[n]))
+			return n;
+	return -EINVAL;
+}
+
+/*
+ * scene[:<w>x<h>][:faces=<n>][:size=<px>][:path=<circle|bounce|line|
+ * still>][:speed=<px>][:noise=<n>][:light=<frames>][:image=<file>]
+ * [:truth=<file>], the fps after an '@' as for any file.
+ */
+static int scene_parse(struct scene *s, char *spec)
+{
+	char *tok, *save, *val;
+	int ret;
+
+	for (tok = strtok_r(spec + 5, ":", &save); tok;
+	     tok = strtok_r(NULL, ":", &save)) {
+		val = strchr(tok, '=');
+		if (!val) {
+			if (sscanf(tok, "%dx%d", &s->width, &s->height) != 2)
+				return -EINVAL;
+			continue;
+		}
+		*val++ = '\0';
+		if (!strcmp(tok, "faces"))
+			s->nfaces = atoi(val);
+		else if (!strcmp(tok, "size"))
+			s->size = atoi(val);
+		else if (!strcmp(tok, "speed"))
+			s->speed = atoi(val);
+		else if (!strcmp(tok, "noise"))
+			s->noise = atoi(val);
+		else if (!strcmp(tok, "light"))
+			s->light = atoi(val);
+		else if (!strcmp(tok, "image"))
+			s->still = val;
+		else if (!strcmp(tok, "truth"))
+			s->truth = fopen(val, "w");
+		else if (!strcmp(tok, "path")) {
+			ret = scene_path(val);
+			if (ret < 0)
+				return ret;
+			s->path = ret;
+		} else
+			return -EINVAL;
+		if (!strcmp(tok, "truth") && !s->truth)
+			return -errno;
+	}
+
+	if (s->width < 16 || s->height < 16 || s->nfaces < 0 ||
+	    s->nfaces > SCENE_MAX_FACES || s->speed < 0 || s->noise < 0 ||
+	    s->noise > 127 || s->light < 0)
+		return -EINVAL;
+	if (!s->size)
+		s->size = s->height / 4;
+	if (s->size < 8 || s->size > s->width || s->size > s->height)
+		return -EINVAL;
+	return 0;
+}
+
+/* a face drawn once: head, brows, eyes, nose and mouth, in gray */
+static void scene_draw_face(IplImage *p, int size)
+{
+	CvPoint c = cvPoint(size / 2, size / 2);
+	int eye_x = size * 17 / 100, eye_y = size / 10;
+
+	cvEllipse(p, c, cvSize(size * 2 / 5, size / 2 - 1), 0, 0, 360,
+		  cvScalarAll(190), -1, 8, 0);
+	cvRectangle(p, cvPoint(c.x - eye_x - size / 10, c.y - eye_y * 2),
+		    cvPoint(c.x - eye_x + size / 10, c.y - eye_y * 2 + size / 40),
+		    cvScalarAll(70), -1, 8, 0);
+	cvRectangle(p, cvPoint(c.x + eye_x - size / 10, c.y - eye_y * 2),
+		    cvPoint(c.x + eye_x + size / 10, c.y - eye_y * 2 + size / 40),
+		    cvScalarAll(70), -1, 8, 0);
+	cvEllipse(p, cvPoint(c.x - eye_x, c.y - eye_y),
+		  cvSize(size * 8 / 100, size / 25), 0, 0, 360,
+		  cvScalarAll(40), -1, 8, 0);
+	cvEllipse(p, cvPoint(c.x + eye_x, c.y - eye_y),
+		  cvSize(size * 8 / 100, size / 25), 0, 0, 360,
+		  cvScalarAll(40), -1, 8, 0);
+	cvEllipse(p, cvPoint(c.x, c.y + size / 20),
+		  cvSize(size / 25, size / 12), 0, 0, 360,
+		  cvScalarAll(150), -1, 8, 0);
+	cvEllipse(p, cvPoint(c.x, c.y + size * 22 / 100),
+		  cvSize(size * 15 / 100, size / 20), 0, 0, 360,
+		  cvScalarAll(70), -1, 8, 0);
+}
+
+/* the largest centered square of the image, to the size of a face */
+static int scene_crop(IplImage *p, const char *path)
+{
+	IplImage *img = cvLoadImage(path, CV_LOAD_IMAGE_GRAYSCALE);
+	int side;
+
+	if (!img)
+		return -ENOENT;
+	side = img->width < img->height ? img->width : img->height;
+	cvSetImageROI(img, cvRect((img->width - side) / 2,
+				  (img->height - side) / 2, side, side));
+	cvResize(img, p, CV_INTER_AREA);
+	cvReleaseImage(&img);
+	return 0;
+}
+
+/* spread out, each face with its own phase along the path */
+static void scene_place(struct scene *s)
+{
+	struct scene_face *f;
+	int n;
+
+	for (n = 0; n < s->nfaces; n++) {
+		f = &s->faces[n];
+		f->phase = 2 * M_PI * n / s->nfaces;
+		f->x = s->width * (n + 1) / (s->nfaces + 1);
+		f->y = s->height * (n + 1) / (s->nfaces + 1);
+		f->dx = s->speed * cos(f->phase + M_PI / 5);
+		f->dy = s->speed * sin(f->phase + M_PI / 5);
+		if (s->path == SCENE_LINE)
+			f->y = s->height / 2 + (n % 2 ? s->size : 0) *
+				(n / 2 % 2 ? -1 : 1);
+	}
+}
+
+static void scene_move(struct scene *s, struct scene_face *f)
+{
+	double half = s->size / 2.0, r, a;
+
+	switch (s->path) {
+	case SCENE_CIRCLE:
+		r = (s->width < s->height ? s->width : s->height) / 2.0 - half;
+		a = r > 1 ? s->rendered * s->speed / r + f->phase : f->phase;
+		f->x = s->width / 2.0 + r * cos(a);
+		f->y = s->height / 2.0 + r * sin(a);
+		break;
+	case SCENE_BOUNCE:
+		f->x += f->dx;
+		f->y += f->dy;
+		if (f->x < half || f->x > s->width - half) {
+			f->dx = -f->dx;
+			f->x += 2 * f->dx;
+		}
+		if (f->y < half || f->y > s->height - half) {
+			f->dy = -f->dy;
+			f->y += 2 * f->dy;
+		}
+		break;
+	case SCENE_LINE:
+		/* in from the left, out on the right, and again */
+		f->x += s->speed;
+		if (f->x > s->width + half)
+			f->x = -half;
+		break;
+	case SCENE_STILL:
+		break;
+	}
+}
+
+/* a face pasted where it is, what is out of the frame left out */
+static void scene_paste(struct scene *s, struct scene_face *f, CvRect *box)
+{
+	int x0 = (int)f->x - s->size / 2, y0 = (int)f->y - s->size / 2;
+	int x1 = x0 + s->size, y1 = y0 + s->size;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 > s->width)
+		x1 = s->width;
+	if (y1 > s->height)
+		y1 = s->height;
+	*box = cvRect(x0, y0, x1 - x0, y1 - y0);
+	if (box->width <= 0 || box->height <= 0)
+		return;
+
+	cvSetImageROI(s->patch, cvRect(x0 - ((int)f->x - s->size / 2),
+				       y0 - ((int)f->y - s->size / 2),
+				       box->width, box->height));
+	cvSetImageROI(s->image, *box);
+	cvCopy(s->patch, s->image, NULL);
+	cvResetImageROI(s->image);
+	cvResetImageROI(s->patch);
+}
+
+/* lighting and noise over the whole frame, faces included */
+static void scene_expose(struct scene *s)
+{
+	unsigned char *row;
+	unsigned int r = s->rng, span = 2 * s->noise + 1;
+	int x, y, v, light = 0;
+
+	if (s->light)
+		light = SCENE_LIGHT_SWING *
+			sin(2 * M_PI * (s->rendered % s->light) / s->light);
+	if (!light && !s->noise)
+		return;
+
+	for (y = 0; y < s->height; y++) {
+		row = (unsigned char *)s->image->imageData +
+			y * s->image->widthStep;
+		for (x = 0; x < s->width; x++) {
+			v = row[x] + light;
+			if (s->noise) {
+				/* xorshift32 */
+				r ^= r << 13;
+				r ^= r >> 17;
+				r ^= r << 5;
+				v += (int)(((r >> 16) * span) >> 16) - s->noise;
+			}
+			row[x] = v < 0 ? 0 : v > 255 ? 255 : v;
+		}
+	}
+	s->rng = r;
+}
+
+static void scene_close(struct imager *i)
+{
+	struct scene *s = i->params.scene;
+
+	if (!s)
+		return;
+	if (s->truth)
+		fclose(s->truth);
+	if (s->patch)
+		cvReleaseImage(&s->patch);
+	if (s->image)
+		cvReleaseImage(&s->image);
+	free((char *)s->spec);
+	free(s);
+	i->params.scene = NULL;
+}
+
+static int scene_open(struct imager *i)
+{
+	struct scene *s;
+	char *spec, *at;
+	int ret;
+
+	s = calloc(1, sizeof(*s));
+	spec = strdup(i->params.path);
+	if (!s || !spec) {
+		free(s);
+		free(spec);
+		return -ENOMEM;
+	}
+	s->spec = spec;
+	i->params.scene = s;
+	s->width = SCENE_WIDTH;
+	s->height = SCENE_HEIGHT;
+	s->nfaces = 1;
+	s->path = SCENE_CIRCLE;
+	s->speed = 4;
+	s->rng = 2463534242u;
+	s->fps = CAPTURE_DEFAULT_FPS;
+
+	at = strrchr(spec, '@');
+	if (at) {
+		*at++ = '\0';
+		s->fps = atoi(at);
+	}
+	ret = scene_parse(s, spec);
+	if (ret) {
+		printf("%s: bad scene, see --help.\n", i->params.path);
+		goto fail;
+	}
+
+	s->image = cvCreateImage(cvSize(s->width, s->height), IPL_DEPTH_8U, 1);
+	s->patch = cvCreateImage(cvSize(s->size, s->size), IPL_DEPTH_8U, 1);
+	if (!s->image || !s->patch) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	cvSet(s->patch, cvScalarAll(SCENE_BACKGROUND), NULL);
+	if (s->still) {
+		ret = scene_crop(s->patch, s->still);
+		if (ret) {
+			printf("%s: cannot load %s.\n", i->params.path,
+			       s->still);
+			goto fail;
+		}
+	} else {
+		scene_draw_face(s->patch, s->size);
+	}
+	scene_place(s);
+
+	if (s->fps) {
+		i->rate.fps = s->fps;
+		i->rate.applied_fps = s->fps;
+	}
+	printf("scene: %dx%d, %d faces of %d px, %d px a frame, noise %d, "
+	       "light %d, %d fps.\n", s->width, s->height, s->nfaces,
+	       s->size, s->speed, s->noise, s->light, s->fps);
+	return 0;
+fail:
+	scene_close(i);
+	return ret;
+}
+
+/*
+ * Truth lines: frame number, CLOCK_MONOTONIC ns it was drawn at (right
+ * before capture stamps it), then x0 y0 x1 y1 of every face in it.
+ */
+static int scene_grab(struct imager *i)
+{
+	struct scene *s = i->params.scene;
+	struct timespec drawn;
+	CvRect box;
+	int n;
+
+	capture_pace(&s->due, s->fps);
+
+	cvSet(s->image, cvScalarAll(SCENE_BACKGROUND), NULL);
+	if (s->truth) {
+		clock_gettime(CLOCK_MONOTONIC, &drawn);
+		fprintf(s->truth, "%lu %llu", s->rendered,
+			timespec_nsecs(&drawn));
+	}
+	for (n = 0; n < s->nfaces; n++) {
+		if (s->rendered)
+			scene_move(s, &s->faces[n]);
+		scene_paste(s, &s->faces[n], &box);
+		if (s->truth && box.width > 0 && box.height > 0)
+			fprintf(s->truth, " %d %d %d %d", box.x, box.y,
+				box.x + box.width, box.y + box.height);
+	}
+	if (s->truth)
+		fputc('\n', s->truth);
+	scene_expose(s);
+	++(s->rendered);
+	return 0;
+}
+
+static void *scene_retrieve(struct imager *i)
+{
+	return i->params.scene->image;
+}
+
+static enum capture_format scene_format(struct imager *i)
+{
+	return CAPTURE_FORMAT_GRAY;
+}
+
+static int scene_set_fps(struct imager *i, int fps)
+{
+	i->params.scene->fps = fps;
+	timespec_zero(&i->params.scene->due);
+	return 0;
+}
+
+const struct capture_source scene_source = {
+	.name = "scene",
+	.stable = 0,
+	.open = scene_open,
+	.grab = scene_grab,
+	.retrieve = scene_retrieve,
+	.format = scene_format,
+	.set_fps = scene_set_fps,
+	.close = scene_close,
+};
+
+#endif /* HAVE_OPENCV2 */
@@ -0,0 +1,77 @@
+#ifndef __SCENE_H_
+#define __SCENE_H_
+
+#include <stdio.h>
+#include <time.h>
+
+#include "capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCENE_MAX_FACES 16
+#define SCENE_WIDTH 640
+#define SCENE_HEIGHT 480
+#define SCENE_BACKGROUND 96
+/* brightness swing of a lighting cycle, either way */
+#define SCENE_LIGHT_SWING 48
+
+enum scene_path {
+	SCENE_CIRCLE = 0,
+	SCENE_BOUNCE = 1,
+	SCENE_LINE = 2,
+	SCENE_STILL = 3,
+};
+
+int scene_match(const char *spec);
+
+#if defined(HAVE_OPENCV2)
+
+/* where a face is now, its center, and where it heads */
+struct scene_face {
+	double x;
+	double y;
+	double dx;
+	double dy;
+	double phase;
+};
+
+/*
+ * Frames drawn on the fly, as a capture source: faces, drawn once as a
+ * patch or cropped from a still image, moving along a path over a flat
+ * background, with noise and a lighting cycle on top. Where every face
+ * was is written, frame by frame, to the truth file if there is one.
+ */
+struct scene {
+	const char *spec;
+	int width;
+	int height;
+	int nfaces;
+	int size;
+	enum scene_path path;
+	/* pixels per frame */
+	int speed;
+	/* +/- on every pixel, and frames per lighting cycle (0: none) */
+	int noise;
+	int light;
+	const char *still;
+	FILE *truth;
+	struct scene_face faces[SCENE_MAX_FACES];
+	unsigned long rendered;
+	unsigned int rng;
+	int fps;
+	struct timespec due;
+	IplImage *patch;
+	IplImage *image;
+};
+
+extern const struct capture_source scene_source;
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SCENE_H_ */
@@ -0,0 +1,111 @@
+/**
+ * @file facelockedloop/shmstats.c
+ * @brief Live statistics published in POSIX shared memory.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "shmstats.h"
+#include "pipeline.h"
+#include "time_utils.h"
+
+/* replaces the segment of an fll that did not clean up */
+struct shmstats *shmstats_open(const char *name)
+{
+	struct shmstats *s;
+	int fd;
+
+	fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("shm: cannot create %s: %s.\n", name, strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(*s))) {
+		printf("shm: cannot size %s: %s.\n", name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	s = mmap(NULL, sizeof(*s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		printf("shm: cannot map %s: %s.\n", name, strerror(errno));
+		shm_unlink(name);
+		return NULL;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->version = SHMSTATS_VERSION;
+	s->pid = getpid();
+	clock_gettime(CLOCK_MONOTONIC, &s->started);
+	/* readers check the magic last */
+	__atomic_store_n(&s->magic, SHMSTATS_MAGIC, __ATOMIC_RELEASE);
+
+	return s;
+}
+
+void shmstats_close(struct shmstats *s, const char *name)
+{
+	munmap(s, sizeof(*s));
+	shm_unlink(name);
+}
+
+void shmstats_begin(struct shmstats *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shmstats_end(struct shmstats *s)
+{
+	clock_gettime(CLOCK_MONOTONIC, &s->updated);
+	++(s->updates);
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* between shmstats_begin() and shmstats_end() */
+void shmstats_stages(struct shmstats *s, struct pipeline *pipe)
+{
+	struct shmstats_stage *ss;
+	struct stage *stg;
+	int n, l;
+
+	s->nstages = 0;
+	for (n = 0; n < pipe->nstgs && s->nstages < SHMSTATS_MAX_STAGES;
+	     n++) {
+		stg = pipe->stgs[n];
+		if (!stg)
+			continue;
+
+		ss = &s->stages[s->nstages++];
+		snprintf(ss->name, sizeof(ss->name), "%s", stg->params.name);
+		ss->nth = stg->params.nth_stage;
+		ss->fused = !!(stg->flags & STAGE_FUSED);
+		ss->ofinterest = stg->stats.ofinterest;
+		ss->persecond = stg->stats.persecond;
+		ss->overall = timespec_nsecs(&stg->stats.overall);
+		ss->last = timespec_nsecs(&stg->duration);
+		ss->runs = histogram_count(&stg->stats.run);
+		ss->run_p50 = histogram_percentile(&stg->stats.run, 50.0);
+		ss->run_p99 = histogram_percentile(&stg->stats.run, 99.0);
+		ss->latency_p50 = histogram_percentile(&stg->stats.latency,
+						       50.0);
+		ss->latency_p99 = histogram_percentile(&stg->stats.latency,
+						       99.0);
+		ss->dropped = 0;
+		ss->superseded = 0;
+		for (l = 0; l < stg->nout; l++) {
+			ss->dropped += stg->stats.links[l].dropped;
+			ss->superseded += stg->stats.links[l].superseded;
+		}
+		ss->overruns = stg->budget.overruns;
+		ss->skipped = stg->budget.skipped;
+	}
+}
@@ -0,0 +1,109 @@
+#ifndef __SHMSTATS_H_
+#define __SHMSTATS_H_
+
+#include <sys/types.h>
+#include <errno.h>
+#include <time.h>
+
+#include "servolib.h"
+#include "store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMSTATS_NAME "/fll-stats"
+#define SHMSTATS_MAGIC 0x534c4c46	/* "FLLS" */
+#define SHMSTATS_VERSION 2
+#define SHMSTATS_MAX_STAGES 16
+#define SHMSTATS_MAX_CAMERAS STORE_MAX_CAMERAS
+#define SHMSTATS_NAME_LEN 16
+
+/*
+ * Live counters of a running fll, for readers such as fll-top. Every
+ * time is in ns. Only fll writes, a seqlock keeps readers consistent:
+ * 'seq' is odd while an update is under way, and a copy is only good if
+ * 'seq' was even and the same before and after it.
+ */
+struct shmstats_stage {
+	char name[SHMSTATS_NAME_LEN];
+	int nth;
+	int fused;
+	unsigned long ofinterest;
+	unsigned long persecond;
+	unsigned long long overall;
+	unsigned long long last;
+	unsigned long runs;
+	unsigned long long run_p50;
+	unsigned long long run_p99;
+	unsigned long long latency_p50;
+	unsigned long long latency_p99;
+	unsigned long dropped;
+	unsigned long superseded;
+	unsigned long overruns;
+	unsigned long skipped;
+};
+
+/* a camera, and the tracker steering its servos */
+struct shmstats_camera {
+	unsigned long frames;
+	int fps;
+	int cadence;
+	/* of the faces found on this camera only */
+	unsigned long long e2e_p50;
+	unsigned long long e2e_p99;
+	int dev;
+	/* pan and tilt */
+	struct servo_stats servos[2];
+};
+
+struct shmstats {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int seq;
+	pid_t pid;
+	struct timespec started;
+	struct timespec updated;
+	unsigned long updates;
+	int nstages;
+	struct shmstats_stage stages[SHMSTATS_MAX_STAGES];
+	/* of every camera, the detectors are shared */
+	unsigned long frames;
+	unsigned long faces;
+	int ncameras;
+	struct shmstats_camera cameras[SHMSTATS_MAX_CAMERAS];
+};
+
+struct pipeline;
+
+/* fll side */
+struct shmstats *shmstats_open(const char *name);
+void shmstats_close(struct shmstats *s, const char *name);
+void shmstats_begin(struct shmstats *s);
+void shmstats_end(struct shmstats *s);
+void shmstats_stages(struct shmstats *s, struct pipeline *pipe);
+
+/* a consistent copy of the segment, -EAGAIN if fll kept writing */
+static inline int shmstats_read(const struct shmstats *s,
+				struct shmstats *copy)
+{
+	unsigned int seq;
+	int tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		*copy = *s;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EAGAIN;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SHMSTATS_H_ */
@@ -7,7 +7,12 @@ extern "C" {
   
 #include <time.h>
 
+/* cameras one process serves, each with its own servos */
+#define STORE_MAX_CAMERAS 4
+
 struct store_box {
+	/* capture order of the frame the box was found in */
+	unsigned long seq;
 	/* if there is no coordinates, request a scan*/
 	int scan;
 	/* bounding box coordinates */
@@ -17,11 +22,63 @@ struct store_box {
 	int ptB_y;
 };
 
+/*
+ * Frame handed from capture to its consumers. 'refs' counts the holders:
+ * capture only reuses a frame once every consumer has put it back.
+ */
+struct store_frame {
+	int refs;
+	unsigned long seq;
+	/* when it was grabbed, CLOCK_MONOTONIC */
+	struct timespec stamp;
+	/* decoded at 1/scale of its size */
+	int scale;
+	/* its size in pixels before scaling, the one boxes are given in */
+	int width;
+	int height;
+	/* which camera of the rig grabbed it */
+	int camera;
+	void *image;
+};
+
+static inline int store_frame_busy(struct store_frame *f)
+{
+	return __atomic_load_n(&f->refs, __ATOMIC_ACQUIRE) != 0;
+}
+
+static inline void store_frame_get(struct store_frame *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+static inline void store_frame_put(struct store_frame *f)
+{
+	__atomic_sub_fetch(&f->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Detection result on its way to the tracker, with the capture time of
+ * the frame it came from. Both times are CLOCK_MONOTONIC. Results come
+ * from a pool of their detector and are 'busy' until put back, from
+ * whichever thread is done with them.
+ */
 struct facepos {
-	struct timeval timestamp;
+	struct timespec timestamp;
+	struct timespec detected;
 	struct store_box box;
+	/* size of the frame the box is in */
+	int width;
+	int height;
+	/* of the frame, picks the tracker the result goes to */
+	int camera;
+	int busy;
 };
 
+static inline void store_result_put(struct facepos *p)
+{
+	__atomic_store_n(&p->busy, 0, __ATOMIC_RELEASE);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,193 @@
+/**
+ * @file facelockedloop/test-jpeg.c
+ * test program to measure what a JPEG frame costs until it is ready for
+ * detection: the highgui path (color decode, cvCvtColor and cvResize to
+ * the detection size) against the gray decode of the jpeg capture
+ * source, scaled down by libjpeg in the DCT.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_OPENCV2)
+#include "opencv2/highgui/highgui_c.h"
+#include "opencv2/imgproc/imgproc_c.h"
+#endif
+
+#include "jpegfile.h"
+#include "time_utils.h"
+
+#define MAX_FRAMES 4096
+
+static const unsigned char *frames[MAX_FRAMES];
+static size_t sizes[MAX_FRAMES];
+static int nframes;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return timespec_nsecs(&t);
+}
+
+#if defined(HAVE_OPENCV2)
+
+/* ns per frame: decoded in color, made gray, resized to 1/denom */
+static unsigned long long bench_highgui(int denom, int runs)
+{
+	IplImage *color, *gray = NULL, *small = NULL;
+	unsigned long long start, total = 0;
+	CvMat *buf = NULL;
+	int r, n;
+
+	for (r = 0; r < runs; r++) {
+		for (n = 0; n < nframes; n++) {
+			start = now_ns();
+			buf = cvCreateMatHeader(1, sizes[n], CV_8UC1);
+			cvSetData(buf, (void *)frames[n], sizes[n]);
+			color = cvDecodeImage(buf, CV_LOAD_IMAGE_COLOR);
+			if (!color) {
+				cvReleaseMat(&buf);
+				return 0;
+			}
+			if (!gray) {
+				gray = cvCreateImage(cvSize(color->width,
+							    color->height),
+						     IPL_DEPTH_8U, 1);
+				small = cvCreateImage(
+					cvSize(color->width / denom,
+					       color->height / denom),
+					IPL_DEPTH_8U, 1);
+			}
+			cvCvtColor(color, gray, CV_BGR2GRAY);
+			if (denom > 1)
+				cvResize(gray, small, CV_INTER_AREA);
+			total += now_ns() - start;
+			cvReleaseImage(&color);
+			cvReleaseMat(&buf);
+		}
+	}
+	cvReleaseImage(&gray);
+	cvReleaseImage(&small);
+	return total / ((unsigned long long)runs * nframes);
+}
+
+#else
+
+static unsigned long long bench_highgui(int denom, int runs)
+{
+	return 0;
+}
+
+#endif
+
+#if defined(HAVE_LIBJPEG)
+
+/* ns per frame: decoded to gray at 1/denom */
+static unsigned long long bench_scaled(int denom, int runs,
+				       unsigned char *out, size_t size)
+{
+	unsigned long long start, total = 0;
+	struct jpegdec dec;
+	int r, n, w, h;
+
+	if (jpegdec_init(&dec))
+		return 0;
+	for (r = 0; r < runs; r++) {
+		for (n = 0; n < nframes; n++) {
+			start = now_ns();
+			/* stride: the widest a frame may be */
+			if (jpegdec_gray(&dec, frames[n], sizes[n], denom, out,
+					 size / 8192, size, &w, &h)) {
+				jpegdec_fini(&dec);
+				return 0;
+			}
+			total += now_ns() - start;
+		}
+	}
+	jpegdec_fini(&dec);
+	return total / ((unsigned long long)runs * nframes);
+}
+
+#else
+
+static unsigned long long bench_scaled(int denom, int runs,
+				       unsigned char *out, size_t size)
+{
+	return 0;
+}
+
+#endif
+
+int main(int argc, char *const argv[])
+{
+	unsigned long long highgui, scaled;
+	unsigned char *map, *out;
+	struct stat st;
+	size_t off, size;
+	int fd, runs, denom;
+	long len;
+
+	if (argc < 2) {
+		printf("usage: test-jpeg <file.mjpg|file.jpg> [runs]\n");
+		return -EINVAL;
+	}
+	runs = argc > 2 ? atoi(argv[2]) : 10;
+	if (runs < 1)
+		runs = 1;
+
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st))
+		return -errno;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+	for (off = 0; off < (size_t)st.st_size && nframes < MAX_FRAMES; ) {
+		len = jpeg_frame_len(map + off, st.st_size - off);
+		if (len < 0) {
+			off++;
+			continue;
+		}
+		frames[nframes] = map + off;
+		sizes[nframes++] = len;
+		off += len;
+	}
+	if (!nframes) {
+		printf("%s: no JPEG images.\n", argv[1]);
+		return -ENODATA;
+	}
+
+	/* rows of up to 8192 pixels, 8192 of them */
+	size = 8192 * 8192;
+	out = malloc(size);
+	if (!out)
+		return -ENOMEM;
+
+	printf("%s: %d images, %d runs.\n", argv[1], nframes, runs);
+	printf("scale    highgui+cvt+resize    scaled gray    speedup\n");
+	for (denom = 1; denom <= JPEG_MAX_DENOM; denom *= 2) {
+		highgui = bench_highgui(denom, runs);
+		scaled = bench_scaled(denom, runs, out, size);
+		if (!highgui)
+			printf("1/%d               n/a       %8.1f us\n",
+			       denom, scaled / 1000.0);
+		else
+			printf("1/%d      %12.1f us    %8.1f us    %6.1fx\n",
+			       denom, highgui / 1000.0, scaled / 1000.0,
+			       scaled ? (double)highgui / scaled : 0.0);
+	}
+
+	free(out);
+	munmap(map, st.st_size);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,250 @@
+/**
+ * @file facelockedloop/test-pipeline.c
+ * test program to measure the cost of handing items between stages,
+ * with semaphores and with spinning futexes, and of the stage threads
+ * themselves against fused stages and the cooperative executor.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "time_utils.h"
+
+#define MAX_STAGES 16
+
+/* none, every stage on the worker of the source, or as measured */
+enum bench_fuse {
+	FUSE_NONE,
+	FUSE_ALL,
+	FUSE_AUTO,
+};
+
+static struct stage stages[MAX_STAGES];
+static unsigned long produced, consumed, nitems, work;
+
+/* stands for the processing of an item, in microseconds */
+static void busy(unsigned long usecs)
+{
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while (timespec_delta(&start, &now) <
+		 usecs * FLL_NANOSECONDS_IN_MICROSECOND);
+}
+
+static void bench_up(struct stage *stg, struct stage_params *p,
+		     struct stage_ops *o, struct pipeline *pipe)
+{
+	stage_up(stg, p, o, pipe);
+	pipeline_register(pipe, stg);
+}
+
+static int source_run(struct stage *stg)
+{
+	if (produced < nitems)
+		stg->params.data_out = (void *)(produced + 1);
+	return 0;
+}
+
+static int source_output(struct stage *stg, void *it)
+{
+	if (stage_output(stg, it))
+		return -EAGAIN;
+	++produced;
+	return 0;
+}
+
+static int filter_input(struct stage *stg, void **it)
+{
+	void *itin;
+
+	return stage_input(stg, &itin);
+}
+
+static int filter_run(struct stage *stg)
+{
+	busy(work);
+	stg->params.data_out = stg->params.data_in;
+	return 0;
+}
+
+static int filter_output(struct stage *stg, void *it)
+{
+	return stage_output(stg, it) ? -EAGAIN : 0;
+}
+
+static int sink_run(struct stage *stg)
+{
+	busy(work);
+	++consumed;
+	return 0;
+}
+
+static struct stage_ops source_ops = {
+	.up = bench_up,
+	.down = stage_down,
+	.run = source_run,
+	.go = stage_go,
+	.wait = stage_wait,
+	.output = source_output,
+};
+
+static struct stage_ops filter_ops = {
+	.up = bench_up,
+	.down = stage_down,
+	.run = filter_run,
+	.go = stage_go,
+	.wait = stage_wait,
+	.input = filter_input,
+	.output = filter_output,
+};
+
+static struct stage_ops sink_ops = {
+	.up = bench_up,
+	.down = stage_down,
+	.run = sink_run,
+	.go = stage_go,
+	.wait = stage_wait,
+	.input = filter_input,
+};
+
+/*
+ * Every item went once through every link, and the scheduler never
+ * started a stage on an empty one; a push may find a link full only when
+ * its consumer was about to free a slot, or it is a drop.
+ */
+static int bench_check(int nstages)
+{
+	struct stage_queue *q;
+	int n, ret = 0;
+
+	for (n = 1; n < nstages; n++) {
+		q = &stages[n].in[0]->q;
+		if (q->prod.enqueued == nitems && q->cons.dequeued == nitems &&
+		    !q->cons.empty &&
+		    q->prod.full >= stages[n - 1].stats.links[0].dropped)
+			continue;
+		printf("link %d: enqueued %lu, dequeued %lu, full %lu, "
+		       "empty %lu, dropped %lu.\n", n, q->prod.enqueued,
+		       q->cons.dequeued, q->prod.full, q->cons.empty,
+		       stages[n - 1].stats.links[0].dropped);
+		ret = -EPROTO;
+	}
+	return ret;
+}
+
+static int bench(int nstages, enum pipeline_mode mode,
+		 enum handoff_kind kind, unsigned int spin,
+		 enum bench_fuse fuse)
+{
+	struct stage_params p = { .name = "bench" };
+	struct pipeline pipe;
+	struct rusage before, after;
+	struct timespec start, stop, wall;
+	unsigned long cpu;
+	struct stage_ops *o;
+	int n, ret;
+
+	produced = consumed = 0;
+	pipeline_init(&pipe);
+	pipeline_set_mode(&pipe, mode);
+	pipeline_set_handoff(&pipe, kind, spin);
+	for (n = 0; n < nstages; n++) {
+		o = !n ? &source_ops :
+			(n == nstages - 1 ? &sink_ops : &filter_ops);
+		o->up(&stages[n], &p, o, &pipe);
+		if (n)
+			pipeline_link(&pipe, &stages[n - 1], &stages[n]);
+	}
+	ret = pipeline_build(&pipe);
+	if (ret)
+		return ret;
+	for (n = 1; fuse == FUSE_ALL && n < nstages; n++)
+		pipeline_fuse(&pipe, &stages[n - 1], &stages[n]);
+	if (fuse == FUSE_AUTO)
+		pipeline_set_autofuse(&pipe, 100);
+
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (consumed < nitems) {
+		ret = pipeline_run(&pipe);
+		if (ret)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	getrusage(RUSAGE_SELF, &after);
+	if (!ret)
+		ret = bench_check(nstages);
+	pipeline_teardown(&pipe);
+
+	timespec_substract(&wall, &stop, &start);
+	cpu = timeval_usecs(&after.ru_utime) + timeval_usecs(&after.ru_stime) -
+		timeval_usecs(&before.ru_utime) -
+		timeval_usecs(&before.ru_stime);
+	printf("%-11s %-5s %-5s spin %6u: %8lu items/s, %7.2f us/item, "
+	       "cpu %5.1f%%, %ld+%ld context switches\n",
+	       mode == PIPELINE_COOPERATIVE ? "cooperative" : "overlapped",
+	       fuse == FUSE_ALL ? "fused" : (fuse == FUSE_AUTO ? "auto" : ""),
+	       kind == HANDOFF_SEM ? "sem" : "futex", spin,
+	       timespec_usecs(&wall) ?
+	       consumed * FLL_MICROSECONDS_IN_SECOND / timespec_usecs(&wall) :
+	       0, (double)timespec_usecs(&wall) / consumed,
+	       100.0 * cpu / timespec_usecs(&wall),
+	       after.ru_nvcsw - before.ru_nvcsw,
+	       after.ru_nivcsw - before.ru_nivcsw);
+
+	return ret;
+}
+
+int main(int argc, char *const argv[])
+{
+	static const unsigned int spins[] = { 0, 100, 1000, 10000 };
+	int nstages = 3, single, failed = 0;
+	unsigned int n;
+
+	nitems = 20000;
+	if (argc > 1)
+		nitems = atol(argv[1]);
+	if (argc > 2)
+		nstages = atoi(argv[2]);
+	if (argc > 3)
+		work = atol(argv[3]);
+	if (nstages < 2 || nstages > MAX_STAGES || !nitems) {
+		printf("usage: test-pipeline [items] [stages, 2 to %d] "
+		       "[us of work per stage and item]\n", MAX_STAGES);
+		return -EINVAL;
+	}
+
+	printf("%lu items through %d stages, %lu us of work each.\n",
+	       nitems, nstages, work);
+	failed += !!bench(nstages, PIPELINE_OVERLAPPED, HANDOFF_SEM, 0,
+			  FUSE_NONE);
+	/* a spinning waiter only holds off the thread it waits for */
+	single = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+	if (single)
+		printf("single cpu: the futex rows that spin are skipped.\n");
+	for (n = 0; n < sizeof(spins) / sizeof(spins[0]); n++)
+		if (!single || !spins[n])
+			failed += !!bench(nstages, PIPELINE_OVERLAPPED,
+					  HANDOFF_FUTEX, spins[n], FUSE_NONE);
+	failed += !!bench(nstages, PIPELINE_OVERLAPPED, HANDOFF_SEM, 0,
+			  FUSE_ALL);
+	failed += !!bench(nstages, PIPELINE_OVERLAPPED, HANDOFF_SEM, 0,
+			  FUSE_AUTO);
+	failed += !!bench(nstages, PIPELINE_COOPERATIVE, HANDOFF_SEM, 0,
+			  FUSE_NONE);
+
+	if (failed)
+		printf("%d configurations failed the link checks.\n", failed);
+	return failed ? -EPROTO : 0;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file facelockedloop/threads.c
+ * @brief CPU affinity and scheduling policy of the fll threads.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "threads.h"
+
+static const char *const roles[] = {
+	"capture", "grab", "detect", "reorder", "track",
+	"override", "signal", "control", "main",
+};
+
+static struct thread_sched table[THREADS_MAX_ROLES];
+static int nentries;
+static cpu_set_t isolated;
+static int nisolated;
+
+static int role_valid(const char *role)
+{
+	unsigned int n;
+
+	for (n = 0; n < sizeof(roles) / sizeof(roles[0]); n++)
+		if (!strcmp(role, roles[n]))
+			return 1;
+	return 0;
+}
+
+static struct thread_sched *role_lookup(const char *role)
+{
+	int n;
+
+	for (n = 0; n < nentries; n++)
+		if (!strcmp(table[n].role, role))
+			return &table[n];
+	return NULL;
+}
+
+/* "any", or a list such as "1", "2-3" or "0,2" */
+static int parse_cpus(char *s, struct thread_sched *ts)
+{
+	char *tok, *save, *end;
+	long first, last;
+
+	CPU_ZERO(&ts->cpus);
+	ts->ncpus = 0;
+	if (!strcmp(s, "any"))
+		return 0;
+
+	for (tok = strtok_r(s, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		first = strtol(tok, &end, 10);
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == tok || *end || first < 0 || last < first ||
+		    last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (; first <= last; first++)
+			CPU_SET(first, &ts->cpus);
+	}
+	ts->ncpus = CPU_COUNT(&ts->cpus);
+
+	return ts->ncpus ? 0 : -EINVAL;
+}
+
+static int parse_policy(const char *s)
+{
+	if (!strcmp(s, "other"))
+		return SCHED_OTHER;
+	if (!strcmp(s, "fifo"))
+		return SCHED_FIFO;
+	if (!strcmp(s, "rr"))
+		return SCHED_RR;
+	return -EINVAL;
+}
+
+static const char *policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "fifo";
+	case SCHED_RR:
+		return "rr";
+	case SCHED_OTHER:
+		return "other";
+	}
+	return "?";
+}
+
+/*
+ * spec: <role>:<cpus>[:<other|fifo|rr>[:<prio>]][:isolate]
+ * The last setting given for a role wins.
+ */
+int threads_configure(const char *spec)
+{
+	struct thread_sched ts, *entry;
+	char *copy, *tok, *save;
+	int n, ret = -EINVAL;
+
+	copy = strdup(spec);
+	if (!copy)
+		return -ENOMEM;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.policy = SCHED_OTHER;
+
+	tok = strtok_r(copy, ":", &save);
+	if (!tok || !role_valid(tok))
+		goto out;
+	strncpy(ts.role, tok, THREADS_ROLE_LEN - 1);
+
+	tok = strtok_r(NULL, ":", &save);
+	if (!tok || parse_cpus(tok, &ts))
+		goto out;
+
+	tok = strtok_r(NULL, ":", &save);
+	if (tok && strcmp(tok, "isolate")) {
+		ts.policy = parse_policy(tok);
+		if (ts.policy < 0)
+			goto out;
+		ts.prio = sched_get_priority_min(ts.policy);
+		tok = strtok_r(NULL, ":", &save);
+		if (tok && strcmp(tok, "isolate")) {
+			ts.prio = atoi(tok);
+			if (ts.prio < sched_get_priority_min(ts.policy) ||
+			    ts.prio > sched_get_priority_max(ts.policy))
+				goto out;
+			tok = strtok_r(NULL, ":", &save);
+		}
+	}
+	if (tok) {
+		if (strcmp(tok, "isolate") || !ts.ncpus)
+			goto out;
+		ts.isolate = 1;
+		tok = strtok_r(NULL, ":", &save);
+	}
+	if (tok)
+		goto out;
+
+	entry = role_lookup(ts.role);
+	if (!entry) {
+		if (nentries == THREADS_MAX_ROLES) {
+			ret = -ENOSPC;
+			goto out;
+		}
+		entry = &table[nentries++];
+	}
+	*entry = ts;
+
+	CPU_ZERO(&isolated);
+	for (n = 0; n < nentries; n++)
+		if (table[n].isolate)
+			CPU_OR(&isolated, &isolated, &table[n].cpus);
+	nisolated = CPU_COUNT(&isolated);
+	ret = 0;
+out:
+	free(copy);
+	return ret;
+}
+
+static void print_cpus(char *buf, size_t len, cpu_set_t *set)
+{
+	int cpu, n = 0;
+
+	buf[0] = '\0';
+	for (cpu = 0; cpu < CPU_SETSIZE && n < (int)len - 5; cpu++)
+		if (CPU_ISSET(cpu, set))
+			n += snprintf(buf + n, len - n, "%s%d",
+				      n ? "," : "", cpu);
+}
+
+/*
+ * Places one thread as configured for its role and reports what it
+ * actually got; failures, typically EPERM for the real-time policies,
+ * are reported but the thread keeps running where it was.
+ */
+int threads_apply(const char *role, const char *name, pthread_t tid)
+{
+	static cpu_set_t allowed;
+	static int have_allowed;
+	struct thread_sched *ts = role_lookup(role);
+	struct sched_param param;
+	cpu_set_t cpus;
+	char buf[64];
+	int policy, ret = 0, err;
+
+	if (!have_allowed) {
+		/* before any fll thread has been moved */
+		sched_getaffinity(0, sizeof(allowed), &allowed);
+		have_allowed = 1;
+	}
+
+	if (ts && ts->ncpus) {
+		cpus = ts->cpus;
+	} else if (nisolated) {
+		/* whatever the process may use, minus the isolated cpus */
+		CPU_XOR(&cpus, &allowed, &isolated);
+		CPU_AND(&cpus, &cpus, &allowed);
+	}
+	if ((ts && ts->ncpus) || nisolated) {
+		err = pthread_setaffinity_np(tid, sizeof(cpus), &cpus);
+		if (err) {
+			printf("sched: %s: cannot set affinity: %s.\n", name,
+			       strerror(err));
+			ret = -err;
+		}
+	}
+
+	if (ts) {
+		param.sched_priority = ts->prio;
+		err = pthread_setschedparam(tid, ts->policy, &param);
+		if (err) {
+			printf("sched: %s: cannot set %s priority %d: %s.\n",
+			       name, policy_name(ts->policy), ts->prio,
+			       strerror(err));
+			ret = -err;
+		}
+	}
+
+	if (pthread_getaffinity_np(tid, sizeof(cpus), &cpus))
+		CPU_ZERO(&cpus);
+	print_cpus(buf, sizeof(buf), &cpus);
+	if (pthread_getschedparam(tid, &policy, &param)) {
+		policy = -1;
+		param.sched_priority = 0;
+	}
+	printf("sched: %-8s %-12s cpus %s, %s priority %d%s.\n", role, name,
+	       buf, policy_name(policy), param.sched_priority,
+	       ts && ts->isolate ? ", isolated" : "");
+
+	return ret;
+}
@@ -0,0 +1,35 @@
+#ifndef __THREADS_H_
+#define __THREADS_H_
+
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* capture, grab, detect, reorder, track, override, signal, control, main */
+#define THREADS_MAX_ROLES 9
+#define THREADS_ROLE_LEN 16
+
+/*
+ * Placement of every fll thread playing a given role. Threads whose role
+ * has no cpus set may run anywhere but on the isolated cpus.
+ */
+struct thread_sched {
+	char role[THREADS_ROLE_LEN];
+	cpu_set_t cpus;
+	int ncpus;	/* 0: any cpu */
+	int policy;	/* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+	int prio;
+	int isolate;	/* no other fll thread on these cpus */
+};
+
+int threads_configure(const char *spec);
+int threads_apply(const char *role, const char *name, pthread_t tid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __THREADS_H_ */
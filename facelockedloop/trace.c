@@ -0,0 +1,156 @@
+/**
+ * @file facelockedloop/trace.c
+ * @brief Span events of every fll thread, saved as Chrome trace JSON.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "time_utils.h"
+
+struct trace_event {
+	const char *name;
+	unsigned long long start;
+	unsigned long long duration;
+};
+
+/* written by its own thread only, read once tracing stops */
+struct trace_buffer {
+	struct trace_buffer *next;
+	pid_t tid;
+	char name[TRACE_NAME_LEN];
+	unsigned long count;
+	struct trace_event events[TRACE_EVENTS];
+};
+
+int trace_enabled;
+
+static const char *trace_path;
+static struct trace_buffer *buffers;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_buffer *mine;
+
+int trace_start(const char *path)
+{
+	if (!path)
+		return -EINVAL;
+
+	trace_path = path;
+	trace_enabled = 1;
+	return 0;
+}
+
+/*
+ * Gives the calling thread its buffer and its name in the trace. Called
+ * by a thread before its first span, it keeps allocation out of the
+ * traced code.
+ */
+void trace_thread(const char *name)
+{
+	struct trace_buffer *b;
+
+	if (!trace_enabled)
+		return;
+
+	b = mine;
+	if (!b) {
+		b = calloc(1, sizeof(*b));
+		if (!b)
+			return;
+		b->tid = syscall(SYS_gettid);
+		pthread_mutex_lock(&buffers_lock);
+		b->next = buffers;
+		buffers = b;
+		pthread_mutex_unlock(&buffers_lock);
+		mine = b;
+	}
+	if (name)
+		snprintf(b->name, sizeof(b->name), "%s", name);
+	else
+		snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+}
+
+void __trace_span(const char *name, unsigned long long start)
+{
+	struct trace_event *e;
+	struct timespec now;
+
+	if (!mine) {
+		trace_thread(NULL);
+		if (!mine)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	e = &mine->events[mine->count % TRACE_EVENTS];
+	e->name = name;
+	e->start = start;
+	e->duration = timespec_nsecs(&now) - start;
+	__atomic_store_n(&mine->count, mine->count + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_write_thread(FILE *f, struct trace_buffer *b, int *first)
+{
+	struct trace_event *e;
+	unsigned long n, count;
+
+	fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",",
+		getpid(), b->tid, b->name);
+	*first = 0;
+
+	count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+	n = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+	for (; n < count; n++) {
+		e = &b->events[n % TRACE_EVENTS];
+		/* microseconds, as the format wants */
+		fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+			"\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+			e->name, getpid(), b->tid,
+			e->start / 1000, e->start % 1000,
+			e->duration / 1000, e->duration % 1000);
+	}
+	if (count > TRACE_EVENTS)
+		printf("trace: %s lost its %lu oldest events.\n", b->name,
+		       count - TRACE_EVENTS);
+}
+
+/*
+ * Threads still running, such as the override, may add a span or two
+ * while this writes, so their buffers are left to the process exit.
+ */
+int trace_stop(void)
+{
+	struct trace_buffer *b;
+	int first = 1;
+	FILE *f;
+
+	if (!trace_enabled)
+		return 0;
+	trace_enabled = 0;
+
+	f = fopen(trace_path, "w");
+	if (!f) {
+		printf("trace: cannot write %s.\n", trace_path);
+		return -errno;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	pthread_mutex_lock(&buffers_lock);
+	for (b = buffers; b; b = b->next)
+		trace_write_thread(f, b, &first);
+	pthread_mutex_unlock(&buffers_lock);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("trace: written to %s.\n", trace_path);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* events kept per thread, the oldest are overwritten */
+#define TRACE_EVENTS 16384
+#define TRACE_NAME_LEN 32
+
+extern int trace_enabled;
+
+int trace_start(const char *path);
+int trace_stop(void);
+void trace_thread(const char *name);
+void __trace_span(const char *name, unsigned long long start);
+
+/*
+ * Spans are recorded as:
+ *	t = trace_begin();
+ *	...
+ *	trace_end("what", t);
+ * Both are almost free while tracing is off.
+ */
+static inline unsigned long long trace_begin(void)
+{
+	struct timespec now;
+
+	if (!trace_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline void trace_end(const char *name, unsigned long long start)
+{
+	if (start)
+		__trace_span(name, start);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRACE_H_ */
@@ -13,29 +13,149 @@
 #include <string.h>
 
 #include "track.h"
+#include "control.h"
 #include "servolib.h"
 #include "kernel_utils.h"
 #include "time_utils.h"
 #include "debug.h"
+#include "trace.h"
 
-static const int tilt_change_rate = 64;
-static const int pan_change_rate = 64;
-
-#define MAX_FRAME_WIDTH	640
-#define MAX_FRAME_HEIGHT 480
+#define TRACK_CHANGE_RATE 64
+#define TRACK_HOLD_MS 350
 
 enum servo_id { pan = 0, tilt = 1};
+/* servos of the first tracker, the keyboard override steers them */
 static int pan_channel = -1;
 static int tilt_channel = -1;
-static sem_t acc_lock;
 
 static const char* const tname = "tracker";
+/*
+ * One tracker per camera, whose servo_stats count the commands to its
+ * channels. Trackers start in parallel and are never removed.
+ */
+static struct tracker *trackers[STORE_MAX_CAMERAS];
+static int ntrackers;
+static pthread_mutex_t trackers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The servo devices of those trackers. servolib writes a command and
+ * reads its reply on each call: the calls to one device, from trackers,
+ * the override or the homing at startup, are made one at a time.
+ */
+static struct track_device {
+	int id;
+	pthread_mutex_t lock;
+} devices[STORE_MAX_CAMERAS];
+static int ndevices;
 
 static int track_get_max_abse(struct tracker *t);
 static int track_update_stats(struct tracker *t);
 static int override_setup(pthread_attr_t *attr, int prio);
 static void *override_ctrl(void *cookie);
 
+/* readers of the tally, such as --shm, run on other threads */
+static void track_count(int id, int channel, enum servo_cmd cmd)
+{
+	struct servo_stats *s = NULL;
+	struct tracker *t;
+	int n, count = __atomic_load_n(&ntrackers, __ATOMIC_ACQUIRE);
+
+	for (n = 0; n < count && !s; n++) {
+		t = trackers[n];
+		if (t->params.dev != id)
+			continue;
+		if (channel == t->params.pan_params.channel)
+			s = &t->stats.pan_stats;
+		else if (channel == t->params.tilt_params.channel)
+			s = &t->stats.tilt_stats;
+	}
+	if (!s)
+		return;
+	__atomic_add_fetch(&s->cmdstally[cmd], 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->lastcmd, cmd, __ATOMIC_RELAXED);
+}
+
+/* 1 for the first tracker, which gets the keyboard override */
+static int track_register(struct tracker *t)
+{
+	int n, first;
+
+	pthread_mutex_lock(&trackers_lock);
+	if (ntrackers == STORE_MAX_CAMERAS) {
+		pthread_mutex_unlock(&trackers_lock);
+		return -ENOSPC;
+	}
+	first = !ntrackers;
+	if (first) {
+		pan_channel = t->params.pan_params.channel;
+		tilt_channel = t->params.tilt_params.channel;
+	}
+	trackers[ntrackers] = t;
+	for (n = 0; n < ndevices; n++)
+		if (devices[n].id == t->params.dev)
+			break;
+	if (n == ndevices) {
+		devices[n].id = t->params.dev;
+		pthread_mutex_init(&devices[n].lock, NULL);
+		__atomic_store_n(&ndevices, n + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ntrackers, ntrackers + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trackers_lock);
+	return first;
+}
+
+/* of a registered tracker, the table only grows */
+static pthread_mutex_t *track_device_lock(int id)
+{
+	int n, count = __atomic_load_n(&ndevices, __ATOMIC_ACQUIRE);
+
+	for (n = 0; n < count; n++)
+		if (devices[n].id == id)
+			return &devices[n].lock;
+	return NULL;
+}
+
+/* the servolib calls, serialized per device, traced and counted */
+static int track_set_pulse(int id, int channel, int value)
+{
+	pthread_mutex_t *lock = track_device_lock(id);
+	unsigned long long span = trace_begin();
+	int ret;
+
+	track_count(id, channel, SERVOIO_WRITE);
+	pthread_mutex_lock(lock);
+	ret = servoio_set_pulse(id, channel, value);
+	pthread_mutex_unlock(lock);
+	trace_end("servoio_set_pulse", span);
+	return ret;
+}
+
+static int track_get_position(int id, int channel)
+{
+	pthread_mutex_t *lock = track_device_lock(id);
+	unsigned long long span = trace_begin();
+	int ret;
+
+	track_count(id, channel, SERVOIO_READ);
+	pthread_mutex_lock(lock);
+	ret = servoio_get_position(id, channel);
+	pthread_mutex_unlock(lock);
+	trace_end("servoio_get_position", span);
+	return ret;
+}
+
+static int track_configure(int id, int channel, int value)
+{
+	pthread_mutex_t *lock = track_device_lock(id);
+	int ret;
+
+	track_count(id, channel, SERVOIO_CONFIG);
+	pthread_mutex_lock(lock);
+	ret = servoio_configure(id, channel, value, 0, 0);
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
 static void track_stage_up(struct stage *stg, struct stage_params *p,
 			     struct stage_ops *o,struct pipeline *pipe)
 {
@@ -59,20 +179,23 @@ static int track_stage_run(struct stage *stg)
 {
 	struct tracker *tracer = container_of(stg, struct tracker, step);
 	int ret;
-	static long last = 0;
 	struct timespec spec;
 	long current;
 
 	if (!tracer)
 		return -EINVAL;
 
+	/* a change under way keeps the settings of the last run */
+	control_snapshot(&tracer->live, &tracer->tunables,
+			 sizeof(tracer->live));
+
 	/* artificial delay */
 	clock_gettime(CLOCK_REALTIME, &spec);
 	current = timespec_msecs(&spec);
-	if (current < last)
+	if (current < tracer->holdoff)
 		return 0;
 
-	last = timespec_msecs(&spec) + 350;
+	tracer->holdoff = timespec_msecs(&spec) + tracer->live.hold;
 
 	ret = track_run(tracer);
 	stg->stats.ofinterest = track_get_max_abse(tracer);
@@ -94,18 +217,62 @@ static int track_stage_input(struct stage *stg, void **it)
 {
 	void *itin = NULL;
 	struct tracker *tracer;
+	struct facepos *pos;
+	int ret;
 
 	tracer = container_of(stg, struct tracker, step);
 	if (!tracer)
 		return -EINVAL;
 
-	stage_input(stg, &itin);
-	tracer->params.bbox  = *(struct store_box*) itin;
-        free((struct store_box*)itin);
+	ret = stage_input(stg, &itin);
+	if (ret)
+		return ret;
+	pos = itin;
+	tracer->params.bbox = pos->box;
+	tracer->params.width = pos->width > 0 ? pos->width : TRACK_REF_WIDTH;
+	tracer->params.height = pos->height > 0 ?
+		pos->height : TRACK_REF_HEIGHT;
+	tracer->params.captured = pos->timestamp;
+	tracer->params.detected = pos->detected;
+	histogram_record(&tracer->stats.detect,
+			 timespec_delta(&pos->timestamp, &pos->detected));
+	store_result_put(pos);
 
 	return 0;
 }
 
+static void track_stage_printstats(struct stage *stg)
+{
+	struct tracker *tracer = container_of(stg, struct tracker, step);
+
+	stage_printstats(stg);
+	histogram_print("detect", &tracer->stats.detect);
+	histogram_print("command", &tracer->stats.command);
+	histogram_print("e2e", &tracer->stats.e2e);
+	histogram_print("age", &tracer->stats.age);
+}
+
+/* the servo command tally keeps counting, like the frames captured */
+static void track_stage_reset(struct stage *stg)
+{
+	struct tracker *tracer = container_of(stg, struct tracker, step);
+	struct servo_stats *s[] = {
+		&tracer->stats.pan_stats, &tracer->stats.tilt_stats,
+	};
+	unsigned int n;
+
+	histogram_reset(&tracer->stats.detect);
+	histogram_reset(&tracer->stats.command);
+	histogram_reset(&tracer->stats.e2e);
+	histogram_reset(&tracer->stats.age);
+	for (n = 0; n < sizeof(s) / sizeof(s[0]); n++) {
+		s[n]->min_pos = 0;
+		s[n]->max_pos = 0;
+		s[n]->min_poserr = 0;
+		s[n]->max_poserr = 0;
+	}
+}
+
 static struct stage_ops track_ops = {
 	.up = track_stage_up,
 	.down = track_stage_down,
@@ -113,43 +280,74 @@ static struct stage_ops track_ops = {
 	.wait = track_stage_wait,
 	.go = track_stage_go,
 	.input = track_stage_input,
+	.printstats = track_stage_printstats,
+	.reset = track_stage_reset,
 };
 
 int track_initialize(struct tracker *t, struct tracker_params *p,
 		     struct pipeline *pipe)
 {
   	struct stage_params stgparams;
-	int ret;
+	int ret, first;
 	pthread_attr_t ov_attr;
-	pthread_t override;
-	
-	pan_channel = p->pan_params.channel;
-	tilt_channel = p->tilt_params.channel;
 	
-	stgparams.nth_stage = TRACKING_STAGE;
+	stgparams.nth_stage = 0;
 	stgparams.data_out = NULL;
 	stgparams.data_in = NULL;
+	stgparams.depth = 0;
+	stgparams.dispatch = STAGE_DISPATCH_ALL;
 	stgparams.name = "TRA_STG";
 	p->pan_params.home_position = HOME_POSITION_QUARTER_US;
 	p->tilt_params.home_position = HOME_POSITION_QUARTER_US;
 
 	t->params = *p;
-
-	ret = sem_init(&acc_lock, 0, 1);
+	t->params.width = TRACK_REF_WIDTH;
+	t->params.height = TRACK_REF_HEIGHT;
+	timespec_zero(&t->params.captured);
+	timespec_zero(&t->params.detected);
+	t->moved = 0;
+	histogram_reset(&t->stats.detect);
+	histogram_reset(&t->stats.command);
+	histogram_reset(&t->stats.e2e);
+	histogram_reset(&t->stats.age);
+	t->tunables.pan_rate = TRACK_CHANGE_RATE;
+	t->tunables.tilt_rate = TRACK_CHANGE_RATE;
+	t->tunables.hold = TRACK_HOLD_MS;
+	t->live = t->tunables;
+	t->scan.backwards = 0;
+	t->scan.skip = 0;
+	t->scan.step = 256;
+	t->holdoff = 0;
+	t->with_override = 0;
+
+	ret = sem_init(&t->hold, 0, 1);
 	if (ret < 0) {
-		printf("%s failed to init acc_lock.\n", __func__);
+		printf("%s failed to init hold.\n", __func__);
 		return -EIO;
 	}
 
-	ret = override_setup(&ov_attr, 0);
-	if (ret) {
-		printf("%s failed to setup override thread.\n", __func__);
-		return -EIO;
+	first = track_register(t);
+	if (first < 0) {
+		printf("%s too many trackers.\n", __func__);
+		return first;
 	}
 
-	ret = pthread_create(&override, &ov_attr, override_ctrl, &t->params.dev);
-	if (ret)
-		printf("%s failed to create override thread.\n", __func__);
+	if (first) {
+		ret = override_setup(&ov_attr, 0);
+		if (ret) {
+			printf("%s failed to setup override thread.\n",
+			       __func__);
+			return -EIO;
+		}
+
+		/* placed later on, along with the other fll threads */
+		ret = pthread_create(&t->override, &ov_attr, override_ctrl,
+				     &t->params.dev);
+		t->with_override = !ret;
+		if (ret)
+			printf("%s failed to create override thread.\n",
+			       __func__);
+	}
 #if 0
 	ret = servoio_all_go_home(t->params.dev);
 	if (ret < 0) {
@@ -157,14 +355,14 @@ int track_initialize(struct tracker *t, struct tracker_params *p,
 		return -EIO;
 	}
 #endif
-	ret = servoio_set_pulse(t->params.dev, t->params.pan_params.channel,
+	ret = track_set_pulse(t->params.dev, t->params.pan_params.channel,
 				HOME_POSITION_QUARTER_US);
 	if (ret < 0) {
 		debug(t, "%s set pulse error %d.\n", __func__, ret);
 		return -EIO;
 	}
 
-	ret = servoio_set_pulse(t->params.dev, t->params.tilt_params.channel,
+	ret = track_set_pulse(t->params.dev, t->params.tilt_params.channel,
 				HOME_POSITION_QUARTER_US);
 	if (ret < 0) {
 		debug(t, "%s set pulse error %d.\n", __func__, ret);
@@ -189,15 +387,15 @@ void track_teardown(struct tracker *t)
 	}
 #endif
 
-	ret = servoio_configure(t->params.dev, t->params.pan_params.channel,
-				HOME_POSITION_QUARTER_US, 0, 0);
+	ret = track_configure(t->params.dev, t->params.pan_params.channel,
+			      HOME_POSITION_QUARTER_US);
 	if (ret < 0) {
 		debug(t, "%s stopping pan servo failed %d.\n", __func__, ret);
 		return;
 	}
 
-	ret = servoio_configure(t->params.dev, t->params.tilt_params.channel,
-				HOME_POSITION_QUARTER_US, 0, 0);
+	ret = track_configure(t->params.dev, t->params.tilt_params.channel,
+			      HOME_POSITION_QUARTER_US);
 	if (ret < 0) {
 		debug(t, "%s stopping tilt servo failed %d.\n", __func__, ret);
 		return;
@@ -208,17 +406,26 @@ void track_teardown(struct tracker *t)
  * 4000 0.25us => all the way left/up
  * 6000 0.25us => servo span middle/middle
  * 8000 0.25us => all the way right/down
+ *
+ * pixels are out of span, the frame width or height: the error is the
+ * same fraction of the frame whatever its resolution.
  */
-static int map_pixels2servoio_pos(enum servo_id sid, int pixels, int cpos)
+static int map_pixels2servoio_pos(enum servo_id sid, int pixels, int span,
+				  int cpos, struct tracker_tunables *rates)
 {
 	int servo_tgt;
+
+	if (sid == pan)
+		pixels = pixels * TRACK_REF_WIDTH / span;
+	else
+		pixels = pixels * TRACK_REF_HEIGHT / span;
 	
-	printf( "%s pan_rate:%d, tilt_rate:%d.\n", __func__, pan_change_rate,
-	       tilt_change_rate);
+	printf( "%s pan_rate:%d, tilt_rate:%d.\n", __func__, rates->pan_rate,
+	       rates->tilt_rate);
 	
 	if (sid == pan) {
 
-		servo_tgt = cpos + pixels/pan_change_rate;
+		servo_tgt = cpos + pixels/rates->pan_rate;
 
 		/* 
 		 * errata : to avoid pan servo stalling on extreme positions of 
@@ -241,7 +448,7 @@ static int map_pixels2servoio_pos(enum servo_id sid, int pixels, int cpos)
 		
 	}
 	else  {
-		servo_tgt = cpos - pixels/tilt_change_rate;
+		servo_tgt = cpos - pixels/rates->tilt_rate;
 
 		/* 
 		 * errata : to avoid tilt servo stalling on  extreme postions of
@@ -280,79 +487,91 @@ static int get_pixels_shift(int ptM, int ptC)
 	return ptM - ptC;
 }
 
-static int move_servo(int id, int channel, int target)
+/* a servo has just been told to move on behalf of the current frame */
+static void track_moved(struct tracker *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	histogram_record(&t->stats.age,
+			 timespec_delta(&t->params.captured, &now));
+	t->moved = 1;
+}
+
+static int move_servo(struct tracker *t, int channel, int target)
 {
+	int id = t->params.dev;
 	int pos = 0, ret;
 	int i;
 
 	for (i = 0; i < 10 && !!(target - pos); i++) {
 
-		ret = servoio_set_pulse(id, channel, target);
+		ret = track_set_pulse(id, channel, target);
 		if (ret < 0) {
 			return -EIO;
 		}
 
-		pos = servoio_get_position(id, channel);
+		pos = track_get_position(id, channel);
 		if (pos < 0) {
 			return -EIO;
 		}
 	}
 
 	/* we did our best ... not much we can do */
+	track_moved(t);
 	return 0;
 }
 
-static int start_scan_seq(struct tracker_params *p)
+static int start_scan_seq(struct tracker *t)
 {
-	static struct {
-		enum {fwd, bck} direction;
-		int skip;
-		int step;
-	} value = {
-		.direction = fwd,
-		.step = 256,
-		.skip = 0,
-		};
+	struct tracker_params *p = &t->params;
+	struct tracker_scan *value = &t->scan;
+	int pan_ch = p->pan_params.channel;
+	int ret;
 	char ch;
 	volatile int v;
 	/* skip every other frame */
-	value.skip = ~value.skip;
-	if (value.skip)
+	value->skip = ~value->skip;
+	if (value->skip)
 		return 0;
 
-	v = servoio_get_position(p->dev, pan_channel);
+	v = track_get_position(p->dev, pan_ch);
 
 
-	if (value.direction == bck) {
+	if (value->backwards) {
 		ch = '-';
-		if ((v - value.step) > SERVOLIB_MAX_PULSE_QUARTER_US) 
+		if ((v - value->step) > SERVOLIB_MAX_PULSE_QUARTER_US) 
 			v = SERVOLIB_MAX_PULSE_QUARTER_US;
 		
-		else if ((v - value.step) > SERVOLIB_MIN_PULSE_QUARTER_US)
-				v -= value.step;
+		else if ((v - value->step) > SERVOLIB_MIN_PULSE_QUARTER_US)
+				v -= value->step;
 		else {
-			value.direction = fwd;
+			value->backwards = 0;
 			v = SERVOLIB_MIN_PULSE_QUARTER_US + 256;
 			goto done;
 		}
 	}
 
-	if (value.direction == fwd) {
+	if (!value->backwards) {
 		ch = '+';
-		if ((v + value.step) < SERVOLIB_MIN_PULSE_QUARTER_US) 
+		if ((v + value->step) < SERVOLIB_MIN_PULSE_QUARTER_US) 
 			v = SERVOLIB_MIN_PULSE_QUARTER_US + 256;
 		
-		else if ((v + value.step) < SERVOLIB_MAX_PULSE_QUARTER_US)
-			v += value.step;
+		else if ((v + value->step) < SERVOLIB_MAX_PULSE_QUARTER_US)
+			v += value->step;
 		else {
-			value.direction = bck;
+			value->backwards = 1;
 			v = SERVOLIB_MAX_PULSE_QUARTER_US;
 		}
 	}
 done:
-	printf("search%c\t[%d, %d]\n", ch, v, servoio_get_position(p->dev, tilt_channel));
+	printf("search%c\t[%d, %d]\n", ch, v,
+	       track_get_position(p->dev, p->tilt_params.channel));
 
-	return servoio_set_pulse(p->dev, pan_channel, v);
+	ret = track_set_pulse(p->dev, pan_ch, v);
+	if (ret >= 0)
+		track_moved(t);
+	return ret;
 
 }
 
@@ -362,16 +581,18 @@ int track_run(struct tracker *t)
 	int box_ptC_x, box_ptC_y;
 	int cpos; /* current motor position */
 	int tpos; /* target motor position  */
+	struct timespec now;
 	int ret;
 
-	ret = sem_trywait(&acc_lock);
+	ret = sem_trywait(&t->hold);
 	if (ret < 0)
 		return 0;
-	
+
+	t->moved = 0;
 	id = t->params.dev;
 	if (t->params.bbox.scan) {
 		/* no detection, initialize scan sequence */
-		ret = start_scan_seq(&t->params);
+		ret = start_scan_seq(t);
 		goto done;
 	}
 	
@@ -381,14 +602,15 @@ int track_run(struct tracker *t)
 		debug(t, "%s: %d error %d.\n", __func__, __LINE__, box_ptC_x);
 		return -EINVAL;
 	}
-	cpos = servoio_get_position(id, pan_channel);
+	cpos = track_get_position(id, t->params.pan_params.channel);
 	if (cpos < 0) {
 		return -EINVAL;
 	}
 	t->params.pan_params.position = cpos;
 	
-	tpos = map_pixels2servoio_pos(pan, get_pixels_shift(MAX_FRAME_WIDTH >> 1, box_ptC_x), cpos);
-	ret = move_servo(id, pan_channel, tpos);
+	tpos = map_pixels2servoio_pos(pan, get_pixels_shift(t->params.width >> 1, box_ptC_x),
+				      t->params.width, cpos, &t->live);
+	ret = move_servo(t, t->params.pan_params.channel, tpos);
 	if (ret) {
 		debug(t, "%s: %d error %d.\n", __func__, __LINE__, ret);
 		sleep(1000);
@@ -404,14 +626,15 @@ int track_run(struct tracker *t)
 		return -EINVAL;
 	}
 	
-	cpos = servoio_get_position(id, tilt_channel);
+	cpos = track_get_position(id, t->params.tilt_params.channel);
 	if (cpos < 0) {
 		return -EINVAL;
 	}
 	t->params.tilt_params.position = cpos;
 	
-	tpos = map_pixels2servoio_pos(tilt, get_pixels_shift(MAX_FRAME_HEIGHT >> 1, box_ptC_y), cpos);
-	ret = move_servo(id, tilt_channel, tpos);
+	tpos = map_pixels2servoio_pos(tilt, get_pixels_shift(t->params.height >> 1, box_ptC_y),
+				      t->params.height, cpos, &t->live);
+	ret = move_servo(t, t->params.tilt_params.channel, tpos);
 	if (ret) {
 		debug(t, "%s: %d error %d.\n", __func__, __LINE__, ret);
 
@@ -424,7 +647,14 @@ int track_run(struct tracker *t)
 	track_update_stats(t);
 
 done:
-	sem_post(&acc_lock);
+	if (t->moved) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		histogram_record(&t->stats.command,
+				 timespec_delta(&t->params.detected, &now));
+		histogram_record(&t->stats.e2e,
+				 timespec_delta(&t->params.captured, &now));
+	}
+	sem_post(&t->hold);
 	return ret;
 }
 
@@ -475,8 +705,20 @@ static void print_config(int dev)
 {
 	printf("Use the UP/DOWN cursor keys to calibrate the servos\n");
 	printf("any other key to exit\n");
-	printf("\tpan  :\t\t%3d\n", servoio_get_position(dev, pan_channel));
-	printf("\ttilt :\t\t%3d\n", servoio_get_position(dev, tilt_channel));
+	printf("\tpan  :\t\t%3d\n", track_get_position(dev, pan_channel));
+	printf("\ttilt :\t\t%3d\n", track_get_position(dev, tilt_channel));
+}
+
+/* while the keyboard steers, every tracker holds still */
+static void override_hold(int hold)
+{
+	int n, count = __atomic_load_n(&ntrackers, __ATOMIC_ACQUIRE);
+
+	for (n = 0; n < count; n++)
+		if (hold)
+			sem_wait(&trackers[n]->hold);
+		else
+			sem_post(&trackers[n]->hold);
 }
 
 static void *override_ctrl(void *cookie)
@@ -484,6 +726,7 @@ static void *override_ctrl(void *cookie)
 	int id, ch, pos, locked = 0;
 	char c;
 	id = *(int*)cookie;
+	trace_thread("override");
 	
 	for (;;) {
 		clear_screen();
@@ -492,10 +735,10 @@ static void *override_ctrl(void *cookie)
 		c = kbhit_irq();
 		if (!locked && (c == 'A' || c == 'B' || c == 'C' || c == 'D')) {
 			locked = 1;
-			sem_wait(&acc_lock);
+			override_hold(1);
 		}
 		else if (locked && (c == 'X')) {
-			sem_post(&acc_lock);
+			override_hold(0);
 			locked = 0;
 			continue;
 		}
@@ -506,29 +749,29 @@ static void *override_ctrl(void *cookie)
 			ch = tilt_channel;
 		}
 
-		pos = servoio_get_position(id, ch);
+		pos = track_get_position(id, ch);
 
 		switch(c) {
 		case 'B':
 		case 'C':
 			if ((pos-512) < SERVOLIB_MIN_PULSE_QUARTER_US)
-				servoio_set_pulse(id, ch, SERVOLIB_MIN_PULSE_QUARTER_US + 512);
+				track_set_pulse(id, ch, SERVOLIB_MIN_PULSE_QUARTER_US + 512);
 		
 			else if ((pos+256) > SERVOLIB_MAX_PULSE_QUARTER_US)
-			        servoio_set_pulse(id, ch, SERVOLIB_MAX_PULSE_QUARTER_US - 256);
+			        track_set_pulse(id, ch, SERVOLIB_MAX_PULSE_QUARTER_US - 256);
 			else 
 
-				servoio_set_pulse(id, ch, pos + 256);
+				track_set_pulse(id, ch, pos + 256);
 			break;
 		case 'A':
 		case 'D':
 			if ((pos-512) < SERVOLIB_MIN_PULSE_QUARTER_US)
-				servoio_set_pulse(id, ch, SERVOLIB_MIN_PULSE_QUARTER_US + 512);
+				track_set_pulse(id, ch, SERVOLIB_MIN_PULSE_QUARTER_US + 512);
 		
 			else if ((pos+256) > SERVOLIB_MAX_PULSE_QUARTER_US)
-			        servoio_set_pulse(id, ch, SERVOLIB_MAX_PULSE_QUARTER_US - 256);
+			        track_set_pulse(id, ch, SERVOLIB_MAX_PULSE_QUARTER_US - 256);
 			else 
-				servoio_set_pulse(id, ch, pos - 256);
+				track_set_pulse(id, ch, pos - 256);
 			break;
 		}
 	}
@@ -11,9 +11,34 @@ extern "C" {
 
 
 
+/*
+ * Latency of the frames behind the servo commands, all measured from the
+ * capture of the frame except 'command', which starts once detection is
+ * done: 'detect' for every result, 'command' and 'e2e' once the commands
+ * of a result are written, 'age' for each servo move on its own.
+ */
 struct tracker_stats {
 	struct servo_stats pan_stats;
 	struct servo_stats tilt_stats;
+	struct histogram detect;
+	struct histogram command;
+	struct histogram e2e;
+	struct histogram age;
+};
+
+/*
+ * Settings that may change between two results, taken once per run with
+ * control_snapshot(): pixels of error per servo step (0.25us) on each
+ * axis, counted as if the frame were TRACK_REF_WIDTH x TRACK_REF_HEIGHT,
+ * and ms to hold still after a move.
+ */
+#define TRACK_REF_WIDTH 640
+#define TRACK_REF_HEIGHT 480
+
+struct tracker_tunables {
+	int pan_rate;
+	int tilt_rate;
+	int hold;
 };
 
 struct tracker_params {
@@ -24,12 +49,36 @@ struct tracker_params {
 	struct servo_params pan_params;
 	struct servo_params tilt_params;
 	struct store_box bbox;
+	/* of the frame bbox was found in */
+	int width;
+	int height;
+	struct timespec captured;
+	struct timespec detected;
+};
+
+/* where the pan servo sweeps to while there is no face */
+struct tracker_scan {
+	int backwards;
+	int skip;
+	int step;
 };
 
 struct tracker {
 	struct stage step;
 	struct tracker_params params;
 	struct tracker_stats stats;
+	/* written by the control socket, and as of this run */
+	struct tracker_tunables tunables;
+	struct tracker_tunables live;
+	struct tracker_scan scan;
+	/* taken by a run, or held by the keyboard override */
+	sem_t hold;
+	/* results before then (ms, CLOCK_REALTIME) are ignored */
+	long holdoff;
+	/* only the first tracker has one, steering its own servos */
+	pthread_t override;
+	int with_override;
+	int moved;
 	int status;
 };
 
@@ -0,0 +1,284 @@
+/**
+ * @file facelockedloop/videofile.c
+ * @brief Y4M and raw video files as a capture source, served from mmap.
+ *
+ * @author Raquel Medina <raquel.medina.rodriguez@gmail.com>
+ *
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "videofile.h"
+#include "time_utils.h"
+#include "debug.h"
+
+#if defined(HAVE_OPENCV2)
+
+#define Y4M_MAGIC "YUV4MPEG2 "
+#define Y4M_FRAME "FRAME"
+
+/* bytes of the planes that follow the luma one, -ENOTSUP if unknown */
+static long y4m_chroma(const char *cs, int w, int h)
+{
+	long cw = (w + 1) / 2, ch = (h + 1) / 2;
+
+	if (strstr(cs, "p1"))	/* more than 8 bits per sample */
+		return -ENOTSUP;
+	if (!strncmp(cs, "mono", 4))
+		return 0;
+	if (!strncmp(cs, "420", 3))
+		return 2 * cw * ch;
+	if (!strncmp(cs, "422", 3))
+		return 2 * cw * h;
+	if (!strcmp(cs, "444alpha"))
+		return 3L * w * h;
+	if (!strncmp(cs, "444", 3))
+		return 2L * w * h;
+	if (!strncmp(cs, "411", 3))
+		return 2L * ((w + 3) / 4) * h;
+	return -ENOTSUP;
+}
+
+/*
+ * YUV4MPEG2 W<w> H<h> [F<n>:<d>] [C<colorspace>] ..., then every frame
+ * as FRAME [...] and its planes; only the luma plane is served.
+ */
+static int y4m_index(struct videofile *v)
+{
+	const char *p = (const char *)v->map, *end = p + v->len;
+	const char *eol, *tok;
+	char cs[16] = "420jpeg";
+	int num = 0, den = 0, n;
+	long chroma;
+	size_t framebytes;
+
+	if (v->len < strlen(Y4M_MAGIC) ||
+	    memcmp(p, Y4M_MAGIC, strlen(Y4M_MAGIC)))
+		return -EINVAL;
+	eol = memchr(p, '\n', v->len);
+	if (!eol)
+		return -EINVAL;
+
+	for (tok = p + strlen(Y4M_MAGIC) - 1; tok < eol; tok++) {
+		if (*tok != ' ')
+			continue;
+		switch (tok[1]) {
+		case 'W':
+			v->width = atoi(tok + 2);
+			break;
+		case 'H':
+			v->height = atoi(tok + 2);
+			break;
+		case 'F':
+			sscanf(tok + 2, "%d:%d", &num, &den);
+			break;
+		case 'C':
+			for (n = 0; n < (int)sizeof(cs) - 1 &&
+				     tok + 2 + n < eol && tok[2 + n] != ' '; n++)
+				cs[n] = tok[2 + n];
+			cs[n] = '\0';
+			break;
+		}
+	}
+	if (v->width <= 0 || v->height <= 0)
+		return -EINVAL;
+	chroma = y4m_chroma(cs, v->width, v->height);
+	if (chroma < 0) {
+		printf("%s: colorspace %s not supported.\n", v->path, cs);
+		return chroma;
+	}
+	if (num > 0 && den > 0)
+		v->fps = (num + den / 2) / den;
+	v->channels = 1;
+
+	framebytes = (size_t)v->width * v->height + chroma;
+	v->offsets = malloc((v->len / framebytes + 1) * sizeof(*v->offsets));
+	if (!v->offsets)
+		return -ENOMEM;
+	for (p = eol + 1; end - p > (long)strlen(Y4M_FRAME) &&
+		     !memcmp(p, Y4M_FRAME, strlen(Y4M_FRAME)); ) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol || (size_t)(end - eol - 1) < framebytes)
+			break;
+		v->offsets[v->nframes++] = eol + 1 - (const char *)v->map;
+		p = eol + 1 + framebytes;
+	}
+	return 0;
+}
+
+/*
+ * <w>x<h>[:bgr|gray|i420|nv12], frames back to back; of the YUV ones,
+ * luma first, only the luma plane is served.
+ */
+static int raw_index(struct videofile *v, const char *geometry)
+{
+	char format[8] = "bgr";
+	size_t framebytes;
+	unsigned long n;
+
+	if (sscanf(geometry, "%dx%d:%7s", &v->width, &v->height,
+		   format) < 2 || v->width <= 0 || v->height <= 0)
+		return -EINVAL;
+
+	framebytes = (size_t)v->width * v->height;
+	v->channels = 1;
+	if (!strcmp(format, "bgr")) {
+		v->channels = 3;
+		framebytes *= 3;
+	} else if (!strcmp(format, "i420") || !strcmp(format, "nv12")) {
+		framebytes += 2 * (size_t)((v->width + 1) / 2) *
+			((v->height + 1) / 2);
+	} else if (strcmp(format, "gray")) {
+		return -EINVAL;
+	}
+
+	v->offsets = malloc((v->len / framebytes + 1) * sizeof(*v->offsets));
+	if (!v->offsets)
+		return -ENOMEM;
+	for (n = 0; (n + 1) * framebytes <= v->len; n++)
+		v->offsets[v->nframes++] = n * framebytes;
+	return 0;
+}
+
+static void videofile_close(struct imager *i)
+{
+	struct videofile *v = i->params.file;
+
+	if (!v)
+		return;
+	if (v->map)
+		munmap(v->map, v->len);
+	if (v->fd >= 0)
+		close(v->fd);
+	free(v->offsets);
+	free((char *)v->path);
+	free(v);
+	i->params.file = NULL;
+}
+
+/* <file>[:<w>x<h>[:gray]][@<fps>], a geometry means a raw file */
+static int videofile_open(struct imager *i)
+{
+	struct videofile *v;
+	struct stat st;
+	char *spec, *geometry, *at;
+	int fps = -1, ret;
+
+	v = calloc(1, sizeof(*v));
+	spec = strdup(i->params.path);
+	if (!v || !spec) {
+		free(v);
+		free(spec);
+		return -ENOMEM;
+	}
+	v->fd = -1;
+	v->path = spec;
+	i->params.file = v;
+
+	at = strrchr(spec, '@');
+	if (at) {
+		*at++ = '\0';
+		fps = atoi(at);
+	}
+	geometry = strrchr(spec, '/');
+	geometry = strchr(geometry ? geometry : spec, ':');
+	if (geometry)
+		*geometry++ = '\0';
+
+	v->fd = open(spec, O_RDONLY | O_CLOEXEC);
+	if (v->fd < 0 || fstat(v->fd, &st)) {
+		ret = -errno;
+		printf("cannot open video file %s: %s.\n", spec,
+		       strerror(errno));
+		goto fail;
+	}
+	v->len = st.st_size;
+	v->map = mmap(NULL, v->len, PROT_READ, MAP_SHARED, v->fd, 0);
+	if (v->map == MAP_FAILED) {
+		v->map = NULL;
+		ret = -errno;
+		goto fail;
+	}
+	/* page cache, not worth keeping locked under --rt */
+	munlock(v->map, v->len);
+
+	v->fps = CAPTURE_DEFAULT_FPS;
+	ret = geometry ? raw_index(v, geometry) : y4m_index(v);
+	if (!ret && !v->nframes)
+		ret = -ENODATA;
+	if (ret) {
+		printf("%s: not a Y4M file, nor a raw one of that size.\n",
+		       spec);
+		goto fail;
+	}
+	if (fps >= 0)
+		v->fps = fps;
+	madvise(v->map, v->len, MADV_SEQUENTIAL);
+
+	cvInitImageHeader(&v->image, cvSize(v->width, v->height),
+			  IPL_DEPTH_8U, v->channels, IPL_ORIGIN_TL, 4);
+	if (v->fps) {
+		i->rate.fps = v->fps;
+		i->rate.applied_fps = v->fps;
+	}
+	printf("%s: %lu frames %dx%d, %s, %d fps.\n", spec, v->nframes,
+	       v->width, v->height, v->channels == 1 ? "luma" : "bgr",
+	       v->fps);
+	return 0;
+fail:
+	videofile_close(i);
+	return ret;
+}
+
+static int videofile_grab(struct imager *i)
+{
+	struct videofile *v = i->params.file;
+
+	capture_pace(&v->due, v->fps);
+
+	if (v->next == v->nframes) {
+		v->next = 0;
+		++(v->loops);
+	}
+	cvSetData(&v->image, v->map + v->offsets[v->next++],
+		  v->width * v->channels);
+	return 0;
+}
+
+static void *videofile_retrieve(struct imager *i)
+{
+	return &i->params.file->image;
+}
+
+static enum capture_format videofile_format(struct imager *i)
+{
+	return i->params.file->channels == 1 ?
+		CAPTURE_FORMAT_GRAY : CAPTURE_FORMAT_BGR;
+}
+
+static int videofile_set_fps(struct imager *i, int fps)
+{
+	i->params.file->fps = fps;
+	timespec_zero(&i->params.file->due);
+	return 0;
+}
+
+const struct capture_source videofile_source = {
+	.name = "file",
+	.stable = 1,
+	.open = videofile_open,
+	.grab = videofile_grab,
+	.retrieve = videofile_retrieve,
+	.format = videofile_format,
+	.set_fps = videofile_set_fps,
+	.close = videofile_close,
+};
+
+#endif /* HAVE_OPENCV2 */
@@ -0,0 +1,48 @@
+#ifndef __VIDEOFILE_H_
+#define __VIDEOFILE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "capture.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(HAVE_OPENCV2)
+
+/*
+ * A video file mapped in memory, as a capture source. Frames are handed
+ * out where they lie in the mapping: packed BGR or gray for raw files,
+ * the luma plane (gray) for Y4M and raw YUV 4:2:0 (i420, nv12). The
+ * mapping is read-only: consumers that draw do so on copies of their own.
+ */
+struct videofile {
+	const char *path;
+	int fd;
+	unsigned char *map;
+	size_t len;
+	int width;
+	int height;
+	int channels;
+	/* where each frame's pixels start */
+	off_t *offsets;
+	unsigned long nframes;
+	unsigned long next;
+	unsigned long loops;
+	/* 0: as fast as frames are asked for */
+	int fps;
+	struct timespec due;
+	IplImage image;
+};
+
+extern const struct capture_source videofile_source;
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __VIDEOFILE_H_ */
@@ -115,5 +115,20 @@ static inline unsigned long timespec_msecs(struct timespec *t)
 		t->tv_nsec / FLL_NANOSECONDS_IN_MILISECOND);
 }
 
+static inline unsigned long long timespec_nsecs(const struct timespec *t)
+{
+	return ((unsigned long long)t->tv_sec * FLL_NANOSECONDS_IN_SECOND +
+		t->tv_nsec);
+}
+
+/* nanoseconds from t1 to t2, 0 if t2 is older */
+static inline unsigned long long timespec_delta(const struct timespec *t1,
+						const struct timespec *t2)
+{
+	unsigned long long n1 = timespec_nsecs(t1), n2 = timespec_nsecs(t2);
+
+	return n2 > n1 ? n2 - n1 : 0;
+}
+
 
 #endif